@@ -5,11 +5,325 @@
 #include <map>
 #include <fstream>
 #include <algorithm> // For std::reverse
+#include <mutex>
+#include <thread>
+#include <future>
+#include <functional>
+#include <condition_variable>
+#include <deque>
+#include <unordered_map>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <filesystem>
+#include <cstdint>
+#include <cmath>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <linux/perf_event.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 // Define MAX for binary conversions, though a dynamic approach is better.
 // Assuming 16 bits is sufficient for character codes
 const int MAX_CODE_LENGTH = 16;
 
+// Size of the blocks files are streamed through. Must be a multiple of DIRECT_IO_ALIGNMENT.
+const size_t IO_BLOCK_SIZE = 1 << 20;
+
+// O_DIRECT requires buffer addresses, file offsets and transfer sizes to be aligned to the
+// device's logical block size. 4096 covers every device we care about.
+const size_t DIRECT_IO_ALIGNMENT = 4096;
+
+// --- Instrumentation: per-stage timers and counters ---
+// Every stage is timed with the CPU timestamp counter where available. Timers nest: starting a
+// stage pauses the one running on the same thread, so the per-stage times are exclusive (e.g.
+// time spent waiting on reads inside encoding is charged to "read", not "encode"). Totals are
+// process-wide and safe to update from worker threads.
+enum Stage {
+    STAGE_READ,
+    STAGE_COUNT,
+    STAGE_BUILD_TREE,
+    STAGE_GENERATE_CODES,
+    STAGE_PARSE, // LZ match finding and parsing
+    STAGE_ENCODE,
+    STAGE_DECODE,
+    STAGE_COPY, // LZ literal and match copies
+    STAGE_WRITE,
+    STAGE_COUNT_
+};
+
+const char* const STAGE_NAMES[STAGE_COUNT_] = {"read", "count", "build_tree", "generate_codes", "parse", "encode", "decode", "copy", "write"};
+
+enum Counter {
+    COUNTER_BYTES_READ,      // Bytes returned by file reads
+    COUNTER_BYTES_WRITTEN,   // Bytes handed to file writes
+    COUNTER_BYTES_IN,        // Uncompressed bytes fed to the encoder
+    COUNTER_BYTES_OUT,       // Compressed bytes produced by the encoder
+    COUNTER_SYMBOLS_ENCODED,
+    COUNTER_SYMBOLS_DECODED,
+    COUNTER_TREE_BUILDS,
+    COUNTER_CODE_TABLES,
+    COUNTER_PAIR_TABLES,       // Symbol-pair encode tables built
+    COUNTER_HUGE_PAGE_BYTES,   // Bytes mapped with MAP_HUGETLB
+    COUNTER_THP_ADVISED_BYTES, // Bytes mapped with MADV_HUGEPAGE because MAP_HUGETLB failed
+    COUNTER_LONG_MATCH_BYTES,  // Bytes covered by long-distance matches
+    COUNTER_BLOCKS_SKIPPED,    // Blocks search ruled out without decoding them
+    COUNTER_SUBTABLE_LOOKUPS,  // Symbols decoded with a second, subtable lookup
+    COUNTER_TABLE_FALLBACKS,   // Symbols decoded without the tables, bit by bit or by code search
+    COUNTER_COUNT_
+};
+
+const char* const COUNTER_NAMES[COUNTER_COUNT_] = {"bytes_read", "bytes_written", "bytes_in", "bytes_out",
+                                                    "symbols_encoded", "symbols_decoded", "tree_builds", "code_tables", "pair_tables",
+                                                    "huge_page_bytes", "thp_advised_bytes", "long_match_bytes", "blocks_skipped",
+                                                    "subtable_lookups", "table_fallbacks"};
+
+inline uint64_t readTicks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+struct CodecStats {
+    std::atomic<uint64_t> stageTicks[STAGE_COUNT_] = {};
+    std::atomic<uint64_t> stageCalls[STAGE_COUNT_] = {};
+    std::atomic<uint64_t> counters[COUNTER_COUNT_] = {};
+    uint64_t startTicks = readTicks();
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+};
+
+CodecStats& codecStats() {
+    static CodecStats stats;
+    return stats;
+}
+
+inline void countStat(Counter counter, uint64_t amount) {
+    codecStats().counters[counter].fetch_add(amount, std::memory_order_relaxed);
+}
+
+void resetCodecStats() {
+    CodecStats& stats = codecStats();
+    for (int i = 0; i < STAGE_COUNT_; ++i) {
+        stats.stageTicks[i] = 0;
+        stats.stageCalls[i] = 0;
+    }
+    for (auto& counter : stats.counters) {
+        counter = 0;
+    }
+    stats.startTicks = readTicks();
+    stats.startTime = std::chrono::steady_clock::now();
+}
+
+// --- Timeline tracing (Chrome trace / Perfetto JSON) ---
+// When enabled, every StageTimer also records a begin/end event, tagged with the block being
+// processed, into a fixed-size ring buffer owned by the recording thread. Recording takes no
+// locks; when a ring is full the oldest events are overwritten. exportTrace() must only run
+// once the worker threads are idle.
+const size_t TRACE_RING_CAPACITY = 1 << 16;
+
+struct TraceEvent {
+    uint8_t stage;
+    int64_t block; // -1 when not inside a TraceBlock
+    uint64_t beginTicks;
+    uint64_t endTicks;
+};
+
+struct TraceRing {
+    std::string threadName;
+    std::vector<TraceEvent> events = std::vector<TraceEvent>(TRACE_RING_CAPACITY);
+    uint64_t recorded = 0; // Total events ever recorded; the ring holds the last CAPACITY
+};
+
+std::atomic<bool> traceEnabled{false};
+
+struct TraceRegistry {
+    std::mutex lock;
+    std::vector<std::shared_ptr<TraceRing>> rings;
+};
+
+TraceRegistry& traceRegistry() {
+    static TraceRegistry registry;
+    return registry;
+}
+
+// The calling thread's ring, registered on first use.
+TraceRing& threadTraceRing() {
+    thread_local std::shared_ptr<TraceRing> ring = [] {
+        auto created = std::make_shared<TraceRing>();
+        TraceRegistry& registry = traceRegistry();
+        std::lock_guard<std::mutex> guard(registry.lock);
+        created->threadName = "thread " + std::to_string(registry.rings.size());
+        registry.rings.push_back(created);
+        return created;
+    }();
+    return *ring;
+}
+
+// Names the calling thread in the exported trace.
+void setTraceThreadName(const std::string& name) {
+    if (traceEnabled.load(std::memory_order_relaxed)) {
+        threadTraceRing().threadName = name;
+    }
+}
+
+int64_t& currentTraceBlock() {
+    thread_local int64_t block = -1;
+    return block;
+}
+
+// Tags the events recorded on this thread while in scope with a block (or entry/chunk) number.
+class TraceBlock {
+public:
+    explicit TraceBlock(int64_t block) : previous_(currentTraceBlock()) {
+        currentTraceBlock() = block;
+    }
+
+    ~TraceBlock() {
+        currentTraceBlock() = previous_;
+    }
+
+    TraceBlock(const TraceBlock&) = delete;
+    TraceBlock& operator=(const TraceBlock&) = delete;
+
+private:
+    int64_t previous_;
+};
+
+inline void recordTraceEvent(Stage stage, uint64_t beginTicks, uint64_t endTicks) {
+    TraceRing& ring = threadTraceRing();
+    ring.events[ring.recorded % TRACE_RING_CAPACITY] = TraceEvent{static_cast<uint8_t>(stage), currentTraceBlock(), beginTicks, endTicks};
+    ++ring.recorded;
+}
+
+class StageTimer {
+public:
+    explicit StageTimer(Stage stage) : stage_(stage), parent_(current()) {
+        start_ = begin_ = readTicks();
+        if (parent_) {
+            parent_->charge(start_);
+        }
+        current() = this;
+    }
+
+    ~StageTimer() {
+        uint64_t now = readTicks();
+        charge(now);
+        codecStats().stageCalls[stage_].fetch_add(1, std::memory_order_relaxed);
+        if (traceEnabled.load(std::memory_order_relaxed)) {
+            recordTraceEvent(stage_, begin_, now);
+        }
+        current() = parent_;
+        if (parent_) {
+            parent_->start_ = now;
+        }
+    }
+
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+
+private:
+    void charge(uint64_t now) {
+        codecStats().stageTicks[stage_].fetch_add(now - start_, std::memory_order_relaxed);
+    }
+
+    static StageTimer*& current() {
+        thread_local StageTimer* active = nullptr;
+        return active;
+    }
+
+    Stage stage_;
+    StageTimer* parent_;
+    uint64_t begin_;
+    uint64_t start_; // Start of the current uninterrupted stretch
+};
+
+// Ticks per nanosecond, measured against the steady clock since the stats were last reset.
+double ticksPerNanosecond() {
+    const CodecStats& stats = codecStats();
+    double nanoseconds = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - stats.startTime).count();
+    uint64_t ticks = readTicks() - stats.startTicks;
+    return nanoseconds > 0 && ticks > 0 ? ticks / nanoseconds : 1.0;
+}
+
+// --- Write the recorded events as Chrome trace JSON ---
+// Open the file in chrome://tracing or ui.perfetto.dev. Nested stages show as nested slices.
+bool exportTrace(const std::string& path) {
+    std::ofstream out(path);
+    if (!out.is_open()) {
+        return false;
+    }
+    const CodecStats& stats = codecStats();
+    double ticksPerMicrosecond = ticksPerNanosecond() * 1000.0;
+    TraceRegistry& registry = traceRegistry();
+    std::lock_guard<std::mutex> guard(registry.lock);
+
+    out << "{\"traceEvents\":[";
+    bool first = true;
+    for (size_t tid = 0; tid < registry.rings.size(); ++tid) {
+        const TraceRing& ring = *registry.rings[tid];
+        out << (first ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << tid
+            << ",\"args\":{\"name\":\"" << ring.threadName << "\"}}";
+        first = false;
+        uint64_t oldest = ring.recorded > TRACE_RING_CAPACITY ? ring.recorded - TRACE_RING_CAPACITY : 0;
+        for (uint64_t i = oldest; i < ring.recorded; ++i) {
+            const TraceEvent& event = ring.events[i % TRACE_RING_CAPACITY];
+            if (event.beginTicks < stats.startTicks) {
+                continue; // Recorded before the last reset
+            }
+            out << ",\n{\"name\":\"" << STAGE_NAMES[event.stage] << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << tid
+                << ",\"ts\":" << (event.beginTicks - stats.startTicks) / ticksPerMicrosecond
+                << ",\"dur\":" << (event.endTicks - event.beginTicks) / ticksPerMicrosecond;
+            if (event.block >= 0) {
+                out << ",\"args\":{\"block\":" << event.block << "}";
+            }
+            out << "}";
+        }
+    }
+    out << "\n],\"displayTimeUnit\":\"ms\"}" << std::endl;
+    return out.good();
+}
+
+void printCodecStats(std::ostream& out, bool json) {
+    const CodecStats& stats = codecStats();
+    double scale = ticksPerNanosecond();
+    uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - stats.startTime).count();
+    if (json) {
+        out << "{\"elapsed_ns\":" << elapsed << ",\"stages\":{";
+        for (int i = 0; i < STAGE_COUNT_; ++i) {
+            out << (i ? "," : "") << "\"" << STAGE_NAMES[i] << "\":{\"ns\":"
+                << static_cast<uint64_t>(stats.stageTicks[i] / scale) << ",\"calls\":" << stats.stageCalls[i] << "}";
+        }
+        out << "},\"counters\":{";
+        for (int i = 0; i < COUNTER_COUNT_; ++i) {
+            out << (i ? "," : "") << "\"" << COUNTER_NAMES[i] << "\":" << stats.counters[i];
+        }
+        out << "}}" << std::endl;
+        return;
+    }
+    out << "elapsed: " << elapsed / 1e6 << " ms" << std::endl;
+    for (int i = 0; i < STAGE_COUNT_; ++i) {
+        out << "  " << STAGE_NAMES[i] << ": " << stats.stageTicks[i] / scale / 1e6 << " ms in " << stats.stageCalls[i] << " call(s)" << std::endl;
+    }
+    for (int i = 0; i < COUNTER_COUNT_; ++i) {
+        out << "  " << COUNTER_NAMES[i] << ": " << stats.counters[i] << std::endl;
+    }
+}
+
 // --- Huffman Tree Node Structure ---
 struct Node {
     char character;
@@ -48,23 +362,29 @@ struct CompareNodes {
 std::map<char, std::string> huffmanCodes;
 
 // --- Function to build Huffman codes recursively ---
-void generateCodes(Node* root, std::string code) {
+void generateCodes(Node* root, std::string code, std::map<char, std::string>& codes = huffmanCodes) {
     if (!root) {
         return;
     }
 
     if (root->isLeaf()) {
-        huffmanCodes[root->character] = code;
+        // A tree with a single symbol still needs a one-bit code.
+        codes[root->character] = code.empty() ? "0" : code;
         return;
     }
 
-    generateCodes(root->left, code + "0");
-    generateCodes(root->right, code + "1");
+    generateCodes(root->left, code + "0", codes);
+    generateCodes(root->right, code + "1", codes);
 }
 
 // --- Function to build Huffman Tree ---
 Node* buildHuffmanTree(const std::map<char, int>& frequencies) {
+    StageTimer timer(STAGE_BUILD_TREE);
+    countStat(COUNTER_TREE_BUILDS, 1);
     std::priority_queue<Node*, std::vector<Node*>, CompareNodes> minHeap;
+    if (frequencies.empty()) {
+        return nullptr; // Empty input has no tree
+    }
 
     // Create a leaf node for each character and add to min-heap
     for (auto const& [character, freq] : frequencies) {
@@ -115,218 +435,6993 @@ std::string decimalToBinary(int dec, int length) {
     return bin;
 }
 
-// --- Compression Function ---
-void compressFile(const std::string& inputFile, const std::string& outputFile, Node* huffmanRoot) {
-    std::ifstream ifs(inputFile, std::ios::binary);
-    std::ofstream ofs(outputFile, std::ios::binary);
+// --- Pool of aligned I/O buffers ---
+// Buffers are allocated once, aligned for O_DIRECT, and handed back to the pool on release,
+// so streaming a file (or many files in a row) never reallocates per block.
+class BufferPool {
+public:
+    explicit BufferPool(size_t bufferSize) : bufferSize_(bufferSize) {}
 
-    if (!ifs.is_open() || !ofs.is_open()) {
-        std::cerr << "Error opening files for compression." << std::endl;
-        return;
+    ~BufferPool() {
+        for (unsigned char* buffer : allBuffers_) {
+            std::free(buffer);
+        }
     }
 
-    // --- Write Huffman Tree metadata to output file ---
-    // This is a simplified way to store the tree for decompression.
-    // A more robust method would involve serializing the tree structure itself.
-    // Here, we'll write character, code length, and decimal representation of code.
-    // The number of unique characters needs to be written first.
-    int uniqueCharCount = huffmanCodes.size();
-    ofs.write(reinterpret_cast<const char*>(&uniqueCharCount), sizeof(int));
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
 
-    for (auto const& [character, code] : huffmanCodes) {
-        ofs.write(reinterpret_cast<const char*>(&character), sizeof(char));
-        int codeLength = code.length();
-        ofs.write(reinterpret_cast<const char*>(&codeLength), sizeof(int));
-        int decimalCode = binaryToDecimal(code);
-        ofs.write(reinterpret_cast<const char*>(&decimalCode), sizeof(int));
+    unsigned char* acquire() {
+        std::lock_guard<std::mutex> guard(lock_);
+        if (!freeBuffers_.empty()) {
+            unsigned char* buffer = freeBuffers_.back();
+            freeBuffers_.pop_back();
+            return buffer;
+        }
+        void* memory = nullptr;
+        if (posix_memalign(&memory, DIRECT_IO_ALIGNMENT, bufferSize_) != 0) {
+            return nullptr;
+        }
+        allBuffers_.push_back(static_cast<unsigned char*>(memory));
+        return static_cast<unsigned char*>(memory);
     }
 
-    // --- Write compressed data ---
-    std::string bitBuffer = "";
-    char ch;
-    while (ifs.get(ch)) {
-        bitBuffer += huffmanCodes[ch];
-        // Write full bytes to file
-        while (bitBuffer.length() >= 8) {
-            unsigned char byte = static_cast<unsigned char>(binaryToDecimal(bitBuffer.substr(0, 8)));
-            ofs.write(reinterpret_cast<const char*>(&byte), sizeof(unsigned char));
-            bitBuffer = bitBuffer.substr(8);
+    void release(unsigned char* buffer) {
+        if (!buffer) {
+            return;
         }
+        std::lock_guard<std::mutex> guard(lock_);
+        freeBuffers_.push_back(buffer);
     }
 
-    // Handle any remaining bits (pad with zeros to form a full byte)
-    if (!bitBuffer.empty()) {
-        int paddingBits = 8 - bitBuffer.length();
-        for (int i = 0; i < paddingBits; ++i) {
-            bitBuffer += '0'; // Pad with zeros
+    size_t bufferSize() const {
+        return bufferSize_;
+    }
+
+    uint64_t allocatedBytes() {
+        std::lock_guard<std::mutex> guard(lock_);
+        return static_cast<uint64_t>(allBuffers_.size()) * bufferSize_;
+    }
+
+private:
+    size_t bufferSize_;
+    std::vector<unsigned char*> allBuffers_;
+    std::vector<unsigned char*> freeBuffers_;
+    std::mutex lock_;
+};
+
+// Process-wide pool shared by every reader and writer.
+BufferPool& ioBufferPool() {
+    static BufferPool pool(IO_BLOCK_SIZE);
+    return pool;
+}
+
+// --- Open a file, optionally bypassing the page cache ---
+// If O_DIRECT is requested but the filesystem rejects it (tmpfs, some overlays), fall back to
+// buffered I/O; callers then drop the pages they touched with posix_fadvise instead.
+int openFile(const std::string& path, int flags, bool directIO, bool& isDirect) {
+    isDirect = false;
+    if (directIO) {
+        int fd = open(path.c_str(), flags | O_DIRECT, 0644);
+        if (fd >= 0) {
+            isDirect = true;
+            return fd;
+        }
+        if (errno != EINVAL) {
+            return -1;
         }
-        unsigned char byte = static_cast<unsigned char>(binaryToDecimal(bitBuffer.substr(0, 8)));
-        ofs.write(reinterpret_cast<const char*>(&byte), sizeof(unsigned char));
+    }
+    return open(path.c_str(), flags, 0644);
+}
 
-        // Optionally, write the number of padding bits as metadata for proper decompression
-        ofs.write(reinterpret_cast<const char*>(&paddingBits), sizeof(int));
-    } else {
-        // If the last byte was exactly 8 bits, and no padding was needed, still write 0 padding.
-        int paddingBits = 0;
-        ofs.write(reinterpret_cast<const char*>(&paddingBits), sizeof(int));
+// --- A run of real data in a sparse file ---
+struct FileExtent {
+    uint64_t offset;
+    uint64_t length;
+};
+
+// --- Find the data extents of a file with SEEK_DATA/SEEK_HOLE ---
+// Holes are skipped without being read. Filesystems without hole support report the whole file
+// as a single extent.
+bool findDataExtents(int fd, uint64_t fileSize, std::vector<FileExtent>& extents) {
+    extents.clear();
+    off_t position = 0;
+    while (static_cast<uint64_t>(position) < fileSize) {
+        off_t dataStart = lseek(fd, position, SEEK_DATA);
+        if (dataStart < 0) {
+            if (errno == ENXIO) {
+                break; // Only a hole remains
+            }
+            extents.assign(1, FileExtent{0, fileSize}); // SEEK_DATA unsupported
+            return true;
+        }
+        off_t holeStart = lseek(fd, dataStart, SEEK_HOLE);
+        if (holeStart < 0) {
+            holeStart = fileSize;
+        }
+        extents.push_back(FileExtent{static_cast<uint64_t>(dataStart), static_cast<uint64_t>(holeStart - dataStart)});
+        position = holeStart;
     }
+    return true;
+}
 
-    ifs.close();
-    ofs.close();
-    std::cout << "File compressed successfully." << std::endl;
+// --- Read exactly `length` bytes at `offset`; false on a read error or end of file ---
+bool preadFully(int fd, void* destination, size_t length, uint64_t offset) {
+    unsigned char* out = static_cast<unsigned char*>(destination);
+    size_t done = 0;
+    while (done < length) {
+        ssize_t got = pread(fd, out + done, length - done, offset + done);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        done += got;
+    }
+    return true;
 }
 
-// --- Decompression Function ---
-void decompressFile(const std::string& compressedFile, const std::string& decompressedFile) {
-    std::ifstream ifs(compressedFile, std::ios::binary);
-    std::ofstream ofs(decompressedFile, std::ios::binary);
+// --- Map a range of the extents' concatenated data onto file offsets ---
+// Calls visit(fileOffset, length) for each piece of [position, position + length) in order;
+// false if the range runs past the last extent or a visit fails.
+template <typename Visit>
+bool forEachExtentRange(const std::vector<FileExtent>& extents, uint64_t position, uint64_t length, Visit visit) {
+    for (const FileExtent& extent : extents) {
+        if (length == 0) {
+            break;
+        }
+        if (position >= extent.length) {
+            position -= extent.length;
+            continue;
+        }
+        uint64_t chunk = std::min(length, extent.length - position);
+        if (!visit(extent.offset + position, chunk)) {
+            return false;
+        }
+        position = 0;
+        length -= chunk;
+    }
+    return length == 0;
+}
 
-    if (!ifs.is_open() || !ofs.is_open()) {
-        std::cerr << "Error opening files for decompression." << std::endl;
-        return;
+// --- Sequential block reader ---
+// Reads the file one IO_BLOCK_SIZE block at a time into a pooled buffer and serves bytes from it.
+// With skipHoles the file is read as the concatenation of its data extents, so holes in sparse
+// files are never read.
+class BlockReader {
+public:
+    BlockReader() = default;
+
+    ~BlockReader() {
+        close();
     }
 
-    // --- Rebuild Huffman Tree from metadata ---
-    int uniqueCharCount;
-    ifs.read(reinterpret_cast<char*>(&uniqueCharCount), sizeof(int));
+    BlockReader(const BlockReader&) = delete;
+    BlockReader& operator=(const BlockReader&) = delete;
 
-    std::map<std::string, char> huffmanDecodingMap;
-    Node* huffmanRoot = new Node(0, nullptr, nullptr); // Dummy root for building
+    bool open(const std::string& path, bool directIO = false, bool skipHoles = false) {
+        close();
+        path_ = path;
+        dropCache_ = directIO;
+        fd_ = openFile(path, O_RDONLY, directIO, isDirect_);
+        if (fd_ < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd_, &st) != 0) {
+            close();
+            return false;
+        }
+        fileSize_ = st.st_size;
+        if (skipHoles) {
+            findDataExtents(fd_, fileSize_, extents_);
+        } else {
+            extents_.assign(1, FileExtent{0, fileSize_});
+        }
+        dataSize_ = 0;
+        for (const FileExtent& extent : extents_) {
+            dataSize_ += extent.length;
+        }
+        buffer_ = ioBufferPool().acquire();
+        if (!buffer_) {
+            close();
+            return false;
+        }
+        return true;
+    }
 
-    for (int i = 0; i < uniqueCharCount; ++i) {
-        char character;
-        int codeLength;
-        int decimalCode;
+    bool is_open() const {
+        return fd_ >= 0;
+    }
 
-        ifs.read(reinterpret_cast<char*>(&character), sizeof(char));
-        ifs.read(reinterpret_cast<char*>(&codeLength), sizeof(int));
-        ifs.read(reinterpret_cast<char*>(&decimalCode), sizeof(int));
+    // Apparent size of the file, holes included.
+    unsigned long long size() const {
+        return fileSize_;
+    }
 
-        std::string code = decimalToBinary(decimalCode, codeLength);
-        huffmanDecodingMap[code] = character;
+    // The extents being read; a single extent covering the file unless skipHoles found holes.
+    const std::vector<FileExtent>& dataExtents() const {
+        return extents_;
+    }
 
-        // Rebuild tree structure from codes
-        Node* current = huffmanRoot;
-        for (char bit : code) {
-            if (bit == '0') {
-                if (!current->left) {
-                    current->left = new Node(0, nullptr, nullptr);
-                }
-                current = current->left;
-            } else { // bit == '1'
-                if (!current->right) {
-                    current->right = new Node(0, nullptr, nullptr);
-                }
-                current = current->right;
+    bool hasHoles() const {
+        return dataSize_ < fileSize_;
+    }
+
+    // Bytes not yet consumed.
+    unsigned long long remaining() const {
+        return dataSize_ - bufferStart_ - position_;
+    }
+
+    // Next byte of the file; false at end of file or on a read error.
+    bool get(unsigned char& byte) {
+        if (position_ == filled_ && !fill()) {
+            return false;
+        }
+        byte = buffer_[position_++];
+        return true;
+    }
+
+    // Copies exactly `length` bytes; false if the file ends first.
+    bool read(void* destination, size_t length) {
+        unsigned char* out = static_cast<unsigned char*>(destination);
+        while (length > 0) {
+            if (position_ == filled_ && !fill()) {
+                return false;
             }
+            size_t chunk = std::min(length, filled_ - position_);
+            std::memcpy(out, buffer_ + position_, chunk);
+            position_ += chunk;
+            out += chunk;
+            length -= chunk;
+        }
+        return true;
+    }
+
+    // Copies the next `length` bytes without consuming them. Only valid at the start of the file.
+    bool peek(void* destination, size_t length) {
+        if (position_ == filled_ && !fill()) {
+            return false;
+        }
+        if (filled_ - position_ < length) {
+            return false;
+        }
+        std::memcpy(destination, buffer_ + position_, length);
+        return true;
+    }
+
+    // Copies `length` bytes from stream position `position`, anywhere in the file and without
+    // moving the read position. Uses a second, buffered descriptor so it works under O_DIRECT.
+    bool readAt(uint64_t position, void* destination, size_t length) {
+        if (historyFd_ < 0 && (historyFd_ = ::open(path_.c_str(), O_RDONLY)) < 0) {
+            return false;
+        }
+        StageTimer timer(STAGE_READ);
+        countStat(COUNTER_BYTES_READ, length);
+        unsigned char* out = static_cast<unsigned char*>(destination);
+        return forEachExtentRange(extents_, position, length, [&](uint64_t offset, uint64_t chunk) {
+            bool ok = preadFully(historyFd_, out, chunk, offset);
+            out += chunk;
+            return ok;
+        });
+    }
+
+    void close() {
+        if (fd_ >= 0) {
+            ::close(fd_);
+            fd_ = -1;
         }
-        current->character = character; // Mark the leaf node
+        if (historyFd_ >= 0) {
+            ::close(historyFd_);
+            historyFd_ = -1;
+        }
+        ioBufferPool().release(buffer_);
+        buffer_ = nullptr;
+        position_ = filled_ = 0;
+        bufferStart_ = 0;
+        extentIndex_ = 0;
+        extentDone_ = 0;
     }
 
-    // Read padding information (last int in the file)
-    ifs.seekg(-sizeof(int), std::ios::end); // Move to the end minus size of int
-    int paddingBits;
-    ifs.read(reinterpret_cast<char*>(&paddingBits), sizeof(int));
-    ifs.seekg(sizeof(int) + uniqueCharCount * (sizeof(char) + 2 * sizeof(int)), std::ios::beg); // Move back to start of compressed data
+private:
+    // Loads the next block of the current extent. Extents start on filesystem block boundaries and
+    // blocks are whole multiples of the alignment, so reads stay aligned for O_DIRECT; only a
+    // request running past end of file is short.
+    bool fill() {
+        if (fd_ < 0) {
+            return false;
+        }
+        while (extentIndex_ < extents_.size() && extentDone_ == extents_[extentIndex_].length) {
+            ++extentIndex_;
+            extentDone_ = 0;
+        }
+        if (extentIndex_ == extents_.size()) {
+            return false;
+        }
+        StageTimer timer(STAGE_READ);
+        const FileExtent& extent = extents_[extentIndex_];
+        off_t offset = extent.offset + extentDone_;
+        size_t wanted = std::min<uint64_t>(IO_BLOCK_SIZE, extent.length - extentDone_);
+        size_t request = (wanted + DIRECT_IO_ALIGNMENT - 1) / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+        ssize_t got;
+        do {
+            got = pread(fd_, buffer_, request, offset);
+        } while (got < 0 && errno == EINTR);
+        if (got <= 0) {
+            return false;
+        }
+        got = std::min<size_t>(got, wanted);
+        countStat(COUNTER_BYTES_READ, got);
+        if (dropCache_ && !isDirect_) {
+            posix_fadvise(fd_, offset, got, POSIX_FADV_DONTNEED);
+        }
+        extentDone_ += got;
+        bufferStart_ += filled_;
+        position_ = 0;
+        filled_ = static_cast<size_t>(got);
+        return true;
+    }
 
+    std::string path_;
+    int fd_ = -1;
+    int historyFd_ = -1; // Buffered descriptor for readAt
+    bool isDirect_ = false;
+    bool dropCache_ = false;
+    unsigned char* buffer_ = nullptr;
+    size_t position_ = 0;
+    size_t filled_ = 0;
+    unsigned long long bufferStart_ = 0; // Stream position of buffer_[0]
+    unsigned long long fileSize_ = 0;
+    unsigned long long dataSize_ = 0;
+    std::vector<FileExtent> extents_;
+    size_t extentIndex_ = 0;
+    uint64_t extentDone_ = 0;
+};
 
-    // --- Decompress data ---
-    unsigned char byte;
-    std::string bitStream = "";
-    Node* current = huffmanRoot;
+// --- Sequential block writer ---
+// Collects output in a pooled buffer and writes it out in whole IO_BLOCK_SIZE blocks. Under
+// O_DIRECT the short final block is padded to the alignment and the file truncated back.
+class BlockWriter {
+public:
+    BlockWriter() = default;
 
-    // Read all bytes except the last one (which contains padding info)
-    std::vector<unsigned char> compressedBytes;
-    char tempByte;
-    while(ifs.get(tempByte)) {
-        compressedBytes.push_back(static_cast<unsigned char>(tempByte));
+    ~BlockWriter() {
+        close();
     }
 
-    // Process all bytes except the last one (which holds padding information)
-    for (size_t i = 0; i < compressedBytes.size(); ++i) {
-        byte = compressedBytes[i];
-        bitStream += decimalToBinary(byte, 8);
+    BlockWriter(const BlockWriter&) = delete;
+    BlockWriter& operator=(const BlockWriter&) = delete;
+
+    bool open(const std::string& path, bool directIO = false) {
+        close();
+        path_ = path;
+        dropCache_ = directIO;
+        failed_ = false;
+        fd_ = openFile(path, O_WRONLY | O_CREAT | O_TRUNC, directIO, isDirect_);
+        if (fd_ < 0) {
+            return false;
+        }
+        buffer_ = ioBufferPool().acquire();
+        if (!buffer_) {
+            close();
+            return false;
+        }
+        return true;
     }
-    
-    // Remove padding from the last byte
-    if (compressedBytes.size() > 0) {
-        bitStream.resize(bitStream.length() - paddingBits);
+
+    bool is_open() const {
+        return fd_ >= 0;
     }
 
-    for (char bit : bitStream) {
-        if (bit == '0') {
-            current = current->left;
-        } else {
-            current = current->right;
+    void put(unsigned char byte) {
+        if (filled_ == IO_BLOCK_SIZE) {
+            flush(IO_BLOCK_SIZE);
         }
+        buffer_[filled_++] = byte;
+    }
 
-        if (current->isLeaf()) {
-            ofs.put(current->character);
-            current = huffmanRoot; // Reset to root for next code
+    void write(const void* data, size_t length) {
+        const unsigned char* in = static_cast<const unsigned char*>(data);
+        while (length > 0) {
+            if (filled_ == IO_BLOCK_SIZE) {
+                flush(IO_BLOCK_SIZE);
+            }
+            size_t chunk = std::min(length, IO_BLOCK_SIZE - filled_);
+            std::memcpy(buffer_ + filled_, in, chunk);
+            filled_ += chunk;
+            in += chunk;
+            length -= chunk;
         }
     }
 
-    delete huffmanRoot; // Clean up the rebuilt tree
-    ifs.close();
-    ofs.close();
-    std::cout << "File decompressed successfully." << std::endl;
-}
+    // Sets the final file size up front. Everything not written afterwards stays a hole.
+    bool reserve(uint64_t size) {
+        if (ftruncate(fd_, size) != 0) {
+            failed_ = true;
+            return false;
+        }
+        minimumSize_ = size;
+        return true;
+    }
 
-// --- Main function for demonstration ---
-int main() {
-    std::string inputFileName = "input.txt";
-    std::string compressedFileName = "compressed.bin";
-    std::string decompressedFileName = "decompressed.txt";
+    // Continues writing at `offset`, leaving any gap as a hole.
+    void seek(uint64_t offset) {
+        if (filled_ > 0) {
+            if (isDirect_ && (filled_ % DIRECT_IO_ALIGNMENT != 0 || offset % DIRECT_IO_ALIGNMENT != 0)) {
+                leaveDirectMode(); // Unaligned extent boundary: finish with buffered I/O
+            }
+            flush(filled_);
+        }
+        if (isDirect_ && offset % DIRECT_IO_ALIGNMENT != 0) {
+            leaveDirectMode();
+        }
+        fileOffset_ = offset;
+    }
 
-    // Create a dummy input file for testing
-    std::ofstream testInput(inputFileName);
-    if (testInput.is_open()) {
-        testInput << "this is a test string for huffman coding. a simple test to see if it works.";
-        testInput.close();
-        std::cout << "Created " << inputFileName << std::endl;
-    } else {
-        std::cerr << "Error creating input.txt" << std::endl;
-        return 1;
+    // Copies `length` already written bytes from file offset `offset`: the unflushed tail comes
+    // from the buffer, the rest is read back through a second, buffered descriptor.
+    bool readBack(uint64_t offset, void* destination, size_t length) {
+        unsigned char* out = static_cast<unsigned char*>(destination);
+        uint64_t flushedEnd = fileOffset_;
+        if (offset < flushedEnd) {
+            if (historyFd_ < 0 && (historyFd_ = ::open(path_.c_str(), O_RDONLY)) < 0) {
+                return false;
+            }
+            size_t chunk = std::min<uint64_t>(length, flushedEnd - offset);
+            StageTimer timer(STAGE_READ);
+            countStat(COUNTER_BYTES_READ, chunk);
+            if (!preadFully(historyFd_, out, chunk, offset)) {
+                return false;
+            }
+            out += chunk;
+            offset += chunk;
+            length -= chunk;
+        }
+        if (length > 0) {
+            if (offset + length > flushedEnd + filled_) {
+                return false; // Not written yet
+            }
+            std::memcpy(out, buffer_ + (offset - flushedEnd), length);
+        }
+        return true;
     }
 
-    // --- Step 1: Calculate character frequencies ---
-    std::map<char, int> frequencies;
-    std::ifstream ifs(inputFileName, std::ios::binary);
-    if (!ifs.is_open()) {
-        std::cerr << "Error opening " << inputFileName << std::endl;
-        return 1;
+    // Flushes the tail and closes the file; false if any write failed.
+    bool close() {
+        if (historyFd_ >= 0) {
+            ::close(historyFd_);
+            historyFd_ = -1;
+        }
+        if (fd_ < 0) {
+            return !failed_;
+        }
+        off_t logicalSize = fileOffset_ + filled_;
+        if (filled_ > 0) {
+            if (isDirect_) {
+                size_t aligned = (filled_ + DIRECT_IO_ALIGNMENT - 1) / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+                std::memset(buffer_ + filled_, 0, aligned - filled_);
+                filled_ = aligned;
+            }
+            flush(filled_);
+        }
+        if ((isDirect_ || minimumSize_ > 0) &&
+            ftruncate(fd_, std::max<uint64_t>(logicalSize, minimumSize_)) != 0) {
+            failed_ = true;
+        }
+        if (::close(fd_) != 0) {
+            failed_ = true;
+        }
+        fd_ = -1;
+        ioBufferPool().release(buffer_);
+        buffer_ = nullptr;
+        filled_ = 0;
+        fileOffset_ = 0;
+        minimumSize_ = 0;
+        return !failed_;
     }
-    char ch;
-    while (ifs.get(ch)) {
-        frequencies[ch]++;
+
+private:
+    void leaveDirectMode() {
+        int flags = fcntl(fd_, F_GETFL);
+        if (flags >= 0 && fcntl(fd_, F_SETFL, flags & ~O_DIRECT) == 0) {
+            isDirect_ = false;
+        }
     }
-    ifs.close();
 
-    // --- Step 2: Build Huffman Tree ---
-    Node* huffmanRoot = buildHuffmanTree(frequencies);
+    void flush(size_t length) {
+        StageTimer timer(STAGE_WRITE);
+        countStat(COUNTER_BYTES_WRITTEN, length);
+        size_t done = 0;
+        while (done < length) {
+            ssize_t wrote = pwrite(fd_, buffer_ + done, length - done, fileOffset_ + done);
+            if (wrote < 0 && errno == EINTR) {
+                continue;
+            }
+            if (wrote <= 0) {
+                failed_ = true;
+                break;
+            }
+            done += wrote;
+        }
+        if (dropCache_ && !isDirect_) {
+            // Buffered fallback: push the block to disk, then evict it from the page cache.
+            sync_file_range(fd_, fileOffset_, length,
+                            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+            posix_fadvise(fd_, fileOffset_, length, POSIX_FADV_DONTNEED);
+        }
+        fileOffset_ += length;
+        filled_ = 0;
+    }
 
-    // --- Step 3: Generate Huffman Codes ---
-    generateCodes(huffmanRoot, "");
+    std::string path_;
+    int fd_ = -1;
+    int historyFd_ = -1; // Buffered descriptor for readBack
+    bool isDirect_ = false;
+    bool dropCache_ = false;
+    bool failed_ = false;
+    unsigned char* buffer_ = nullptr;
+    size_t filled_ = 0;
+    off_t fileOffset_ = 0;
+    uint64_t minimumSize_ = 0;
+};
 
-    std::cout << "\nHuffman Codes:" << std::endl;
-    for (auto const& [character, code] : huffmanCodes) {
-        if (character == '\n') {
-            std::cout << "'\\n': " << code << std::endl;
-        } else if (character == ' ') {
-            std::cout << "' ': " << code << std::endl;
-        } else {
-            std::cout << "'" << character << "': " << code << std::endl;
+// --- Writes a byte stream into the data extents of a sparse file ---
+// Bytes fill each extent in turn; the gaps between them are never written and stay holes.
+class ExtentWriter {
+public:
+    ExtentWriter(BlockWriter& ofs, const std::vector<FileExtent>& extents) : ofs_(ofs), extents_(extents) {}
+
+    void put(unsigned char byte) {
+        while (left_ == 0) {
+            if (next_ == extents_.size()) {
+                overflow_ = true; // More data than the extents hold
+                return;
+            }
+            ofs_.seek(extents_[next_].offset);
+            left_ = extents_[next_++].length;
         }
+        ofs_.put(byte);
+        --left_;
     }
 
-    // --- Step 4: Compress the file ---
-    compressFile(inputFileName, compressedFileName, huffmanRoot);
+    void write(const void* data, size_t length) {
+        const unsigned char* in = static_cast<const unsigned char*>(data);
+        while (length > 0) {
+            if (left_ == 0) {
+                put(*in++); // Moves to the next extent
+                --length;
+                continue;
+            }
+            size_t chunk = std::min<uint64_t>(length, left_);
+            ofs_.write(in, chunk);
+            in += chunk;
+            length -= chunk;
+            left_ -= chunk;
+        }
+    }
 
-    // --- Step 5: Decompress the file ---
-    decompressFile(compressedFileName, decompressedFileName);
+    // Copies `length` already written bytes from position `position` of the extents' data.
+    bool readBack(uint64_t position, void* destination, size_t length) {
+        unsigned char* out = static_cast<unsigned char*>(destination);
+        return forEachExtentRange(extents_, position, length, [&](uint64_t offset, uint64_t chunk) {
+            bool ok = ofs_.readBack(offset, out, chunk);
+            out += chunk;
+            return ok;
+        });
+    }
 
-    // Clean up the Huffman tree
-    delete huffmanRoot;
+    // True if exactly the extents' worth of data was written.
+    bool complete() const {
+        return !overflow_ && left_ == 0 && next_ == extents_.size();
+    }
 
-    return 0;
+private:
+    BlockWriter& ofs_;
+    const std::vector<FileExtent>& extents_;
+    size_t next_ = 0;
+    uint64_t left_ = 0;
+    bool overflow_ = false;
+};
+
+// --- In-memory byte source and sink ---
+// Same get/read/put/write interface as BlockReader/BlockWriter, so the stream encoder and
+// decoder below work on files and on memory alike.
+class MemoryReader {
+public:
+    MemoryReader(const unsigned char* data, size_t length) : data_(data), length_(length) {}
+
+    unsigned long long size() const {
+        return length_;
+    }
+
+    unsigned long long remaining() const {
+        return length_ - position_;
+    }
+
+    bool get(unsigned char& byte) {
+        if (position_ == length_) {
+            return false;
+        }
+        byte = data_[position_++];
+        return true;
+    }
+
+    bool read(void* destination, size_t length) {
+        if (length > length_ - position_) {
+            return false;
+        }
+        std::memcpy(destination, data_ + position_, length);
+        position_ += length;
+        return true;
+    }
+
+private:
+    const unsigned char* data_;
+    size_t length_;
+    size_t position_ = 0;
+};
+
+template <typename Vector = std::vector<unsigned char>>
+class MemoryWriter {
+public:
+    explicit MemoryWriter(Vector& out) : out_(out) {}
+
+    void put(unsigned char byte) {
+        out_.push_back(byte);
+    }
+
+    void write(const void* data, size_t length) {
+        const unsigned char* in = static_cast<const unsigned char*>(data);
+        out_.insert(out_.end(), in, in + length);
+    }
+
+private:
+    Vector& out_;
+};
+
+// --- Flat code table: code bits and length for every byte value ---
+// Codes are stored right-aligned; a length of 0 means the byte does not occur. Codes are at most
+// 31 bits long because the stream header stores them as an int.
+const int MAX_STREAM_CODE_LENGTH = 31;
+
+struct CodeTable {
+    uint32_t code[256];
+    uint8_t length[256];
+};
+
+CodeTable codeTableFromMap(const std::map<char, std::string>& codes) {
+    CodeTable table = {};
+    for (auto const& [character, code] : codes) {
+        unsigned char symbol = static_cast<unsigned char>(character);
+        table.code[symbol] = binaryToDecimal(code);
+        table.length[symbol] = code.length();
+    }
+    return table;
+}
+
+// --- Decoding tree rebuilt from a stream header ---
+// Nodes live in a flat array (a full binary tree over 256 leaves has 511 nodes), so rebuilding and
+// walking it never allocates.
+struct DecodeTree {
+    static const int16_t NONE = -1;
+    int16_t child[511][2];
+    int16_t symbol[511]; // Byte value for leaves, NONE for internal nodes
+    int nodeCount;
+
+    void reset() {
+        nodeCount = 1;
+        child[0][0] = child[0][1] = NONE;
+        symbol[0] = NONE;
+    }
+
+    // Adds a code; false if it collides with a code already present.
+    bool insert(uint32_t code, int length, unsigned char character) {
+        int node = 0;
+        for (int i = length - 1; i >= 0; --i) {
+            if (symbol[node] != NONE) {
+                return false; // Passes through another code's leaf
+            }
+            int bit = (code >> i) & 1;
+            if (child[node][bit] == NONE) {
+                if (nodeCount == 511) {
+                    return false;
+                }
+                child[nodeCount][0] = child[nodeCount][1] = NONE;
+                symbol[nodeCount] = NONE;
+                child[node][bit] = nodeCount++;
+            }
+            node = child[node][bit];
+        }
+        if (symbol[node] != NONE || child[node][0] != NONE || child[node][1] != NONE) {
+            return false;
+        }
+        symbol[node] = character;
+        return true;
+    }
+};
+
+// --- Symbol-pair encode table ---
+// For every pair of bytes, the concatenation of their two codes: bits 0-4 hold the combined
+// length, the rest the combined code. With codes of at most MAX_PAIR_CODE_LENGTH bits a pair fits
+// in one entry, so the encoder does one lookup and one accumulator update per two bytes. Building
+// the 64K entries costs about as much as encoding as many bytes, so it only pays off for longer
+// inputs with short codes.
+const int MAX_PAIR_CODE_LENGTH = 13;
+const size_t PAIR_TABLE_MIN_INPUT = 256 * 1024;
+
+struct PairCodeTable {
+    uint32_t entry[1 << 16];
+};
+
+void buildPairTable(const CodeTable& table, PairCodeTable& pairs) {
+    for (int first = 0; first < 256; ++first) {
+        uint32_t* row = pairs.entry + (first << 8);
+        for (int second = 0; second < 256; ++second) {
+            uint32_t code = table.code[first] << table.length[second] | table.code[second];
+            row[second] = code << 5 | (table.length[first] + table.length[second]);
+        }
+    }
+    countStat(COUNTER_PAIR_TABLES, 1);
+}
+
+// True if the pair table is worth building for `length` bytes coded with `table`.
+bool pairTableProfitable(const CodeTable& table, size_t length) {
+    if (length < PAIR_TABLE_MIN_INPUT) {
+        return false;
+    }
+    for (uint8_t codeLength : table.length) {
+        if (codeLength > MAX_PAIR_CODE_LENGTH) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// --- Encode a byte stream with a code table ---
+// Output layout: unique character count, (character, code length, code) per character,
+// the packed code bits, and finally the number of padding bits in the last byte.
+// Bits are gathered in a 64-bit accumulator, so encoding does not allocate. Given a pair table
+// built from the same codes, bytes are encoded two at a time.
+template <typename Input, typename Output>
+void encodeStream(Input& ifs, Output& ofs, const CodeTable& table, const PairCodeTable* pairs = nullptr) {
+    StageTimer timer(STAGE_ENCODE);
+    uint64_t symbols = 0;
+    uint64_t dataBytes = 0;
+    // --- Write Huffman Tree metadata to output file ---
+    // This is a simplified way to store the tree for decompression.
+    // A more robust method would involve serializing the tree structure itself.
+    // Here, we'll write character, code length, and decimal representation of code.
+    // The number of unique characters needs to be written first.
+    int uniqueCharCount = 0;
+    for (int symbol = 0; symbol < 256; ++symbol) {
+        uniqueCharCount += table.length[symbol] > 0;
+    }
+    ofs.write(&uniqueCharCount, sizeof(int));
+
+    for (int symbol = 0; symbol < 256; ++symbol) {
+        if (table.length[symbol] == 0) {
+            continue;
+        }
+        char character = static_cast<char>(symbol);
+        ofs.write(&character, sizeof(char));
+        int codeLength = table.length[symbol];
+        ofs.write(&codeLength, sizeof(int));
+        int decimalCode = table.code[symbol];
+        ofs.write(&decimalCode, sizeof(int));
+    }
+
+    // --- Write compressed data ---
+    // Codes are appended below the bits already pending; whole bytes leave from the top.
+    uint64_t bitBuffer = 0;
+    int bitCount = 0;
+    unsigned char ch;
+    unsigned char next;
+    while (pairs && ifs.get(ch)) {
+        if (ifs.get(next)) {
+            uint32_t entry = pairs->entry[ch << 8 | next];
+            bitBuffer = (bitBuffer << (entry & 0x1F)) | (entry >> 5);
+            bitCount += entry & 0x1F;
+            symbols += 2;
+        } else { // Odd byte at the end
+            bitBuffer = (bitBuffer << table.length[ch]) | table.code[ch];
+            bitCount += table.length[ch];
+            ++symbols;
+        }
+        while (bitCount >= 8) {
+            bitCount -= 8;
+            ofs.put(static_cast<unsigned char>(bitBuffer >> bitCount));
+            ++dataBytes;
+        }
+    }
+    while (!pairs && ifs.get(ch)) {
+        bitBuffer = (bitBuffer << table.length[ch]) | table.code[ch];
+        bitCount += table.length[ch];
+        ++symbols;
+        // Write full bytes to file
+        while (bitCount >= 8) {
+            bitCount -= 8;
+            ofs.put(static_cast<unsigned char>(bitBuffer >> bitCount));
+            ++dataBytes;
+        }
+    }
+
+    // Handle any remaining bits (pad with zeros to form a full byte)
+    int paddingBits = 0;
+    if (bitCount > 0) {
+        paddingBits = 8 - bitCount;
+        ofs.put(static_cast<unsigned char>(bitBuffer << paddingBits));
+        ++dataBytes;
+    }
+    // The number of padding bits is always written, 0 if the last byte was full.
+    ofs.write(&paddingBits, sizeof(int));
+
+    countStat(COUNTER_SYMBOLS_ENCODED, symbols);
+    countStat(COUNTER_BYTES_IN, symbols);
+    countStat(COUNTER_BYTES_OUT, sizeof(int) + uniqueCharCount * (sizeof(char) + 2 * sizeof(int)) + dataBytes + sizeof(int));
+}
+
+template <typename Input, typename Output>
+void encodeStream(Input& ifs, Output& ofs, const std::map<char, std::string>& codes) {
+    encodeStream(ifs, ofs, codeTableFromMap(codes));
+}
+
+// --- Table-driven decoders ---
+// A DecodeTable<TABLE_BITS, MAX_LENGTH> decodes any code of up to MAX_LENGTH bits with one lookup
+// in a 2^TABLE_BITS primary table, plus one in a 2^(MAX_LENGTH - TABLE_BITS) subtable for codes
+// longer than TABLE_BITS. Both are compile-time constants, so the hot loop's shifts and masks are
+// constants and the subtable step disappears entirely when MAX_LENGTH == TABLE_BITS. The decoder
+// for a stream is picked from the longest code in its header; streams with longer codes than any
+// table supports fall back to walking the DecodeTree.
+//
+// Entries hold the symbol in bits 0-7 and the code length in bits 8-12; 0 marks a bit pattern no
+// code starts with. A primary entry with SUBTABLE_LINK set holds a subtable offset instead.
+const uint16_t SUBTABLE_LINK = 0x8000;
+
+// Symbols a decode loop found past the primary table, tallied locally and counted once per stream.
+struct TableMisses {
+    uint64_t subtable = 0; // With a subtable lookup
+    uint64_t fallback = 0; // Without the tables
+
+    void count() const {
+        countStat(COUNTER_SUBTABLE_LOOKUPS, subtable);
+        countStat(COUNTER_TABLE_FALLBACKS, fallback);
+    }
+};
+
+// Codes as listed in a stream header.
+struct StreamHeader {
+    int count;
+    int maxLength;
+    uint8_t symbol[256];
+    uint8_t length[256];
+    uint32_t code[256];
+};
+
+template <int TABLE_BITS, int MAX_LENGTH>
+struct DecodeTable {
+    static_assert(TABLE_BITS <= MAX_LENGTH && MAX_LENGTH <= 16, "codes must fit the 16-bit entries");
+    static const int SUB_BITS = MAX_LENGTH - TABLE_BITS;
+
+    uint16_t primary[1 << TABLE_BITS];
+    uint16_t sub[SUB_BITS > 0 ? 256 << SUB_BITS : 1]; // At most one subtable per long code
+
+    // False if the codes collide (one is a prefix of another).
+    bool build(const StreamHeader& header) {
+        std::fill(std::begin(primary), std::end(primary), 0);
+        int subtables = 0;
+        for (int i = 0; i < header.count; ++i) {
+            int length = header.length[i];
+            uint32_t code = header.code[i];
+            uint16_t entry = header.symbol[i] | length << 8;
+            if (length <= TABLE_BITS) {
+                uint32_t first = code << (TABLE_BITS - length);
+                for (uint32_t slot = first; slot < first + (1u << (TABLE_BITS - length)); ++slot) {
+                    if (primary[slot] != 0) {
+                        return false;
+                    }
+                    primary[slot] = entry;
+                }
+                continue;
+            }
+            if constexpr (SUB_BITS > 0) {
+                uint32_t prefix = code >> (length - TABLE_BITS);
+                if (primary[prefix] == 0) {
+                    primary[prefix] = SUBTABLE_LINK | subtables++ << SUB_BITS;
+                    std::fill(sub + (primary[prefix] & ~SUBTABLE_LINK), sub + (primary[prefix] & ~SUBTABLE_LINK) + (1 << SUB_BITS), 0);
+                } else if (!(primary[prefix] & SUBTABLE_LINK)) {
+                    return false;
+                }
+                uint16_t* table = sub + (primary[prefix] & ~SUBTABLE_LINK);
+                uint32_t suffix = code & ((1u << (length - TABLE_BITS)) - 1);
+                uint32_t first = suffix << (MAX_LENGTH - length);
+                for (uint32_t slot = first; slot < first + (1u << (MAX_LENGTH - length)); ++slot) {
+                    if (table[slot] != 0) {
+                        return false;
+                    }
+                    table[slot] = entry;
+                }
+            }
+        }
+        return true;
+    }
+
+    // Entry for the code at the top of `bits`.
+    uint16_t lookup(uint64_t bits) const {
+        uint16_t entry = primary[bits >> (64 - TABLE_BITS)];
+        if constexpr (SUB_BITS > 0) {
+            if (entry & SUBTABLE_LINK) {
+                entry = sub[(entry & ~SUBTABLE_LINK) + ((bits << TABLE_BITS) >> (64 - SUB_BITS))];
+            }
+        }
+        return entry;
+    }
+};
+
+// Decodes `dataBytes` bytes of packed codes (the last of which is followed by the padding int)
+// with a table. Bits are kept left-aligned in a 64-bit buffer. While more than MAX_LENGTH bits are
+// buffered every lookup is complete, so the main loop needs no bounds checks; only the final
+// partial byte is decoded with them.
+template <int TABLE_BITS, int MAX_LENGTH, typename Input, typename Output>
+bool decodeWithTable(const DecodeTable<TABLE_BITS, MAX_LENGTH>& table, Input& ifs, Output& ofs, uint64_t dataBytes, uint64_t& symbols,
+                     TableMisses& misses) {
+    uint64_t bits = 0;
+    uint64_t subtable = 0; // Codes longer than TABLE_BITS, each of which took a subtable lookup
+    int available = 0;
+    uint64_t bodyBytes = dataBytes > 0 ? dataBytes - 1 : 0;
+    unsigned char byte = 0;
+    for (;;) {
+        while (available <= 56 && bodyBytes > 0) {
+            if (!ifs.get(byte)) {
+                return false;
+            }
+            bits |= static_cast<uint64_t>(byte) << (56 - available);
+            available += 8;
+            --bodyBytes;
+        }
+        if (available < MAX_LENGTH) {
+            break;
+        }
+        do {
+            uint16_t entry = table.lookup(bits);
+            int length = (entry >> 8) & 0x1F;
+            if (length == 0) {
+                return false; // Code not in the table
+            }
+            ofs.put(static_cast<unsigned char>(entry));
+            ++symbols;
+            if constexpr (MAX_LENGTH > TABLE_BITS) {
+                subtable += length > TABLE_BITS;
+            }
+            bits <<= length;
+            available -= length;
+        } while (available >= MAX_LENGTH);
+    }
+    misses.subtable += subtable;
+    if (dataBytes == 0) {
+        return true;
+    }
+
+    // Remove padding from the last byte
+    int paddingBits = 0;
+    if (!ifs.get(byte) || !ifs.read(&paddingBits, sizeof(int)) || paddingBits < 0 || paddingBits > 7) {
+        return false;
+    }
+    bits |= static_cast<uint64_t>(byte) << (56 - available);
+    available += 8 - paddingBits;
+    bits &= ~0ULL << (64 - available); // Drop the padding itself
+    while (available > 0) {
+        uint16_t entry = table.lookup(bits);
+        int length = (entry >> 8) & 0x1F;
+        if (length == 0 || length > available) {
+            return false;
+        }
+        ofs.put(static_cast<unsigned char>(entry));
+        ++symbols;
+        misses.subtable += length > TABLE_BITS;
+        bits <<= length;
+        available -= length;
+    }
+    return true;
+}
+
+// --- Bit-by-bit decoding for codes too long for the tables ---
+template <typename Input, typename Output>
+bool decodeWithTree(const StreamHeader& header, DecodeTree& tree, Input& ifs, Output& ofs, uint64_t dataBytes, uint64_t& symbols) {
+    tree.reset();
+    for (int i = 0; i < header.count; ++i) {
+        if (!tree.insert(header.code[i], header.length[i], header.symbol[i])) {
+            return false;
+        }
+    }
+
+    int current = 0;
+    auto decodeBits = [&](unsigned char byte, int bitCount) {
+        for (int i = 7; i >= 8 - bitCount; --i) {
+            current = tree.child[current][(byte >> i) & 1];
+            if (current == DecodeTree::NONE) {
+                return false; // Code not in the table
+            }
+            if (tree.symbol[current] != DecodeTree::NONE) {
+                ofs.put(static_cast<unsigned char>(tree.symbol[current]));
+                ++symbols;
+                current = 0; // Reset to root for next code
+            }
+        }
+        return true;
+    };
+
+    bool valid = true;
+    unsigned char byte = 0;
+    for (unsigned long long i = 0; i + 1 < dataBytes && valid; ++i) {
+        valid = ifs.get(byte) && decodeBits(byte, 8);
+    }
+
+    // Remove padding from the last byte
+    if (dataBytes > 0 && valid) {
+        int paddingBits = 0;
+        valid = ifs.get(byte) && ifs.read(&paddingBits, sizeof(int)) && paddingBits >= 0 && paddingBits <= 7 &&
+                decodeBits(byte, 8 - paddingBits);
+    }
+    return valid;
+}
+
+// Everything decodeStream needs, kept together so a codec context can own it.
+struct StreamDecoder {
+    StreamHeader header;
+    DecodeTable<8, 8> table8;
+    DecodeTable<12, 12> table12;
+    DecodeTable<11, 15> table11;
+    DecodeTree tree;
+};
+
+// Longest code the table decoders handle; HuffmanContext limits its codes to this.
+const int MAX_TABLE_CODE_LENGTH = 15;
+
+// --- Decode a stream written by encodeStream ---
+// Returns false if the metadata is malformed or the stream is truncated.
+template <typename Input, typename Output>
+bool decodeStream(Input& ifs, Output& ofs, StreamDecoder& decoder) {
+    StageTimer timer(STAGE_DECODE);
+    unsigned long long streamBytes = ifs.remaining();
+    StreamHeader& header = decoder.header;
+
+    // --- Read the code list ---
+    int uniqueCharCount;
+    if (!ifs.read(&uniqueCharCount, sizeof(int)) || uniqueCharCount < 0 || uniqueCharCount > 256) {
+        return false;
+    }
+    header.count = uniqueCharCount;
+    header.maxLength = 0;
+    for (int i = 0; i < uniqueCharCount; ++i) {
+        char character;
+        int codeLength;
+        int decimalCode;
+
+        if (!ifs.read(&character, sizeof(char)) || !ifs.read(&codeLength, sizeof(int)) ||
+            !ifs.read(&decimalCode, sizeof(int)) || codeLength <= 0 || codeLength > MAX_STREAM_CODE_LENGTH ||
+            (codeLength < 32 && static_cast<uint32_t>(decimalCode) >> codeLength != 0)) {
+            return false;
+        }
+        header.symbol[i] = static_cast<unsigned char>(character);
+        header.length[i] = codeLength;
+        header.code[i] = static_cast<uint32_t>(decimalCode);
+        header.maxLength = std::max(header.maxLength, codeLength);
+    }
+
+    // The compressed data sits between the metadata and the trailing padding int. The stream is
+    // read once, front to back, so the padding is only known once the last data byte is in hand.
+    unsigned long long headerBytes = sizeof(int) + uniqueCharCount * (sizeof(char) + 2 * sizeof(int));
+    if (streamBytes < headerBytes + sizeof(int)) {
+        return false;
+    }
+    unsigned long long dataBytes = streamBytes - headerBytes - sizeof(int);
+
+    // --- Pick a decoder from the longest code ---
+    uint64_t symbols = 0;
+    TableMisses misses;
+    bool valid;
+    if (header.maxLength <= 8) {
+        valid = decoder.table8.build(header) && decodeWithTable(decoder.table8, ifs, ofs, dataBytes, symbols, misses);
+    } else if (header.maxLength <= 12) {
+        valid = decoder.table12.build(header) && decodeWithTable(decoder.table12, ifs, ofs, dataBytes, symbols, misses);
+    } else if (header.maxLength <= MAX_TABLE_CODE_LENGTH) {
+        valid = decoder.table11.build(header) && decodeWithTable(decoder.table11, ifs, ofs, dataBytes, symbols, misses);
+    } else {
+        valid = decodeWithTree(header, decoder.tree, ifs, ofs, dataBytes, symbols);
+        misses.fallback = symbols;
+    }
+    countStat(COUNTER_SYMBOLS_DECODED, symbols);
+    misses.count();
+    return valid;
+}
+
+template <typename Input, typename Output>
+bool decodeStream(Input& ifs, Output& ofs) {
+    StreamDecoder decoder;
+    return decodeStream(ifs, ofs, decoder);
+}
+
+// --- Reusable codec context ---
+// Owns all the working memory needed to compress and decompress buffers: the histogram, the tree
+// under construction, the code table and the decoding tree. It is allocated once, from the given
+// memory resource, when the context is created; compress() and decompress() then run without any
+// allocation as long as the output container already has enough capacity. A context is not
+// thread-safe; use one per thread.
+class HuffmanContext {
+public:
+    explicit HuffmanContext(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : resource_(resource) {
+        workspace_ = new (resource_->allocate(sizeof(Workspace), alignof(Workspace))) Workspace();
+    }
+
+    ~HuffmanContext() {
+        if (pairs_) {
+            resource_->deallocate(pairs_, sizeof(PairCodeTable), alignof(PairCodeTable));
+        }
+        workspace_->~Workspace();
+        resource_->deallocate(workspace_, sizeof(Workspace), alignof(Workspace));
+    }
+
+    HuffmanContext(const HuffmanContext&) = delete;
+    HuffmanContext& operator=(const HuffmanContext&) = delete;
+
+    std::pmr::memory_resource* resource() const {
+        return resource_;
+    }
+
+    // Compresses data[0, length) into `out` in the encodeStream format.
+    template <typename Output>
+    void compress(const unsigned char* data, size_t length, Output& out) {
+        prepare(data, length);
+        encodePrepared(data, length, out);
+    }
+
+    // Builds the codes for data[0, length) and returns the exact size compress() will produce.
+    size_t prepare(const unsigned char* data, size_t length) {
+        Workspace& ws = *workspace_;
+        {
+            StageTimer timer(STAGE_COUNT);
+            std::fill(std::begin(ws.frequencies), std::end(ws.frequencies), 0);
+            for (size_t i = 0; i < length; ++i) {
+                ws.frequencies[data[i]]++;
+            }
+        }
+        buildCodes(ws.frequencies, ws.table);
+        uint64_t bits = 0;
+        int uniqueCount = 0;
+        for (int symbol = 0; symbol < 256; ++symbol) {
+            bits += ws.frequencies[symbol] * ws.table.length[symbol];
+            uniqueCount += ws.table.length[symbol] > 0;
+        }
+        return sizeof(int) + uniqueCount * (sizeof(char) + 2 * sizeof(int)) + (bits + 7) / 8 + sizeof(int);
+    }
+
+    // Encodes the data last passed to prepare().
+    template <typename Output>
+    void encodePrepared(const unsigned char* data, size_t length, Output& out) {
+        Workspace& ws = *workspace_;
+        MemoryReader in(data, length);
+        if (pairTableProfitable(ws.table, length)) {
+            if (!pairs_) {
+                pairs_ = new (resource_->allocate(sizeof(PairCodeTable), alignof(PairCodeTable))) PairCodeTable;
+            }
+            buildPairTable(ws.table, *pairs_);
+            encodeStream(in, out, ws.table, pairs_);
+        } else {
+            encodeStream(in, out, ws.table);
+        }
+    }
+
+    // Size of the working memory a context allocates from its resource when it is created.
+    static constexpr size_t workspaceBytes() {
+        return sizeof(Workspace);
+    }
+
+    // Size of the pair table an encoding context allocates on its first input of
+    // PAIR_TABLE_MIN_INPUT bytes or more whose codes suit one; decoding never needs it.
+    static constexpr size_t pairTableBytes() {
+        return sizeof(PairCodeTable);
+    }
+
+    template <typename Input, typename Output>
+    bool decompress(Input& in, Output& out) {
+        return decodeStream(in, out, workspace_->decoder);
+    }
+
+    // Huffman code lengths for the given histogram, turned into canonical codes of at most
+    // MAX_TABLE_CODE_LENGTH bits so every stream gets a table decoder. Absent symbols get length 0.
+    void buildCodes(const uint64_t* frequencies, CodeTable& table) {
+        Workspace& ws = *workspace_;
+        std::copy(frequencies, frequencies + 256, ws.weights);
+        countStat(COUNTER_TREE_BUILDS, 1);
+        countStat(COUNTER_CODE_TABLES, 1);
+        for (;;) {
+            int maxLength;
+            {
+                StageTimer timer(STAGE_BUILD_TREE);
+                maxLength = buildLengths(ws, table.length);
+            }
+            if (maxLength <= MAX_TABLE_CODE_LENGTH) {
+                break;
+            }
+            // Too deep: flatten the histogram and try again.
+            for (uint64_t& weight : ws.weights) {
+                weight = weight ? (weight >> 1) | 1 : 0;
+            }
+        }
+        StageTimer timer(STAGE_GENERATE_CODES);
+        assignCanonicalCodes(table);
+    }
+
+private:
+    struct Workspace {
+        uint64_t frequencies[256];
+        uint64_t weights[256];
+        uint64_t nodeWeight[511];
+        int16_t parent[511];
+        int16_t heap[256];
+        CodeTable table;
+        StreamDecoder decoder;
+    };
+
+    // Builds the tree bottom-up in a fixed array: leaves first, then each merge appends an internal
+    // node, so a node's parent always has a higher index. Returns the longest code length.
+    static int buildLengths(Workspace& ws, uint8_t* lengths) {
+        int leafCount = 0;
+        int16_t leafSymbol[256];
+        for (int symbol = 0; symbol < 256; ++symbol) {
+            lengths[symbol] = 0;
+            if (ws.weights[symbol] > 0) {
+                ws.nodeWeight[leafCount] = ws.weights[symbol];
+                leafSymbol[leafCount++] = symbol;
+            }
+        }
+        if (leafCount == 0) {
+            return 0;
+        }
+        if (leafCount == 1) {
+            lengths[leafSymbol[0]] = 1; // A lone symbol still needs a one-bit code
+            return 1;
+        }
+
+        auto heavier = [&ws](int16_t a, int16_t b) {
+            return ws.nodeWeight[a] != ws.nodeWeight[b] ? ws.nodeWeight[a] > ws.nodeWeight[b] : a > b;
+        };
+        int heapSize = leafCount;
+        for (int i = 0; i < leafCount; ++i) {
+            ws.heap[i] = i;
+        }
+        std::make_heap(ws.heap, ws.heap + heapSize, heavier);
+        int nodeCount = leafCount;
+        while (heapSize > 1) {
+            std::pop_heap(ws.heap, ws.heap + heapSize--, heavier);
+            int16_t left = ws.heap[heapSize];
+            std::pop_heap(ws.heap, ws.heap + heapSize--, heavier);
+            int16_t right = ws.heap[heapSize];
+            ws.nodeWeight[nodeCount] = ws.nodeWeight[left] + ws.nodeWeight[right];
+            ws.parent[left] = ws.parent[right] = nodeCount;
+            ws.heap[heapSize++] = nodeCount++;
+            std::push_heap(ws.heap, ws.heap + heapSize, heavier);
+        }
+
+        // Depths, walking from the root (last node) down.
+        int16_t depth[511];
+        depth[nodeCount - 1] = 0;
+        for (int node = nodeCount - 2; node >= 0; --node) {
+            depth[node] = depth[ws.parent[node]] + 1;
+        }
+        int maxLength = 0;
+        for (int leaf = 0; leaf < leafCount; ++leaf) {
+            maxLength = std::max<int>(maxLength, depth[leaf]);
+            lengths[leafSymbol[leaf]] = std::min<int>(depth[leaf], 255);
+        }
+        return maxLength;
+    }
+
+    // Canonical codes: ordered by length, then by byte value.
+    static void assignCanonicalCodes(CodeTable& table) {
+        uint32_t lengthCount[MAX_STREAM_CODE_LENGTH + 1] = {};
+        for (int symbol = 0; symbol < 256; ++symbol) {
+            lengthCount[table.length[symbol]]++;
+        }
+        lengthCount[0] = 0;
+        uint32_t nextCode[MAX_STREAM_CODE_LENGTH + 1] = {};
+        uint32_t code = 0;
+        for (int length = 1; length <= MAX_STREAM_CODE_LENGTH; ++length) {
+            code = (code + lengthCount[length - 1]) << 1;
+            nextCode[length] = code;
+        }
+        for (int symbol = 0; symbol < 256; ++symbol) {
+            table.code[symbol] = table.length[symbol] ? nextCode[table.length[symbol]]++ : 0;
+        }
+    }
+
+    std::pmr::memory_resource* resource_;
+    Workspace* workspace_;
+    PairCodeTable* pairs_ = nullptr; // Allocated on the first input it pays off for
+};
+
+// One context per thread for the buffer helpers below.
+HuffmanContext& threadHuffmanContext() {
+    thread_local HuffmanContext context;
+    return context;
+}
+
+// --- LZ77 front end ---
+// Levels 2 and up look for repeated strings within the block before entropy coding. A block is
+// parsed into sequences (a run of literals followed by a match) and split into four byte streams,
+// each compressed with its own Huffman code table:
+//
+//   literals: the literal bytes
+//   tokens:   one byte per sequence: literal count (high nibble) and match length - 4 (low
+//             nibble), 15 meaning "15 plus a varint in extras"
+//   extras:   those varints (7 bits per byte, high bit = more follows)
+//   offsets:  a varint per match: the distance back, or 0 to repeat the previous distance
+//
+// Literals after the last match are simply the rest of the literal stream. Levels 2-6 parse
+// greedily with deeper match searches; levels 7-9 parse optimally: a shortest-path search where
+// every literal and match is priced with the code lengths the streams got in the previous pass,
+// repeated for up to three passes. Decoding is the same at every level.
+const int LZ_MIN_MATCH = 4;
+const int LZ_WINDOW_BITS = 20;
+const size_t LZ_WINDOW = size_t(1) << LZ_WINDOW_BITS;
+const int LZ_HASH_BITS = 17;
+const uint32_t LZ_NICE_MATCH = 256;   // Longer matches are taken without searching further
+const size_t LZ_OPT_CHUNK = 4096;     // Positions per optimal-parse search
+const int LZ_MAX_CANDIDATES = 64;     // Matches of increasing length reported per position
+const uint32_t LZ_UNSEEN_PRICE = 12;  // Bits charged for a byte the previous pass never produced
+const int DEFAULT_LEVEL = 1;          // Huffman only
+const int MIN_LZ_LEVEL = 2;
+const int MIN_OPTIMAL_LEVEL = 7;
+const int MAX_LEVEL = 9;
+
+void appendVarint(std::pmr::vector<unsigned char>& out, uint32_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<unsigned char>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<unsigned char>(value));
+}
+
+bool takeVarint(const unsigned char* data, size_t size, size_t& position, uint32_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 35 && position < size; shift += 7) {
+        unsigned char byte = data[position++];
+        value |= static_cast<uint32_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool takeVarint(const std::pmr::vector<unsigned char>& in, size_t& position, uint32_t& value) {
+    return takeVarint(in.data(), in.size(), position, value);
+}
+
+class LzContext {
+public:
+    explicit LzContext(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : head_(resource), chain_(resource), literals_(resource), tokens_(resource), extras_(resource), offsets_(resource),
+          nodes_(resource), path_(resource) {}
+
+    // Working memory compress() needs for a block of `blockSize` bytes.
+    static uint64_t compressBytes(size_t blockSize) {
+        return (uint64_t(1) << LZ_HASH_BITS) * sizeof(uint32_t) + std::min(LZ_WINDOW, blockSize) * sizeof(uint32_t) +
+               2 * blockSize + (LZ_OPT_CHUNK + 1) * (sizeof(OptNode) + sizeof(uint32_t));
+    }
+
+    // Working memory decompress() needs for a block of `blockSize` bytes.
+    static uint64_t decompressBytes(size_t blockSize) {
+        return 2 * blockSize;
+    }
+
+    // Parses data[0, length) at `level` and writes the sequence count and the four streams, each
+    // preceded by its size, to `out`. `entropy` codes the streams.
+    template <typename Output>
+    void compress(const unsigned char* data, size_t length, int level, HuffmanContext& entropy, Output& out) {
+        {
+            StageTimer timer(STAGE_PARSE);
+            int depth = level < MIN_OPTIMAL_LEVEL ? 4 << (level - MIN_LZ_LEVEL) : 64 << (level - MIN_OPTIMAL_LEVEL);
+            parseGreedy(data, length, level < MIN_OPTIMAL_LEVEL ? depth : 64);
+            for (int pass = MIN_OPTIMAL_LEVEL; pass <= level; ++pass) {
+                LzPrices prices;
+                priceStreams(entropy, prices);
+                parseOptimal(data, length, depth, prices);
+            }
+        }
+        out.write(&sequenceCount_, sizeof(sequenceCount_));
+        for (const std::pmr::vector<unsigned char>* stream : {&literals_, &tokens_, &extras_, &offsets_}) {
+            uint32_t size = entropy.prepare(stream->data(), stream->size());
+            out.write(&size, sizeof(size));
+            entropy.encodePrepared(stream->data(), stream->size(), out);
+        }
+    }
+
+    // Appends the block of exactly `rawSize` bytes to `output`. False if the payload is corrupt.
+    template <typename Vector>
+    bool decompress(const unsigned char* payload, size_t payloadSize, size_t rawSize, HuffmanContext& entropy, Vector& output) {
+        size_t position = sizeof(sequenceCount_);
+        if (payloadSize < position) {
+            return false;
+        }
+        std::memcpy(&sequenceCount_, payload, sizeof(sequenceCount_));
+        for (std::pmr::vector<unsigned char>* stream : {&literals_, &tokens_, &extras_, &offsets_}) {
+            uint32_t size = 0;
+            if (payloadSize - position < sizeof(size)) {
+                return false;
+            }
+            std::memcpy(&size, payload + position, sizeof(size));
+            position += sizeof(size);
+            if (size > payloadSize - position) {
+                return false;
+            }
+            stream->clear();
+            MemoryReader streamIn(payload + position, size);
+            MemoryWriter streamOut(*stream);
+            if (!entropy.decompress(streamIn, streamOut) || stream->size() > rawSize) {
+                return false;
+            }
+            position += size;
+        }
+        if (position != payloadSize || tokens_.size() != sequenceCount_) {
+            return false;
+        }
+
+        StageTimer timer(STAGE_COPY);
+        size_t start = output.size();
+        output.resize(start + rawSize);
+        unsigned char* target = output.data() + start;
+        size_t produced = 0;
+        size_t literal = 0;
+        size_t extra = 0;
+        size_t offsetPosition = 0;
+        uint32_t previousOffset = 0;
+        for (uint32_t sequence = 0; sequence < sequenceCount_; ++sequence) {
+            uint32_t literalLength = tokens_[sequence] >> 4;
+            uint32_t matchLength = tokens_[sequence] & 0x0F;
+            uint32_t more = 0;
+            if ((literalLength == 15 && (!takeVarint(extras_, extra, more) || (literalLength += more) < more)) ||
+                (matchLength == 15 && (!takeVarint(extras_, extra, more) || (matchLength += more) < more))) {
+                return false;
+            }
+            matchLength += LZ_MIN_MATCH;
+            uint32_t offset = 0;
+            if (!takeVarint(offsets_, offsetPosition, offset)) {
+                return false;
+            }
+            offset = offset ? offset : previousOffset;
+            previousOffset = offset;
+            if (literalLength > literals_.size() - literal || literalLength > rawSize - produced ||
+                matchLength > rawSize - produced - literalLength || offset == 0 || offset > produced + literalLength) {
+                return false;
+            }
+            std::memcpy(target + produced, literals_.data() + literal, literalLength);
+            literal += literalLength;
+            produced += literalLength;
+            const unsigned char* source = target + produced - offset;
+            if (offset >= matchLength) {
+                std::memcpy(target + produced, source, matchLength);
+            } else {
+                for (uint32_t i = 0; i < matchLength; ++i) { // Overlapping: repeats the last `offset` bytes
+                    target[produced + i] = source[i];
+                }
+            }
+            produced += matchLength;
+        }
+        size_t tail = literals_.size() - literal;
+        if (tail != rawSize - produced || extra != extras_.size() || offsetPosition != offsets_.size()) {
+            return false;
+        }
+        std::memcpy(target + produced, literals_.data() + literal, tail);
+        return true;
+    }
+
+private:
+    struct LzMatch {
+        uint32_t length;
+        uint32_t offset;
+    };
+
+    // Bits per byte value of each stream, from its Huffman code lengths.
+    struct LzPrices {
+        uint32_t literal[256];
+        uint32_t token[256];
+        uint32_t extra[256];
+        uint32_t offset[256];
+    };
+
+    // One position of the optimal-parse search: the cheapest way found to reach it.
+    struct OptNode {
+        uint32_t price;
+        uint32_t length;        // Match that ends here, 0 if reached by a literal
+        uint32_t offset;
+        uint32_t literalRun;    // Literals since the last match on the cheapest path
+        uint32_t previousOffset;
+    };
+
+    static uint32_t hash4(const unsigned char* data) {
+        uint32_t value;
+        std::memcpy(&value, data, sizeof(value));
+        return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+    }
+
+    void reset(size_t length) {
+        head_.assign(size_t(1) << LZ_HASH_BITS, 0);
+        size_t window = MIN_BLOCK_SIZE_FOR_LZ;
+        while (window < length && window < LZ_WINDOW) {
+            window <<= 1;
+        }
+        if (chain_.size() < window) {
+            chain_.resize(window);
+        }
+        windowMask_ = window - 1;
+        literals_.clear();
+        tokens_.clear();
+        extras_.clear();
+        offsets_.clear();
+        sequenceCount_ = 0;
+    }
+
+    void insert(const unsigned char* data, size_t length, size_t position) {
+        if (position + LZ_MIN_MATCH <= length) {
+            uint32_t hash = hash4(data + position);
+            chain_[position & windowMask_] = head_[hash];
+            head_[hash] = position + 1;
+        }
+    }
+
+    // Fills `matches` with matches at `position` of strictly increasing length (the previous
+    // offset is tried first) and returns how many there are.
+    int findMatches(const unsigned char* data, size_t length, size_t position, int depth, uint32_t previousOffset, LzMatch* matches) {
+        size_t limit = length - position;
+        if (limit < LZ_MIN_MATCH) {
+            return 0;
+        }
+        int count = 0;
+        uint32_t best = LZ_MIN_MATCH - 1;
+        const unsigned char* current = data + position;
+        auto consider = [&](size_t candidate) {
+            const unsigned char* earlier = data + candidate;
+            if (earlier[best] != current[best]) {
+                return;
+            }
+            uint32_t matched = 0;
+            while (matched < limit && earlier[matched] == current[matched]) {
+                ++matched;
+            }
+            if (matched > best) {
+                best = matched;
+                matches[count < LZ_MAX_CANDIDATES ? count++ : count - 1] = LzMatch{matched, static_cast<uint32_t>(position - candidate)};
+            }
+        };
+        if (previousOffset && previousOffset <= position && previousOffset <= windowMask_) {
+            consider(position - previousOffset);
+        }
+        uint32_t next = head_[hash4(current)];
+        for (int step = 0; step < depth && next && best < limit && best < LZ_NICE_MATCH; ++step) {
+            size_t candidate = next - 1;
+            if (candidate >= position || position - candidate > windowMask_) {
+                break;
+            }
+            consider(candidate);
+            next = chain_[candidate & windowMask_];
+            if (next > candidate) {
+                break; // Slot reused by a newer position
+            }
+        }
+        return count;
+    }
+
+    void emitSequence(const unsigned char* literals, uint32_t literalLength, uint32_t matchLength, uint32_t offset, uint32_t& previousOffset) {
+        literals_.insert(literals_.end(), literals, literals + literalLength);
+        uint32_t matchCode = matchLength - LZ_MIN_MATCH;
+        tokens_.push_back(static_cast<unsigned char>(std::min(literalLength, 15u) << 4 | std::min(matchCode, 15u)));
+        if (literalLength >= 15) {
+            appendVarint(extras_, literalLength - 15);
+        }
+        if (matchCode >= 15) {
+            appendVarint(extras_, matchCode - 15);
+        }
+        appendVarint(offsets_, offset == previousOffset ? 0 : offset);
+        previousOffset = offset;
+        ++sequenceCount_;
+    }
+
+    void parseGreedy(const unsigned char* data, size_t length, int depth) {
+        reset(length);
+        LzMatch matches[LZ_MAX_CANDIDATES];
+        size_t literalStart = 0;
+        uint32_t previousOffset = 0;
+        for (size_t position = 0; position < length;) {
+            int count = findMatches(data, length, position, depth, previousOffset, matches);
+            insert(data, length, position);
+            if (count == 0) {
+                ++position;
+                continue;
+            }
+            const LzMatch& match = matches[count - 1];
+            emitSequence(data + literalStart, position - literalStart, match.length, match.offset, previousOffset);
+            for (size_t covered = position + 1; covered < position + match.length; ++covered) {
+                insert(data, length, covered);
+            }
+            position += match.length;
+            literalStart = position;
+        }
+        literals_.insert(literals_.end(), data + literalStart, data + length);
+    }
+
+    void priceStreams(HuffmanContext& entropy, LzPrices& prices) {
+        const std::pmr::vector<unsigned char>* streams[4] = {&literals_, &tokens_, &extras_, &offsets_};
+        uint32_t* tables[4] = {prices.literal, prices.token, prices.extra, prices.offset};
+        for (int i = 0; i < 4; ++i) {
+            uint64_t frequencies[256] = {};
+            for (unsigned char byte : *streams[i]) {
+                frequencies[byte]++;
+            }
+            CodeTable table;
+            entropy.buildCodes(frequencies, table);
+            for (int symbol = 0; symbol < 256; ++symbol) {
+                tables[i][symbol] = table.length[symbol] ? table.length[symbol] : LZ_UNSEEN_PRICE;
+            }
+        }
+    }
+
+    static uint32_t varintPrice(const uint32_t* table, uint32_t value) {
+        uint32_t price = 0;
+        while (value >= 0x80) {
+            price += table[(value & 0x7F) | 0x80];
+            value >>= 7;
+        }
+        return price + table[value];
+    }
+
+    static uint32_t matchPrice(const LzPrices& prices, uint32_t literalRun, uint32_t length, uint32_t offset, uint32_t previousOffset) {
+        uint32_t matchCode = length - LZ_MIN_MATCH;
+        uint32_t price = prices.token[std::min(literalRun, 15u) << 4 | std::min(matchCode, 15u)];
+        if (literalRun >= 15) {
+            price += varintPrice(prices.extra, literalRun - 15);
+        }
+        if (matchCode >= 15) {
+            price += varintPrice(prices.extra, matchCode - 15);
+        }
+        return price + varintPrice(prices.offset, offset == previousOffset ? 0 : offset);
+    }
+
+    // Shortest-path parse over LZ_OPT_CHUNK positions at a time. Each position is reached either
+    // by a literal from the previous one or by a match from an earlier one; the cheapest path to
+    // the end of the chunk is emitted. A match of LZ_NICE_MATCH or more is taken as soon as it is
+    // found: the chunk ends there and the match is emitted whole, even past the chunk.
+    void parseOptimal(const unsigned char* data, size_t length, int depth, const LzPrices& prices) {
+        reset(length);
+        nodes_.resize(LZ_OPT_CHUNK + 1);
+        path_.resize(LZ_OPT_CHUNK);
+        LzMatch matches[LZ_MAX_CANDIDATES];
+        size_t literalStart = 0;
+        uint32_t previousOffset = 0;
+        for (size_t start = 0; start < length;) {
+            size_t end = std::min(LZ_OPT_CHUNK, length - start);
+            nodes_[0] = OptNode{0, 0, 0, static_cast<uint32_t>(start - literalStart), previousOffset};
+            for (size_t i = 1; i <= end; ++i) {
+                nodes_[i].price = UINT32_MAX;
+            }
+            LzMatch forced = {0, 0};
+            for (size_t i = 0; i < end; ++i) {
+                const OptNode node = nodes_[i];
+                size_t position = start + i;
+                uint32_t price = node.price + prices.literal[data[position]];
+                if (price < nodes_[i + 1].price) {
+                    nodes_[i + 1] = OptNode{price, 0, 0, node.literalRun + 1, node.previousOffset};
+                }
+                int count = findMatches(data, length, position, depth, node.previousOffset, matches);
+                insert(data, length, position);
+                if (count > 0 && matches[count - 1].length >= LZ_NICE_MATCH) {
+                    forced = matches[count - 1];
+                    end = i;
+                    for (size_t covered = position + 1; covered < position + forced.length; ++covered) {
+                        insert(data, length, covered);
+                    }
+                    break;
+                }
+                uint32_t shortest = LZ_MIN_MATCH;
+                for (int m = 0; m < count; ++m) {
+                    uint32_t longest = std::min<uint32_t>(matches[m].length, end - i);
+                    for (uint32_t matchLength = shortest; matchLength <= longest; ++matchLength) {
+                        price = node.price + matchPrice(prices, node.literalRun, matchLength, matches[m].offset, node.previousOffset);
+                        if (price < nodes_[i + matchLength].price) {
+                            nodes_[i + matchLength] = OptNode{price, matchLength, matches[m].offset, 0, matches[m].offset};
+                        }
+                    }
+                    shortest = std::max(shortest, longest + 1);
+                }
+            }
+
+            // Walk back from the end of the chunk, then emit the path front to back.
+            size_t steps = 0;
+            for (size_t i = end; i > 0; i -= nodes_[i].length ? nodes_[i].length : 1) {
+                path_[steps++] = i;
+            }
+            while (steps > 0) {
+                const OptNode& node = nodes_[path_[--steps]];
+                if (node.length) {
+                    size_t matchStart = start + path_[steps] - node.length;
+                    emitSequence(data + literalStart, matchStart - literalStart, node.length, node.offset, previousOffset);
+                    literalStart = matchStart + node.length;
+                }
+            }
+            start += end;
+            if (forced.length) {
+                emitSequence(data + literalStart, start - literalStart, forced.length, forced.offset, previousOffset);
+                start += forced.length;
+                literalStart = start;
+            }
+        }
+        literals_.insert(literals_.end(), data + literalStart, data + length);
+    }
+
+    // Smallest match window; larger blocks get up to LZ_WINDOW.
+    static const size_t MIN_BLOCK_SIZE_FOR_LZ = 64 * 1024;
+
+    std::pmr::vector<uint32_t> head_;
+    std::pmr::vector<uint32_t> chain_;
+    size_t windowMask_ = 0;
+    std::pmr::vector<unsigned char> literals_;
+    std::pmr::vector<unsigned char> tokens_;
+    std::pmr::vector<unsigned char> extras_;
+    std::pmr::vector<unsigned char> offsets_;
+    std::pmr::vector<OptNode> nodes_;
+    std::pmr::vector<uint32_t> path_;
+    uint32_t sequenceCount_ = 0;
+};
+
+// --- Fixed-width fields of the container headers and directories ---
+template <typename T>
+void appendValue(std::vector<unsigned char>& out, T value) {
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&value);
+    out.insert(out.end(), bytes, bytes + sizeof(T));
+}
+
+template <typename T>
+bool takeValue(const std::vector<unsigned char>& in, size_t& position, T& value) {
+    if (in.size() - position < sizeof(T)) {
+        return false;
+    }
+    std::memcpy(&value, in.data() + position, sizeof(T));
+    position += sizeof(T);
+    return true;
+}
+
+// --- Count character frequencies of a file ---
+bool countFrequencies(const std::string& inputFile, std::map<char, int>& frequencies, bool directIO = false) {
+    StageTimer timer(STAGE_COUNT);
+    BlockReader ifs;
+    if (!ifs.open(inputFile, directIO, true)) {
+        std::cerr << "Error opening " << inputFile << std::endl;
+        return false;
+    }
+    unsigned char ch;
+    while (ifs.get(ch)) {
+        frequencies[static_cast<char>(ch)]++;
+    }
+    return true;
+}
+
+// --- Compress a memory buffer into the same format compressFile writes ---
+// Uses its own code table, so it is safe to call from several threads at once.
+void compressBuffer(const std::vector<unsigned char>& input, std::vector<unsigned char>& output) {
+    MemoryWriter out(output);
+    threadHuffmanContext().compress(input.data(), input.size(), out);
+}
+
+// --- Decompress a buffer written by compressBuffer ---
+bool decompressBuffer(const unsigned char* data, size_t length, std::vector<unsigned char>& output) {
+    MemoryReader in(data, length);
+    MemoryWriter out(output);
+    return threadHuffmanContext().decompress(in, out);
+}
+
+// --- CRC-32 (IEEE 802.3) used to verify archive entries and blocks ---
+// Slicing-by-8: eight tables let eight bytes be folded into the CRC per step.
+uint32_t crc32(const unsigned char* data, size_t length, uint32_t crc = 0) {
+    static const std::vector<uint32_t> table = [] {
+        std::vector<uint32_t> t(8 * 256);
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            t[i] = c;
+        }
+        for (uint32_t i = 0; i < 256; ++i) {
+            for (int slice = 1; slice < 8; ++slice) {
+                t[slice * 256 + i] = t[t[(slice - 1) * 256 + i] & 0xFF] ^ (t[(slice - 1) * 256 + i] >> 8);
+            }
+        }
+        return t;
+    }();
+    const uint32_t* t = table.data();
+    crc = ~crc;
+    for (; length >= 8; data += 8, length -= 8) {
+        uint32_t low;
+        uint32_t high;
+        std::memcpy(&low, data, sizeof(low));
+        std::memcpy(&high, data + 4, sizeof(high));
+        low ^= crc;
+        crc = t[7 * 256 + (low & 0xFF)] ^ t[6 * 256 + ((low >> 8) & 0xFF)] ^ t[5 * 256 + ((low >> 16) & 0xFF)] ^ t[4 * 256 + (low >> 24)] ^
+              t[3 * 256 + (high & 0xFF)] ^ t[2 * 256 + ((high >> 8) & 0xFF)] ^ t[256 + ((high >> 16) & 0xFF)] ^ t[high >> 24];
+    }
+    for (; length > 0; ++data, --length) {
+        crc = t[(crc ^ *data) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// --- NUMA topology ---
+// Nodes and their CPUs, read from sysfs. Machines (or kernels) without NUMA information look like
+// a single node holding every CPU.
+struct NumaTopology {
+    std::vector<std::vector<int>> nodeCpus;
+};
+
+// Parses a sysfs CPU list such as "0-3,8-11".
+std::vector<int> parseCpuList(const std::string& text) {
+    std::vector<int> cpus;
+    size_t position = 0;
+    while (position < text.size()) {
+        size_t end = text.find(',', position);
+        std::string range = text.substr(position, end == std::string::npos ? std::string::npos : end - position);
+        int first = 0;
+        int last = 0;
+        int fields = std::sscanf(range.c_str(), "%d-%d", &first, &last);
+        if (fields == 1) {
+            last = first;
+        }
+        for (int cpu = first; fields >= 1 && cpu <= last; ++cpu) {
+            cpus.push_back(cpu);
+        }
+        if (end == std::string::npos) {
+            break;
+        }
+        position = end + 1;
+    }
+    return cpus;
+}
+
+const NumaTopology& numaTopology() {
+    static const NumaTopology topology = [] {
+        NumaTopology result;
+        for (int node = 0;; ++node) {
+            std::ifstream list("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            std::string text;
+            if (!list || !std::getline(list, text)) {
+                break;
+            }
+            std::vector<int> cpus = parseCpuList(text);
+            if (!cpus.empty()) { // Memory-only nodes can't run workers
+                result.nodeCpus.push_back(cpus);
+            }
+        }
+        if (result.nodeCpus.empty()) {
+            result.nodeCpus.emplace_back();
+            for (unsigned cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); ++cpu) {
+                result.nodeCpus.back().push_back(cpu);
+            }
+        }
+        return result;
+    }();
+    return topology;
+}
+
+// Restricts the calling thread to the CPUs of one node.
+void pinThreadToCpus(const std::vector<int>& cpus) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        if (cpu < CPU_SETSIZE) {
+            CPU_SET(cpu, &set);
+        }
+    }
+    sched_setaffinity(0, sizeof(set), &set);
+}
+
+// --- Process-wide shared executor ---
+// One set of workers shared by every concurrent compression job, so running several jobs at once
+// never puts more than the executor's thread count on the cores. A worker first picks a job with
+// queued tasks: highest priority first; within a priority the job that has received the least CPU
+// time per unit of weight (fair sharing), never exceeding a job's parallelism limit. From that
+// job it takes a task bound to its NUMA node, else one bound to none, and steals a task bound to
+// another node only when the job has no others.
+//
+// A NUMA-aware executor spreads its workers over the nodes and pins each to its node's CPUs.
+// Scheduling decisions are made under one lock; block tasks are coarse enough that it isn't
+// contended.
+class Executor {
+public:
+    struct Job;
+
+    Executor(unsigned threadCount, bool numaAware) {
+        const NumaTopology& topology = numaTopology();
+        threadCount = std::max(1u, threadCount);
+        nodeCount_ = numaAware ? std::min<unsigned>(topology.nodeCpus.size(), threadCount) : 1;
+        for (unsigned i = 0; i < threadCount; ++i) {
+            workers_.push_back(std::make_unique<Worker>());
+            workers_.back()->node = i % nodeCount_;
+        }
+        for (unsigned i = 0; i < threadCount; ++i) {
+            workers_[i]->thread = std::thread([this, i, numaAware, &topology] {
+                Worker& self = *workers_[i];
+                if (numaAware) {
+                    pinThreadToCpus(topology.nodeCpus[self.node]);
+                    setTraceThreadName("worker " + std::to_string(i) + " (node " + std::to_string(self.node) + ")");
+                } else {
+                    setTraceThreadName("worker " + std::to_string(i));
+                }
+                workerLoop(self);
+            });
+        }
+    }
+
+    ~Executor() {
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            stopping_ = true;
+        }
+        wakeup_.notify_all();
+        for (auto& worker : workers_) {
+            worker->thread.join();
+        }
+    }
+
+    Executor(const Executor&) = delete;
+    Executor& operator=(const Executor&) = delete;
+
+    size_t size() const {
+        return workers_.size();
+    }
+
+    unsigned nodeCount() const {
+        return nodeCount_;
+    }
+
+    struct Job {
+        int priority = 0;
+        unsigned weight = 1;
+        unsigned maxRunning = 0;
+        unsigned running = 0;
+        uint64_t outstanding = 0; // Queued or running tasks
+        double virtualTime = 0;   // Seconds of CPU received / weight
+        std::vector<std::deque<std::function<void()>>> queues; // One per node, then one for any node
+    };
+
+    void addJob(Job& job) {
+        std::lock_guard<std::mutex> guard(lock_);
+        job.queues.resize(nodeCount_ + 1);
+        // Start level with the least served active job so a new job can't monopolize the workers
+        // by having received nothing so far.
+        job.virtualTime = 0;
+        bool first = true;
+        for (Job* other : jobs_) {
+            if (first || other->virtualTime < job.virtualTime) {
+                job.virtualTime = other->virtualTime;
+                first = false;
+            }
+        }
+        jobs_.push_back(&job);
+    }
+
+    // Waits for the job's outstanding tasks, then forgets it.
+    void removeJob(Job& job) {
+        std::unique_lock<std::mutex> guard(lock_);
+        idle_.wait(guard, [&] { return job.outstanding == 0; });
+        jobs_.erase(std::find(jobs_.begin(), jobs_.end(), &job));
+    }
+
+    // Queues a task for `job` on `node` (nodeCount() for any node).
+    void enqueue(Job& job, unsigned node, std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            ++job.outstanding;
+            job.queues[std::min(node, nodeCount_)].push_back(std::move(task));
+        }
+        wakeup_.notify_all();
+    }
+
+private:
+    struct Task {
+        std::function<void()> run;
+        Job* job = nullptr;
+    };
+
+    struct Worker {
+        unsigned node = 0;
+        std::thread thread;
+    };
+
+    // Picks the next task for `self`; called with lock_ held.
+    bool takeTask(Worker& self, Task& task) {
+        Job* best = nullptr;
+        for (Job* job : jobs_) {
+            if (job->maxRunning && job->running >= job->maxRunning) {
+                continue;
+            }
+            bool queued = std::any_of(job->queues.begin(), job->queues.end(), [](const auto& queue) { return !queue.empty(); });
+            if (queued && (!best || job->priority > best->priority ||
+                           (job->priority == best->priority && job->virtualTime < best->virtualTime))) {
+                best = job;
+            }
+        }
+        if (!best) {
+            return false;
+        }
+        // Within the job: this worker's node, then any node, then tasks bound to other nodes.
+        size_t queue = self.node;
+        if (best->queues[queue].empty()) {
+            queue = nodeCount_;
+            for (size_t node = 0; node < nodeCount_ && best->queues[queue].empty(); ++node) {
+                queue = node;
+            }
+        }
+        task.run = std::move(best->queues[queue].front());
+        task.job = best;
+        best->queues[queue].pop_front();
+        ++best->running;
+        return true;
+    }
+
+    void run(Task& task) {
+        auto start = std::chrono::steady_clock::now();
+        task.run();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            Job& job = *task.job;
+            --job.running;
+            job.virtualTime += seconds / std::max(1u, job.weight);
+            if (--job.outstanding == 0) {
+                idle_.notify_all();
+            }
+        }
+        // A finished task may free a slot under a job's parallelism limit.
+        wakeup_.notify_all();
+    }
+
+    void workerLoop(Worker& self) {
+        for (;;) {
+            Task task;
+            {
+                std::unique_lock<std::mutex> guard(lock_);
+                wakeup_.wait(guard, [&] { return takeTask(self, task) || stopping_; });
+                if (!task.run) {
+                    return; // Stopping and nothing left to run
+                }
+            }
+            run(task);
+        }
+    }
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::vector<Job*> jobs_;
+    unsigned nodeCount_ = 1;
+    std::mutex lock_;
+    std::condition_variable wakeup_;
+    std::condition_variable idle_;
+    bool stopping_ = false;
+};
+
+// --- The shared executor ---
+// Sized and made NUMA-aware from the command line before first use.
+struct ExecutorSettings {
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    bool numaAware = false;
+};
+
+ExecutorSettings& executorSettings() {
+    static ExecutorSettings settings;
+    return settings;
+}
+
+Executor& sharedExecutor() {
+    static Executor executor(executorSettings().threads, executorSettings().numaAware);
+    return executor;
+}
+
+// --- A compression job's handle on the shared executor ---
+// submit() returns a future for the task's result. At most `parallelism` of the job's tasks run
+// at once (0 = no limit); between jobs of equal priority, CPU time is shared in proportion to
+// `weight`. submitToNode() tasks run on that node's workers unless a worker elsewhere finds the
+// job next in line with nothing else queued for it.
+// Destroying the job waits for its tasks.
+class ExecutorJob {
+public:
+    explicit ExecutorJob(unsigned parallelism = 0, int priority = 0, unsigned weight = 1, Executor& executor = sharedExecutor())
+        : executor_(executor) {
+        job_.maxRunning = parallelism;
+        job_.priority = priority;
+        job_.weight = std::max(1u, weight);
+        executor_.addJob(job_);
+    }
+
+    ~ExecutorJob() {
+        executor_.removeJob(job_);
+    }
+
+    ExecutorJob(const ExecutorJob&) = delete;
+    ExecutorJob& operator=(const ExecutorJob&) = delete;
+
+    template <typename F>
+    auto submit(F task) -> std::future<decltype(task())> {
+        return enqueue(executor_.nodeCount(), std::move(task));
+    }
+
+    template <typename F>
+    auto submitToNode(unsigned node, F task) -> std::future<decltype(task())> {
+        return enqueue(node % executor_.nodeCount(), std::move(task));
+    }
+
+    // How many of the job's tasks can run at once.
+    size_t size() const {
+        return job_.maxRunning ? std::min<size_t>(job_.maxRunning, executor_.size()) : executor_.size();
+    }
+
+    unsigned nodeCount() const {
+        return executor_.nodeCount();
+    }
+
+private:
+    template <typename F>
+    auto enqueue(unsigned node, F task) -> std::future<decltype(task())> {
+        auto packaged = std::make_shared<std::packaged_task<decltype(task())()>>(std::move(task));
+        std::future<decltype(task())> result = packaged->get_future();
+        executor_.enqueue(job_, node, [packaged] { (*packaged)(); });
+        return result;
+    }
+
+    Executor& executor_;
+    Executor::Job job_;
+};
+
+// --- Memory accounting ---
+// A pmr resource that forwards to its upstream and keeps track of current and peak usage, so the
+// block engine can report how much memory it actually needed.
+class TrackingResource : public std::pmr::memory_resource {
+public:
+    explicit TrackingResource(std::pmr::memory_resource* upstream = std::pmr::get_default_resource())
+        : upstream_(upstream) {}
+
+    uint64_t peak() const {
+        return peak_.load();
+    }
+
+    // Allocations made through the resource so far.
+    uint64_t allocations() const {
+        return allocations_.load(std::memory_order_relaxed);
+    }
+
+private:
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        void* memory = upstream_->allocate(bytes, alignment);
+        allocations_.fetch_add(1, std::memory_order_relaxed);
+        uint64_t now = current_.fetch_add(bytes) + bytes;
+        uint64_t seen = peak_.load();
+        while (now > seen && !peak_.compare_exchange_weak(seen, now)) {
+        }
+        return memory;
+    }
+
+    void do_deallocate(void* memory, size_t bytes, size_t alignment) override {
+        upstream_->deallocate(memory, bytes, alignment);
+        current_.fetch_sub(bytes);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+    std::pmr::memory_resource* upstream_;
+    std::atomic<uint64_t> current_{0};
+    std::atomic<uint64_t> peak_{0};
+    std::atomic<uint64_t> allocations_{0};
+};
+
+// --- Huge-page memory ---
+// Large block buffers are touched end to end on every block, so with 4 KiB pages they cost a TLB
+// miss every few kilobytes. This resource maps allocations of HUGE_PAGE_MIN_ALLOCATION or more in
+// whole 2 MiB pages: explicit huge pages (MAP_HUGETLB) when the system has some reserved, otherwise
+// an aligned anonymous mapping with MADV_HUGEPAGE so transparent huge pages can back it. Smaller
+// allocations (code and decode tables) are packed into shared huge-page chunks, which are only
+// returned when the resource is destroyed.
+const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+const size_t HUGE_PAGE_MIN_ALLOCATION = 256 * 1024;
+
+class HugePageResource : public std::pmr::memory_resource {
+public:
+    HugePageResource() = default;
+
+    ~HugePageResource() {
+        for (void* chunk : chunks_) {
+            munmap(chunk, HUGE_PAGE_SIZE);
+        }
+    }
+
+    HugePageResource(const HugePageResource&) = delete;
+    HugePageResource& operator=(const HugePageResource&) = delete;
+
+    // Memory actually taken by an allocation of `bytes`.
+    static size_t footprint(size_t bytes) {
+        return bytes >= HUGE_PAGE_MIN_ALLOCATION ? mappedSize(bytes) : bytes;
+    }
+
+private:
+    static size_t mappedSize(size_t bytes) {
+        return (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    }
+
+    static void* mapPages(size_t size) {
+        void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (memory != MAP_FAILED) {
+            countStat(COUNTER_HUGE_PAGE_BYTES, size);
+            return memory;
+        }
+        // No reserved huge pages: over-map, trim to a 2 MiB boundary and ask for THP.
+        void* raw = mmap(nullptr, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        uintptr_t start = reinterpret_cast<uintptr_t>(raw);
+        uintptr_t aligned = (start + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        if (aligned > start) {
+            munmap(raw, aligned - start);
+        }
+        if (aligned < start + HUGE_PAGE_SIZE) {
+            munmap(reinterpret_cast<void*>(aligned + size), start + HUGE_PAGE_SIZE - aligned);
+        }
+        madvise(reinterpret_cast<void*>(aligned), size, MADV_HUGEPAGE);
+        countStat(COUNTER_THP_ADVISED_BYTES, size);
+        return reinterpret_cast<void*>(aligned);
+    }
+
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        if (bytes >= HUGE_PAGE_MIN_ALLOCATION || alignment > HUGE_PAGE_SIZE / 2) {
+            return mapPages(mappedSize(bytes));
+        }
+        std::lock_guard<std::mutex> guard(lock_);
+        size_t offset = (chunkUsed_ + alignment - 1) & ~(alignment - 1);
+        if (chunks_.empty() || offset + bytes > HUGE_PAGE_SIZE) {
+            chunks_.push_back(mapPages(HUGE_PAGE_SIZE));
+            offset = 0;
+        }
+        chunkUsed_ = offset + bytes;
+        return static_cast<unsigned char*>(chunks_.back()) + offset;
+    }
+
+    void do_deallocate(void* memory, size_t bytes, size_t alignment) override {
+        if (bytes >= HUGE_PAGE_MIN_ALLOCATION || alignment > HUGE_PAGE_SIZE / 2) {
+            munmap(memory, mappedSize(bytes));
+        }
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+    std::mutex lock_;
+    std::vector<void*> chunks_;
+    size_t chunkUsed_ = 0;
+};
+
+// --- Parse a size such as 512K, 64M or 2G ---
+bool parseSize(const std::string& text, uint64_t& size) {
+    char* end = nullptr;
+    unsigned long long value = std::strtoull(text.c_str(), &end, 10);
+    if (end == text.c_str()) {
+        return false;
+    }
+    std::string suffix(end);
+    if (suffix == "K" || suffix == "k") {
+        value <<= 10;
+    } else if (suffix == "M" || suffix == "m") {
+        value <<= 20;
+    } else if (suffix == "G" || suffix == "g") {
+        value <<= 30;
+    } else if (!suffix.empty()) {
+        return false;
+    }
+    size = value;
+    return true;
+}
+
+// --- Long-distance matching ---
+// Blocks are coded independently and LZ only looks back within a block, so repeats further apart
+// than that (a file concatenated with an edited copy of itself, disk images, tarballs of similar
+// trees) go unnoticed. The long-match finder covers the whole input: a rolling hash over
+// LONG_MATCH_WINDOW bytes is sampled at content-defined positions, about one in 2^sampleBits, and
+// each sample's stream position is kept in a fixed-size hash table. When a sample hits an entry
+// for an earlier position, the candidate is read back from the input file, verified and extended
+// both ways. Matches are cut out of the block before it is coded; the decompressor copies them
+// back from the output it has already written, so a match's copy must end before the match starts.
+//
+// The table is the finder's only real memory and its size comes from --long=SIZE. The sampling
+// rate drops as the input grows so the table still spans all of it; a smaller table finds fewer,
+// longer matches rather than using more memory.
+const size_t LONG_MATCH_WINDOW = 64;      // Bytes hashed per sample
+const size_t LONG_MATCH_MIN = 128;        // Shorter matches don't pay for their entry
+const int LONG_MATCH_MIN_SAMPLE_BITS = 6; // At most one sample per 64 positions
+const size_t LONG_MATCH_CHUNK = 64 * 1024; // Largest verification read
+const uint64_t DEFAULT_LONG_MATCH_TABLE = 64ull << 20;
+const uint64_t LONG_MATCH_PRIME = 0x100000001b3ull;
+
+struct LongMatch {
+    uint32_t position; // Offset in the block
+    uint32_t length;
+    uint64_t source;   // Stream position of the earlier copy, ending before the match starts
+};
+
+class LongMatchFinder {
+public:
+    LongMatchFinder(std::pmr::memory_resource* resource, uint64_t tableBytes, uint64_t inputSize)
+        : table_(resource), history_(resource) {
+        table_.assign(tableEntries(tableBytes), Entry{NO_POSITION, 0});
+        mask_ = table_.size() - 1;
+        sampleBits_ = LONG_MATCH_MIN_SAMPLE_BITS;
+        while ((inputSize >> sampleBits_) > table_.size() && sampleBits_ < 30) {
+            ++sampleBits_;
+        }
+        history_.resize(LONG_MATCH_CHUNK);
+        for (size_t i = 1; i < LONG_MATCH_WINDOW; ++i) {
+            power_ *= LONG_MATCH_PRIME;
+        }
+    }
+
+    // Memory used for a table of at most `tableBytes`.
+    static uint64_t memoryBytes(uint64_t tableBytes) {
+        return tableEntries(tableBytes) * sizeof(Entry) + LONG_MATCH_CHUNK;
+    }
+
+    // Finds matches of `data`, the block starting at stream position `blockStart`, against the
+    // input before them, in increasing, non-overlapping order. Blocks must be passed in order.
+    void find(BlockReader& input, const unsigned char* data, size_t size, uint64_t blockStart, std::pmr::vector<LongMatch>& matches) {
+        matches.clear();
+        if (size < LONG_MATCH_WINDOW) {
+            return;
+        }
+        uint64_t hash = 0;
+        for (size_t i = 0; i < LONG_MATCH_WINDOW; ++i) {
+            hash = hash * LONG_MATCH_PRIME + data[i];
+        }
+        size_t matchedEnd = 0;
+        for (size_t i = 0;; ++i) {
+            if (hash >> (64 - sampleBits_) == 0) {
+                uint64_t mixed = mix(hash);
+                Entry& entry = table_[mixed & mask_];
+                uint32_t check = static_cast<uint32_t>(mixed >> 32);
+                LongMatch match;
+                if (i >= matchedEnd && entry.position != NO_POSITION && entry.check == check &&
+                    extend(input, data, size, blockStart, i, entry.position, matchedEnd, match)) {
+                    matches.push_back(match);
+                    matchedEnd = match.position + match.length;
+                }
+                entry = Entry{blockStart + i, check};
+            }
+            if (i + LONG_MATCH_WINDOW == size) {
+                break;
+            }
+            hash = (hash - data[i] * power_) * LONG_MATCH_PRIME + data[i + LONG_MATCH_WINDOW];
+        }
+    }
+
+    // Moves the bytes not covered by `matches` to the front of `data`; returns how many there are.
+    static size_t removeMatches(unsigned char* data, size_t size, const std::pmr::vector<LongMatch>& matches) {
+        size_t kept = 0;
+        size_t next = 0;
+        for (const LongMatch& match : matches) {
+            std::memmove(data + kept, data + next, match.position - next);
+            kept += match.position - next;
+            next = match.position + match.length;
+        }
+        std::memmove(data + kept, data + next, size - next);
+        return kept + size - next;
+    }
+
+private:
+    struct Entry {
+        uint64_t position;
+        uint32_t check; // High hash bits, to skip most false candidates without reading
+        uint32_t unused = 0; // Pads the entry to 16 bytes
+    };
+    static constexpr uint64_t NO_POSITION = ~0ull;
+
+    static size_t tableEntries(uint64_t tableBytes) {
+        size_t entries = 1;
+        while (entries * 2 * sizeof(Entry) <= tableBytes) {
+            entries *= 2;
+        }
+        return entries;
+    }
+
+    static uint64_t mix(uint64_t hash) {
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdull;
+        hash ^= hash >> 33;
+        return hash;
+    }
+
+    // Verifies the candidate at `source` for block offset `position` and extends it forwards up to
+    // the block's end (the copy staying before the match) and backwards down to `floor`.
+    bool extend(BlockReader& input, const unsigned char* data, size_t size, uint64_t blockStart, size_t position,
+                uint64_t source, size_t floor, LongMatch& match) {
+        // Start with a window's worth so a false candidate costs a small read.
+        uint64_t maxForward = std::min<uint64_t>(size - position, blockStart + position - source);
+        uint64_t forward = 0;
+        size_t chunk = LONG_MATCH_WINDOW;
+        while (forward < maxForward) {
+            chunk = std::min<uint64_t>(chunk, maxForward - forward);
+            if (!input.readAt(source + forward, history_.data(), chunk)) {
+                break;
+            }
+            const unsigned char* current = data + position + forward;
+            size_t same = 0;
+            while (same < chunk && history_[same] == current[same]) {
+                ++same;
+            }
+            forward += same;
+            if (same < chunk) {
+                break;
+            }
+            chunk = std::min(2 * chunk, LONG_MATCH_CHUNK);
+        }
+        if (forward < LONG_MATCH_WINDOW) {
+            return false;
+        }
+        // Unsampled positions before the hit are about 2^sampleBits long. The copy must still end
+        // before the match starts, so it can't grow past the distance between them.
+        uint64_t distance = blockStart + position - source;
+        size_t maxBackward = std::min<uint64_t>({position - floor, source, std::min<uint64_t>(LONG_MATCH_CHUNK, 16ull << sampleBits_),
+                                                 distance - forward});
+        size_t backward = 0;
+        if (maxBackward > 0 && input.readAt(source - maxBackward, history_.data(), maxBackward)) {
+            while (backward < maxBackward && history_[maxBackward - 1 - backward] == data[position - 1 - backward]) {
+                ++backward;
+            }
+        }
+        if (forward + backward < LONG_MATCH_MIN) {
+            return false;
+        }
+        match = LongMatch{static_cast<uint32_t>(position - backward), static_cast<uint32_t>(forward + backward), source - backward};
+        return true;
+    }
+
+    std::pmr::vector<Entry> table_;
+    std::pmr::vector<unsigned char> history_; // Verification reads
+    size_t mask_ = 0;
+    int sampleBits_ = LONG_MATCH_MIN_SAMPLE_BITS;
+    uint64_t power_ = 1; // LONG_MATCH_PRIME^(LONG_MATCH_WINDOW - 1)
+};
+
+// --- Block container format ---
+// compressFile splits its input into independently coded blocks, each with its own code table,
+// so blocks can be compressed and decompressed in parallel and memory use is bounded by the block
+// size rather than the file size. A block is stored with whichever method makes it smallest.
+//
+//   header: "HFBK" u32 version, u32 block size, u64 original size, u32 flags (version 2)
+//   blocks: u32 raw size, u32 stored size, u8 method, stored bytes
+//
+// The original size determines the number of blocks. BLOCK_FLAG_LZ tells the reader to budget for
+// LZ decoding, BLOCK_FLAG_FILTERS for filtered blocks and BLOCK_FLAG_WORDS for word-coded ones;
+// version 1 files have none of them. BLOCK_FLAG_SUMMARIES means the blocks are followed by a
+// table of block summaries, see "Block summaries", which decoding ignores. With BLOCK_FLAG_SYNC
+// every block starts with a sync marker, its index and a CRC-32 of the block (see blockChecksum),
+// and its header ends with a CRC-32 of the header fields before it (see blockHeaderChecksum):
+//
+//   block: u64 BLOCK_SYNC, u64 index, u32 CRC-32, u32 raw size, u32 stored size, u8 method,
+//          u32 header CRC-32, stored bytes
+//
+// Blocks are coded independently, each with its own tables, so a damaged block only loses its
+// own bytes: the reader checks the header before it trusts the stored size and the block before
+// decoding it, and with --recover it slides over damage to the next marker and writes zeros for
+// the blocks it lost. A BLOCK_FILTERED block holds a filter's streams, see "Block filters", and
+// a BLOCK_WORDS block is described under "Word-based coding". With BLOCK_FLAG_LONG a block's
+// method may carry BLOCK_LONG_MATCHES, in which case its stored bytes start with the long
+// matches cut out of it and the rest codes the remaining bytes with the method in the low bits:
+//
+//   u32 match count, (u32 position, u32 length, u64 source) per match, coded remainder
+const char BLOCK_MAGIC[4] = {'H', 'F', 'B', 'K'};
+const uint32_t BLOCK_VERSION = 2;
+const uint32_t BLOCK_FLAG_LZ = 1;
+const uint32_t BLOCK_FLAG_LONG = 2;
+const uint32_t BLOCK_FLAG_FILTERS = 4;
+const uint32_t BLOCK_FLAG_WORDS = 8;
+const uint32_t BLOCK_FLAG_SUMMARIES = 16;
+const uint32_t BLOCK_FLAG_SYNC = 32;
+const uint64_t BLOCK_SYNC = 0x1A434E5953464889ULL; // Bytes 89 'H' 'F' 'S' 'Y' 'N' 'C' 1A in file order
+const uint8_t BLOCK_STORED = 0;
+const uint8_t BLOCK_HUFFMAN = 1;
+const uint8_t BLOCK_LZ = 2;       // LzContext payload
+const uint8_t BLOCK_FILTERED = 3; // Filter streams, each coded on its own
+const uint8_t BLOCK_WORDS = 4;    // WordContext payload
+const uint8_t BLOCK_LONG_MATCHES = 0x80;
+const size_t LONG_MATCH_ENTRY_SIZE = 2 * sizeof(uint32_t) + sizeof(uint64_t);
+const size_t MIN_BLOCK_SIZE = 64 * 1024;
+const size_t DEFAULT_BLOCK_SIZE = 4 * 1024 * 1024;
+const size_t MAX_BLOCK_SIZE = 64 * 1024 * 1024;
+
+// Largest coded block worth keeping: anything bigger is stored raw instead.
+size_t blockOutputCapacity(size_t blockSize) {
+    return blockSize + sizeof(int) + 256 * (sizeof(char) + 2 * sizeof(int)) + 1 + sizeof(int);
+}
+
+// --- Bit streams for the large-alphabet coder ---
+// Codes are packed most significant bit first, as in encodeStream, and the last byte is padded
+// with zeros.
+template <typename Vector>
+class BitWriter {
+public:
+    explicit BitWriter(Vector& out) : out_(out) {}
+
+    void put(uint32_t code, int length) {
+        buffer_ = (buffer_ << length) | code;
+        count_ += length;
+        while (count_ >= 8) {
+            count_ -= 8;
+            out_.push_back(static_cast<unsigned char>(buffer_ >> count_));
+        }
+    }
+
+    void flush() {
+        if (count_ > 0) {
+            out_.push_back(static_cast<unsigned char>(buffer_ << (8 - count_)));
+            count_ = 0;
+        }
+    }
+
+private:
+    Vector& out_;
+    uint64_t buffer_ = 0;
+    int count_ = 0;
+};
+
+class BitReader {
+public:
+    BitReader(const unsigned char* data, size_t size) : data_(data), next_(data), end_(data + size) {}
+
+    // The next 57 or more bits, left-aligned; zeros past the end of the data.
+    uint64_t peek() {
+        while (available_ <= 56) {
+            if (next_ != end_) {
+                bits_ |= uint64_t(*next_++) << (56 - available_);
+            } else {
+                overrun_ += 8;
+            }
+            available_ += 8;
+        }
+        return bits_;
+    }
+
+    void skip(int length) {
+        bits_ <<= length;
+        available_ -= length;
+    }
+
+    // True if the bits taken lie within the data and end in its last byte.
+    bool endsInLastByte() const {
+        uint64_t total = 8 * uint64_t(end_ - data_);
+        uint64_t used = 8 * uint64_t(next_ - data_) + overrun_ - available_;
+        return used <= total && total - used < 8;
+    }
+
+private:
+    const unsigned char* data_;
+    const unsigned char* next_;
+    const unsigned char* end_;
+    uint64_t bits_ = 0;
+    int available_ = 0;
+    uint64_t overrun_ = 0; // Zero bits fed past the end
+};
+
+// --- Canonical Huffman codes over large alphabets ---
+// HuffmanContext is built around bytes: 256 symbols, a header entry per symbol and decode tables
+// for 15-bit codes. SymbolCoder<Symbol, ALPHABET> gives any alphabet of up to ALPHABET symbols,
+// such as 16-bit samples or word IDs, length-limited canonical codes of at most MAX_LENGTH bits.
+// Apart from the encoder's count and code per symbol, its memory grows with the number of
+// distinct symbols rather than the alphabet.
+//
+//   header: u8 longest code, varint codes per length (1 .. longest code), then, unless the
+//           symbols are implicit, per length its symbols in ascending order as varints: the
+//           first symbol, then the gap to the previous one minus 1
+//
+// Implicit symbols are the canonical indices 0, 1, ...; they suit alphabets the caller lays out
+// in code order itself, like a vocabulary. Codes of up to TABLE_BITS bits decode with one lookup;
+// longer ones with a second lookup in a subtable per primary entry, sized for the longest code
+// under it. Codes whose subtables would grow past MAX_SUBTABLE_ENTRIES, which only contrived
+// headers need, are found by comparing against the first code of each length instead.
+template <typename Symbol, size_t ALPHABET>
+class SymbolCoder {
+public:
+    static const int MAX_LENGTH = 24;
+    static const int TABLE_BITS = 11;
+    static const size_t MAX_SUBTABLE_ENTRIES = size_t(1) << 16;
+    static_assert(ALPHABET <= size_t(1) << 26, "symbols must fit the decode table entries");
+
+    explicit SymbolCoder(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : counts_(resource), length_(resource), code_(resource), sorted_(resource), nodeWeight_(resource), parent_(resource),
+          table_(resource) {}
+
+    // Working memory for an alphabet of `used` symbols.
+    static constexpr uint64_t memoryBytes(size_t used = ALPHABET) {
+        return used * (sizeof(uint64_t) + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(Symbol) + 2 * (sizeof(uint64_t) + sizeof(uint32_t))) +
+               ((size_t(1) << TABLE_BITS) + MAX_SUBTABLE_ENTRIES) * sizeof(uint32_t);
+    }
+
+    // --- Encoding ---
+    // Occurrences of each symbol; symbols past its size don't occur.
+    std::pmr::vector<uint64_t>& counts() {
+        return counts_;
+    }
+
+    // Builds the codes for counts() and returns the size in bits of the symbols counted.
+    uint64_t build() {
+        StageTimer timer(STAGE_BUILD_TREE);
+        countStat(COUNTER_TREE_BUILDS, 1);
+        size_t used = counts_.size();
+        sorted_.clear();
+        for (size_t symbol = 0; symbol < used; ++symbol) {
+            if (counts_[symbol]) {
+                sorted_.push_back(Symbol(symbol));
+            }
+        }
+        length_.assign(used, 0);
+        code_.resize(used);
+        std::fill(std::begin(lengthCount_), std::end(lengthCount_), 0);
+        maxLength_ = 0;
+        uint32_t symbols = sorted_.size();
+        if (symbols == 0) {
+            return 0;
+        }
+        std::sort(sorted_.begin(), sorted_.end(), [this](Symbol a, Symbol b) {
+            return counts_[a] != counts_[b] ? counts_[a] < counts_[b] : a < b;
+        });
+        nodeWeight_.resize(2 * symbols);
+        for (uint32_t i = 0; i < symbols; ++i) {
+            nodeWeight_[i] = counts_[sorted_[i]];
+        }
+        // Too deep: flatten the weights and try again. Halving keeps their order, so the leaves stay sorted.
+        while ((maxLength_ = buildLengths(symbols)) > MAX_LENGTH) {
+            for (uint32_t i = 0; i < symbols; ++i) {
+                nodeWeight_[i] = (nodeWeight_[i] >> 1) | 1;
+            }
+        }
+
+        // Canonical codes, ordered by length and then by symbol.
+        StageTimer codesTimer(STAGE_GENERATE_CODES);
+        countStat(COUNTER_CODE_TABLES, 1);
+        uint64_t bits = 0;
+        for (Symbol symbol : sorted_) {
+            lengthCount_[length_[symbol]]++;
+            bits += counts_[symbol] * length_[symbol];
+        }
+        uint32_t nextCode[MAX_LENGTH + 1] = {};
+        uint32_t nextIndex[MAX_LENGTH + 1] = {};
+        uint32_t code = 0;
+        for (int length = 1; length <= maxLength_; ++length) {
+            code = (code + lengthCount_[length - 1]) << 1;
+            nextCode[length] = code;
+            nextIndex[length] = nextIndex[length - 1] + lengthCount_[length - 1];
+        }
+        for (size_t symbol = 0; symbol < used; ++symbol) {
+            if (int length = length_[symbol]) {
+                code_[symbol] = nextCode[length]++;
+                sorted_[nextIndex[length]++] = Symbol(symbol);
+            }
+        }
+        return bits;
+    }
+
+    // Symbols that have a code, in canonical order.
+    const std::pmr::vector<Symbol>& sorted() const {
+        return sorted_;
+    }
+
+    template <typename Vector>
+    void writeHeader(Vector& out, bool implicitSymbols) const {
+        out.push_back(static_cast<unsigned char>(maxLength_));
+        for (int length = 1; length <= maxLength_; ++length) {
+            appendVarint(out, lengthCount_[length]);
+        }
+        if (implicitSymbols) {
+            return;
+        }
+        size_t index = 0;
+        for (int length = 1; length <= maxLength_; ++length) {
+            for (uint32_t i = 0; i < lengthCount_[length]; ++i, ++index) {
+                appendVarint(out, i == 0 ? sorted_[index] : sorted_[index] - sorted_[index - 1] - 1);
+            }
+        }
+    }
+
+    template <typename Writer>
+    void put(Symbol symbol, Writer& out) const {
+        out.put(code_[symbol], length_[symbol]);
+    }
+
+    // --- Decoding ---
+    // Reads a header at data[position] and builds the decode tables. False if it is corrupt.
+    bool readHeader(const unsigned char* data, size_t size, size_t& position, bool implicitSymbols) {
+        if (position >= size) {
+            return false;
+        }
+        maxLength_ = data[position++];
+        if (maxLength_ < 1 || maxLength_ > MAX_LENGTH) {
+            return false;
+        }
+        uint64_t symbols = 0;
+        uint64_t kraft = 0;
+        for (int length = 1; length <= maxLength_; ++length) {
+            if (!takeVarint(data, size, position, lengthCount_[length])) {
+                return false;
+            }
+            symbols += lengthCount_[length];
+            kraft += uint64_t(lengthCount_[length]) << (MAX_LENGTH - length);
+        }
+        if (symbols == 0 || symbols > ALPHABET || kraft > uint64_t(1) << MAX_LENGTH) {
+            return false;
+        }
+        sorted_.resize(symbols);
+        size_t index = 0;
+        for (int length = 1; length <= maxLength_; ++length) {
+            for (uint32_t i = 0; i < lengthCount_[length]; ++i, ++index) {
+                uint32_t value = index;
+                if (!implicitSymbols) {
+                    if (!takeVarint(data, size, position, value) || (i > 0 && value >= ALPHABET - 1 - sorted_[index - 1])) {
+                        return false;
+                    }
+                    value += i > 0 ? sorted_[index - 1] + 1 : 0;
+                    if (value >= ALPHABET) {
+                        return false;
+                    }
+                }
+                sorted_[index] = Symbol(value);
+            }
+        }
+        buildTables();
+        return true;
+    }
+
+    // Number of symbols the last header listed.
+    size_t symbolCount() const {
+        return sorted_.size();
+    }
+
+    // Decodes one symbol, tallying it in `misses` if it wasn't in the primary table. False if the
+    // bits are no code.
+    bool get(BitReader& in, Symbol& symbol, TableMisses& misses) const {
+        uint64_t bits = in.peek();
+        uint32_t entry = table_[bits >> (64 - TABLE_BITS)];
+        if (entry & LINK) {
+            entry = table_[(entry >> 6) + ((bits << TABLE_BITS) >> (64 - (entry & 0x1F)))];
+            ++misses.subtable;
+        }
+        int length = entry & 0x1F;
+        if (length == 0) {
+            ++misses.fallback;
+            // Not in the tables: compare against the first code of each longer length.
+            for (length = TABLE_BITS + 1; length <= maxLength_; ++length) {
+                uint32_t offset = uint32_t(bits >> (64 - length)) - firstCode_[length];
+                if (offset < lengthCount_[length]) {
+                    entry = uint32_t(sorted_[firstIndex_[length] + offset]) << 6 | length;
+                    break;
+                }
+            }
+            if (length > maxLength_) {
+                return false;
+            }
+        }
+        symbol = Symbol(entry >> 6);
+        in.skip(length);
+        return true;
+    }
+
+private:
+    // Table entries: symbol << 6 | code length, or, with LINK, subtable offset << 6 | LINK |
+    // subtable bits. 0 marks bits that start no code in the tables.
+    static const uint32_t LINK = 0x20;
+
+    // Code lengths for the sorted leaf weights in nodeWeight_[0, symbols), by the two-queue
+    // method: merged nodes are created in order of weight, so the lightest two are always at the
+    // front of the leaves or of the merged nodes. Returns the longest code.
+    int buildLengths(uint32_t symbols) {
+        if (symbols == 1) {
+            length_[sorted_[0]] = 1; // A lone symbol still needs a one-bit code
+            return 1;
+        }
+        parent_.resize(2 * symbols - 1);
+        uint32_t leaf = 0;
+        uint32_t merged = symbols;
+        uint32_t next = symbols;
+        auto lightest = [&] {
+            return leaf < symbols && (merged == next || nodeWeight_[leaf] <= nodeWeight_[merged]) ? leaf++ : merged++;
+        };
+        for (; next < 2 * symbols - 1; ++next) {
+            uint32_t left = lightest();
+            uint32_t right = lightest();
+            nodeWeight_[next] = nodeWeight_[left] + nodeWeight_[right];
+            parent_[left] = parent_[right] = next;
+        }
+        // Depths from the root down, in parent_ itself: a node's parent always comes after it.
+        parent_[2 * symbols - 2] = 0;
+        for (uint32_t node = 2 * symbols - 2; node-- > 0;) {
+            parent_[node] = parent_[parent_[node]] + 1;
+        }
+        int maxLength = 0;
+        for (uint32_t i = 0; i < symbols; ++i) {
+            maxLength = std::max<int>(maxLength, parent_[i]);
+            length_[sorted_[i]] = std::min<uint32_t>(parent_[i], 255);
+        }
+        return maxLength;
+    }
+
+    void buildTables() {
+        StageTimer timer(STAGE_GENERATE_CODES);
+        uint32_t nextCode = 0;
+        uint32_t index = 0;
+        for (int length = 1; length <= maxLength_; ++length) {
+            nextCode = (nextCode + lengthCount_[length - 1]) << 1;
+            firstCode_[length] = nextCode;
+            firstIndex_[length] = index;
+            index += lengthCount_[length];
+        }
+        table_.assign(size_t(1) << TABLE_BITS, 0);
+        uint8_t subBits[1 << TABLE_BITS] = {};
+        for (int length = 1; length <= maxLength_; ++length) {
+            for (uint32_t i = 0; i < lengthCount_[length]; ++i) {
+                uint32_t code = firstCode_[length] + i;
+                uint32_t entry = uint32_t(sorted_[firstIndex_[length] + i]) << 6 | length;
+                if (length <= TABLE_BITS) {
+                    uint32_t first = code << (TABLE_BITS - length);
+                    std::fill(table_.begin() + first, table_.begin() + first + (1u << (TABLE_BITS - length)), entry);
+                    continue;
+                }
+                // Codes under one prefix are consecutive and the last is the longest, so its
+                // subtable is sized when the prefix first comes up.
+                uint32_t prefix = code >> (length - TABLE_BITS);
+                if (table_[prefix] == 0) {
+                    int longest = length;
+                    for (int longer = maxLength_; longer > length && longest == length; --longer) {
+                        uint32_t last = firstCode_[longer] + lengthCount_[longer] - 1;
+                        if (lengthCount_[longer] && (firstCode_[longer] >> (longer - TABLE_BITS)) <= prefix &&
+                            (last >> (longer - TABLE_BITS)) >= prefix) {
+                            longest = longer;
+                        }
+                    }
+                    size_t entries = size_t(1) << (longest - TABLE_BITS);
+                    if (table_.size() - (size_t(1) << TABLE_BITS) + entries > MAX_SUBTABLE_ENTRIES) {
+                        continue; // Left to the search in get()
+                    }
+                    table_[prefix] = uint32_t(table_.size()) << 6 | LINK | (longest - TABLE_BITS);
+                    subBits[prefix] = longest - TABLE_BITS;
+                    table_.resize(table_.size() + entries, 0);
+                } else if (!(table_[prefix] & LINK)) {
+                    continue;
+                }
+                int bits = subBits[prefix];
+                uint32_t suffix = code & ((1u << (length - TABLE_BITS)) - 1);
+                uint32_t first = (table_[prefix] >> 6) + (suffix << (bits - (length - TABLE_BITS)));
+                std::fill(table_.begin() + first, table_.begin() + first + (1u << (bits - (length - TABLE_BITS))), entry);
+            }
+        }
+    }
+
+    std::pmr::vector<uint64_t> counts_;
+    std::pmr::vector<uint8_t> length_; // Code length per symbol, 0 = no code
+    std::pmr::vector<uint32_t> code_;
+    std::pmr::vector<Symbol> sorted_; // Symbols with a code: by weight while building, then canonical
+    std::pmr::vector<uint64_t> nodeWeight_;
+    std::pmr::vector<uint32_t> parent_;
+    std::pmr::vector<uint32_t> table_; // Primary table, then the subtables
+    uint32_t lengthCount_[MAX_LENGTH + 1] = {};
+    uint32_t firstCode_[MAX_LENGTH + 1] = {};
+    uint32_t firstIndex_[MAX_LENGTH + 1] = {};
+    int maxLength_ = 0;
+};
+
+// --- Block filters ---
+// Reversible transforms that reshape a block before entropy coding. A filter splits the block
+// into streams of similar bytes, and each stream is coded on its own with its own code table.
+// With --filter=auto each block picks a filter by trying the candidates on a sample of it and
+// comparing the estimated coded size. A filtered block is kept only if it beats plain Huffman
+// coding of the block.
+//
+//   filtered block: u8 filter, u8 parameter, u8 stream count,
+//                   per stream: u32 raw size, u8 method, u32 stored size, stored bytes
+enum BlockFilter : uint8_t {
+    FILTER_NONE = 0,
+    FILTER_COLUMNS = 1, // Delimited records, one stream per field; parameter: the delimiter
+    FILTER_SHUFFLE = 2, // Fixed-width elements, one stream per byte position; parameter: the width
+    FILTER_DELTA = 3,   // Zigzag-coded differences of integers, then shuffled; parameter: the width
+    FILTER_XOR = 4,     // XOR of each float with the previous one, then shuffled; parameter: the width
+    FILTER_X86 = 5,     // x86 call and jump targets made absolute, in a stream of their own
+    FILTER_ENCODED = 6, // Base64 and hex runs decoded to bytes; parameter: ENCODED_* to look for
+    FILTER_SAMPLES = 7, // Zigzag-coded differences of 16-bit samples, each coded as one symbol
+    FILTER_AUTO = 0xFF, // Option only: choose per block
+};
+
+const size_t FILTER_SAMPLE_SIZE = 64 * 1024;
+const size_t MAX_FILTER_STREAMS = 64;
+
+// Most bytes a filter may produce for a block of `size` bytes.
+size_t filteredCapacity(size_t size) {
+    return size + size / 16 + 1024;
+}
+
+// --- Streams produced by a filter, back to back in one buffer ---
+using SampleCoder = SymbolCoder<uint16_t, 65536>;
+
+struct FilterStreams {
+    explicit FilterStreams(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : bytes(resource), ends(resource), samples(resource) {}
+
+    void clear() {
+        bytes.clear();
+        ends.clear();
+    }
+
+    size_t count() const {
+        return ends.size();
+    }
+
+    const unsigned char* data(size_t stream) const {
+        return bytes.data() + begin(stream);
+    }
+
+    size_t size(size_t stream) const {
+        return ends[stream] - begin(stream);
+    }
+
+    // Lays out streams of the given sizes; returns a pointer to the first.
+    unsigned char* allocate(const size_t* sizes, size_t count) {
+        clear();
+        size_t total = 0;
+        for (size_t i = 0; i < count; ++i) {
+            total += sizes[i];
+            ends.push_back(total);
+        }
+        bytes.resize(total);
+        return bytes.data();
+    }
+
+    std::pmr::vector<unsigned char> bytes;
+    std::pmr::vector<uint32_t> ends;
+    SampleCoder samples; // Codes the FILTER_SAMPLES stream, see appendSamples
+
+private:
+    size_t begin(size_t stream) const {
+        return stream ? ends[stream - 1] : 0;
+    }
+};
+
+// --- Column transpose for delimited text (CSV, TSV) ---
+// Field k of every record goes to stream k; fields past the last stream share it. Each field
+// keeps the byte that ended it, the delimiter or '\n', so rows are rebuilt by taking fields
+// from stream 0, 1, ... until one ends in '\n'. Quoted delimiters only split a field in two,
+// which costs ratio but not correctness, so any input round-trips.
+bool columnsForward(const unsigned char* data, size_t size, unsigned char delimiter, FilterStreams& out) {
+    size_t sizes[MAX_FILTER_STREAMS] = {};
+    size_t columns = 0;
+    size_t column = 0;
+    size_t fieldStart = 0;
+    for (size_t i = 0; i < size; ++i) {
+        if (data[i] == delimiter || data[i] == '\n') {
+            size_t stream = std::min(column, MAX_FILTER_STREAMS - 1);
+            sizes[stream] += i + 1 - fieldStart;
+            columns = std::max(columns, stream + 1);
+            column = data[i] == '\n' ? 0 : column + 1;
+            fieldStart = i + 1;
+        }
+    }
+    if (fieldStart < size) {
+        size_t stream = std::min(column, MAX_FILTER_STREAMS - 1);
+        sizes[stream] += size - fieldStart;
+        columns = std::max(columns, stream + 1);
+    }
+    if (columns < 2) {
+        return false;
+    }
+    unsigned char* base = out.allocate(sizes, columns);
+    unsigned char* next[MAX_FILTER_STREAMS];
+    for (size_t stream = 0; stream < columns; ++stream) {
+        next[stream] = base + (stream ? out.ends[stream - 1] : 0);
+    }
+    column = 0;
+    fieldStart = 0;
+    for (size_t i = 0; i < size; ++i) {
+        if (data[i] == delimiter || data[i] == '\n') {
+            size_t stream = std::min(column, MAX_FILTER_STREAMS - 1);
+            std::memcpy(next[stream], data + fieldStart, i + 1 - fieldStart);
+            next[stream] += i + 1 - fieldStart;
+            column = data[i] == '\n' ? 0 : column + 1;
+            fieldStart = i + 1;
+        }
+    }
+    if (fieldStart < size) {
+        std::memcpy(next[std::min(column, MAX_FILTER_STREAMS - 1)], data + fieldStart, size - fieldStart);
+    }
+    return true;
+}
+
+template <typename Vector>
+bool columnsInverse(const FilterStreams& in, unsigned char delimiter, Vector& output) {
+    size_t columns = in.count();
+    if (columns == 0 || columns > MAX_FILTER_STREAMS) {
+        return false;
+    }
+    const unsigned char* next[MAX_FILTER_STREAMS];
+    const unsigned char* end[MAX_FILTER_STREAMS];
+    for (size_t stream = 0; stream < columns; ++stream) {
+        next[stream] = in.data(stream);
+        end[stream] = next[stream] + in.size(stream);
+    }
+    size_t column = 0;
+    for (;;) {
+        size_t stream = std::min(column, columns - 1);
+        const unsigned char* field = next[stream];
+        const unsigned char* p = field;
+        while (p != end[stream] && *p != delimiter && *p != '\n') {
+            ++p;
+        }
+        if (p == end[stream]) {
+            output.insert(output.end(), field, p); // The last field, without a terminator
+            next[stream] = p;
+            break;
+        }
+        output.insert(output.end(), field, p + 1);
+        next[stream] = p + 1;
+        column = *p == '\n' ? 0 : column + 1;
+    }
+    for (size_t stream = 0; stream < columns; ++stream) {
+        if (next[stream] != end[stream]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Delimiter of the records in `data`, or 0 if it doesn't look like delimited text: most lines
+// must contain the same non-zero number of one candidate delimiter outside double quotes.
+unsigned char detectDelimiter(const unsigned char* data, size_t size) {
+    const unsigned char candidates[] = {',', '\t', ';', '|'};
+    unsigned char best = 0;
+    for (unsigned char delimiter : candidates) {
+        size_t perLine[MAX_FILTER_STREAMS + 1] = {}; // Lines by delimiter count, the last for more
+        size_t lines = 0;
+        size_t count = 0;
+        bool quoted = false;
+        for (size_t i = 0; i < size; ++i) {
+            if (data[i] == '"') {
+                quoted = !quoted;
+            } else if (data[i] == delimiter && !quoted) {
+                ++count;
+            } else if (data[i] == '\n') {
+                quoted = false;
+                ++perLine[std::min(count, MAX_FILTER_STREAMS)];
+                ++lines;
+                count = 0;
+            }
+        }
+        if (lines < 8) {
+            return 0;
+        }
+        size_t mode = std::max_element(perLine + 1, perLine + MAX_FILTER_STREAMS) - perLine;
+        if (perLine[mode] * 10 >= lines * 8) {
+            best = delimiter;
+            break;
+        }
+    }
+    return best;
+}
+
+// --- Numeric filters for arrays of fixed-width elements ---
+// The parameter is the element width: 2, 4 or 8 bytes. Byte k of every element goes to stream
+// k, so the high bytes of small integers or the exponent bytes of floats get streams (and code
+// tables) of their own; the bytes after the last whole element end the last stream. Before the
+// shuffle, FILTER_DELTA replaces every integer by its difference from the previous one,
+// zigzag-coded so small negative steps have small codes too, and FILTER_XOR XORs every element
+// with the previous one (as Gorilla does for floats), which zeroes the sign, exponent and high
+// mantissa bits that slowly changing values share. Elements are processed 16 at a time, and the
+// byte transpose runs in SSE2 registers where available.
+const size_t SHUFFLE_GROUP = 16;
+
+bool isElementWidth(uint8_t width) {
+    return width == 2 || width == 4 || width == 8;
+}
+
+// Replaces each of `count` elements by its filtered value; `previous` is the element before them.
+template <BlockFilter Filter, typename T>
+inline void encodeElements(T* values, size_t count, T& previous) {
+    for (size_t i = 0; i < count; ++i) {
+        T value = values[i];
+        if constexpr (Filter == FILTER_DELTA) {
+            T difference = T(value - previous);
+            values[i] = T(T(difference << 1) ^ T(T(0) - T(difference >> (8 * sizeof(T) - 1))));
+        } else if constexpr (Filter == FILTER_XOR) {
+            values[i] = T(value ^ previous);
+        }
+        previous = value;
+    }
+}
+
+template <BlockFilter Filter, typename T>
+inline void decodeElements(T* values, size_t count, T& previous) {
+    for (size_t i = 0; i < count; ++i) {
+        T value = values[i];
+        if constexpr (Filter == FILTER_DELTA) {
+            value = T(previous + T(T(value >> 1) ^ T(T(0) - T(value & 1))));
+        } else if constexpr (Filter == FILTER_XOR) {
+            value = T(value ^ previous);
+        }
+        values[i] = value;
+        previous = value;
+    }
+}
+
+#if defined(__SSE2__)
+// One perfect shuffle of the Width vectors per round: the first and second half of their bytes
+// are interleaved, which rotates every byte's index left by one bit. Four rounds take byte k of
+// element i to k * 16 + i; log2(Width) rounds take it back.
+template <size_t Width, int Rounds>
+inline void interleaveBytes(__m128i (&v)[Width]) {
+    for (int round = 0; round < Rounds; ++round) {
+        __m128i next[Width];
+        for (size_t m = 0; m < Width / 2; ++m) {
+            next[2 * m] = _mm_unpacklo_epi8(v[m], v[m + Width / 2]);
+            next[2 * m + 1] = _mm_unpackhi_epi8(v[m], v[m + Width / 2]);
+        }
+        std::copy(next, next + Width, v);
+    }
+}
+#endif
+
+// Scatters the bytes of SHUFFLE_GROUP elements to position `offset` of each stream.
+template <size_t Width>
+inline void shuffleGroup(const unsigned char* elements, unsigned char* const* streams, size_t offset) {
+#if defined(__SSE2__)
+    __m128i v[Width];
+    for (size_t k = 0; k < Width; ++k) {
+        v[k] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(elements + 16 * k));
+    }
+    interleaveBytes<Width, 4>(v);
+    for (size_t k = 0; k < Width; ++k) {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(streams[k] + offset), v[k]);
+    }
+#else
+    for (size_t i = 0; i < SHUFFLE_GROUP; ++i) {
+        for (size_t k = 0; k < Width; ++k) {
+            streams[k][offset + i] = elements[i * Width + k];
+        }
+    }
+#endif
+}
+
+// Gathers SHUFFLE_GROUP elements from position `offset` of each stream.
+template <size_t Width>
+inline void unshuffleGroup(const unsigned char* const* streams, size_t offset, unsigned char* elements) {
+#if defined(__SSE2__)
+    __m128i v[Width];
+    for (size_t k = 0; k < Width; ++k) {
+        v[k] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(streams[k] + offset));
+    }
+    interleaveBytes<Width, Width == 2 ? 1 : Width == 4 ? 2 : 3>(v);
+    for (size_t k = 0; k < Width; ++k) {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(elements + 16 * k), v[k]);
+    }
+#else
+    for (size_t i = 0; i < SHUFFLE_GROUP; ++i) {
+        for (size_t k = 0; k < Width; ++k) {
+            elements[i * Width + k] = streams[k][offset + i];
+        }
+    }
+#endif
+}
+
+template <BlockFilter Filter, typename T>
+bool numericForward(const unsigned char* data, size_t size, FilterStreams& out) {
+    const size_t width = sizeof(T);
+    size_t count = size / width;
+    if (count == 0) {
+        return false;
+    }
+    size_t sizes[width];
+    std::fill(sizes, sizes + width, count);
+    sizes[width - 1] += size % width;
+    unsigned char* base = out.allocate(sizes, width);
+    unsigned char* streams[width];
+    for (size_t k = 0; k < width; ++k) {
+        streams[k] = base + k * count;
+    }
+    T values[SHUFFLE_GROUP];
+    T previous = 0;
+    size_t i = 0;
+    for (; i + SHUFFLE_GROUP <= count; i += SHUFFLE_GROUP) {
+        if constexpr (Filter == FILTER_SHUFFLE) {
+            shuffleGroup<width>(data + i * width, streams, i);
+        } else {
+            std::memcpy(values, data + i * width, sizeof(values));
+            encodeElements<Filter>(values, SHUFFLE_GROUP, previous);
+            shuffleGroup<width>(reinterpret_cast<const unsigned char*>(values), streams, i);
+        }
+    }
+    for (; i < count; ++i) {
+        std::memcpy(values, data + i * width, width);
+        encodeElements<Filter>(values, 1, previous);
+        for (size_t k = 0; k < width; ++k) {
+            streams[k][i] = reinterpret_cast<const unsigned char*>(values)[k];
+        }
+    }
+    std::memcpy(streams[width - 1] + count, data + count * width, size % width);
+    return true;
+}
+
+template <BlockFilter Filter, typename T, typename Vector>
+bool numericInverse(const FilterStreams& in, Vector& output) {
+    const size_t width = sizeof(T);
+    if (in.count() != width) {
+        return false;
+    }
+    size_t count = in.size(0);
+    for (size_t k = 1; k + 1 < width; ++k) {
+        if (in.size(k) != count) {
+            return false;
+        }
+    }
+    if (in.size(width - 1) < count || in.size(width - 1) - count >= width) {
+        return false;
+    }
+    size_t tail = in.size(width - 1) - count;
+    size_t start = output.size();
+    output.resize(start + count * width + tail);
+    unsigned char* target = output.data() + start;
+    const unsigned char* streams[width];
+    for (size_t k = 0; k < width; ++k) {
+        streams[k] = in.data(k);
+    }
+    T values[SHUFFLE_GROUP];
+    T previous = 0;
+    size_t i = 0;
+    for (; i + SHUFFLE_GROUP <= count; i += SHUFFLE_GROUP) {
+        if constexpr (Filter == FILTER_SHUFFLE) {
+            unshuffleGroup<width>(streams, i, target + i * width);
+        } else {
+            unshuffleGroup<width>(streams, i, reinterpret_cast<unsigned char*>(values));
+            decodeElements<Filter>(values, SHUFFLE_GROUP, previous);
+            std::memcpy(target + i * width, values, sizeof(values));
+        }
+    }
+    for (; i < count; ++i) {
+        for (size_t k = 0; k < width; ++k) {
+            reinterpret_cast<unsigned char*>(values)[k] = streams[k][i];
+        }
+        decodeElements<Filter>(values, 1, previous);
+        std::memcpy(target + i * width, values, width);
+    }
+    std::memcpy(target + count * width, streams[width - 1] + count, tail);
+    return true;
+}
+
+template <BlockFilter Filter>
+bool numericForward(uint8_t width, const unsigned char* data, size_t size, FilterStreams& out) {
+    switch (width) {
+    case 2:
+        return numericForward<Filter, uint16_t>(data, size, out);
+    case 4:
+        return numericForward<Filter, uint32_t>(data, size, out);
+    case 8:
+        return numericForward<Filter, uint64_t>(data, size, out);
+    default:
+        return false;
+    }
+}
+
+template <BlockFilter Filter, typename Vector>
+bool numericInverse(uint8_t width, const FilterStreams& in, Vector& output) {
+    switch (width) {
+    case 2:
+        return numericInverse<Filter, uint16_t>(in, output);
+    case 4:
+        return numericInverse<Filter, uint32_t>(in, output);
+    case 8:
+        return numericInverse<Filter, uint64_t>(in, output);
+    default:
+        return false;
+    }
+}
+
+// --- 16-bit samples (audio, sensor readings) ---
+// FILTER_SAMPLES takes the same differences as FILTER_DELTA at width 2 but keeps them whole:
+// stream 0 holds one 16-bit difference per sample and is coded with a SampleCoder, so a
+// sample's two bytes share one code instead of each byte position getting a table of its own.
+// An odd last byte is stream 1.
+bool samplesForward(const unsigned char* data, size_t size, FilterStreams& out) {
+    size_t count = size / 2;
+    if (count == 0) {
+        return false;
+    }
+    size_t sizes[2] = {2 * count, size % 2};
+    unsigned char* target = out.allocate(sizes, 2);
+    uint16_t values[SHUFFLE_GROUP];
+    uint16_t previous = 0;
+    for (size_t i = 0; i < count; i += SHUFFLE_GROUP) {
+        size_t group = std::min(SHUFFLE_GROUP, count - i);
+        std::memcpy(values, data + 2 * i, 2 * group);
+        encodeElements<FILTER_DELTA>(values, group, previous);
+        std::memcpy(target + 2 * i, values, 2 * group);
+    }
+    std::memcpy(target + 2 * count, data + 2 * count, size % 2);
+    return true;
+}
+
+template <typename Vector>
+bool samplesInverse(const FilterStreams& in, Vector& output) {
+    if (in.count() != 2 || in.size(0) % 2 != 0 || in.size(1) > 1) {
+        return false;
+    }
+    size_t count = in.size(0) / 2;
+    size_t start = output.size();
+    output.resize(start + in.size(0) + in.size(1));
+    unsigned char* target = output.data() + start;
+    uint16_t values[SHUFFLE_GROUP];
+    uint16_t previous = 0;
+    for (size_t i = 0; i < count; i += SHUFFLE_GROUP) {
+        size_t group = std::min(SHUFFLE_GROUP, count - i);
+        std::memcpy(values, in.data(0) + 2 * i, 2 * group);
+        decodeElements<FILTER_DELTA>(values, group, previous);
+        std::memcpy(target + 2 * i, values, 2 * group);
+    }
+    std::memcpy(target + 2 * count, in.data(1), in.size(1));
+    return true;
+}
+
+// --- x86 branch converter (BCJ) ---
+// The 32-bit displacement of an x86 call (E8) or jump (E9) is relative to the next instruction,
+// so calls to one function from different places all differ. Adding the position turns them
+// into the same absolute target. Displacements whose top byte is 00 or FF, the near ones a
+// real branch has, are converted modulo 2^25 within that range, which maps the range onto
+// itself, so every input round-trips; others are left as they are. The displacements go to
+// stream 1, the other bytes, opcodes included, to stream 0. An E8 or E9 always takes the next
+// four bytes with it, so both directions find the same opcodes.
+const size_t X86_BRANCH_SIZE = 5;
+
+inline bool isX86Branch(unsigned char opcode) {
+    return (opcode & 0xFE) == 0xE8;
+}
+
+// Converts a displacement at `position` to its target, or back; identity outside 00/FF.
+inline uint32_t convertX86Displacement(uint32_t value, uint32_t position, bool encode) {
+    uint32_t top = value >> 24;
+    if (top != 0 && top != 0xFF) {
+        return value;
+    }
+    value = encode ? value + position : value - position;
+    return (value & 0x1FFFFFF) - ((value & 0x1000000) << 1); // Sign-extend bit 24
+}
+
+size_t countX86Branches(const unsigned char* data, size_t size) {
+    size_t branches = 0;
+    for (size_t i = 0; i + X86_BRANCH_SIZE <= size; ++i) {
+        if (isX86Branch(data[i])) {
+            ++branches;
+            i += X86_BRANCH_SIZE - 1;
+        }
+    }
+    return branches;
+}
+
+bool x86Forward(const unsigned char* data, size_t size, FilterStreams& out) {
+    size_t branches = countX86Branches(data, size);
+    if (branches == 0) {
+        return false;
+    }
+    size_t sizes[2] = {size - 4 * branches, 4 * branches};
+    unsigned char* code = out.allocate(sizes, 2);
+    unsigned char* targets = code + sizes[0];
+    for (size_t i = 0; i < size; ++i) {
+        *code++ = data[i];
+        if (isX86Branch(data[i]) && i + X86_BRANCH_SIZE <= size) {
+            uint32_t displacement;
+            std::memcpy(&displacement, data + i + 1, sizeof(displacement));
+            displacement = convertX86Displacement(displacement, uint32_t(i + X86_BRANCH_SIZE), true);
+            std::memcpy(targets, &displacement, sizeof(displacement));
+            targets += sizeof(displacement);
+            i += X86_BRANCH_SIZE - 1;
+        }
+    }
+    return true;
+}
+
+template <typename Vector>
+bool x86Inverse(const FilterStreams& in, Vector& output) {
+    if (in.count() != 2 || in.size(1) % 4) {
+        return false;
+    }
+    size_t size = in.size(0) + in.size(1);
+    size_t start = output.size();
+    output.resize(start + size);
+    unsigned char* target = output.data() + start;
+    const unsigned char* code = in.data(0);
+    const unsigned char* codeEnd = code + in.size(0);
+    const unsigned char* targets = in.data(1);
+    const unsigned char* targetsEnd = targets + in.size(1);
+    for (size_t i = 0; i < size; ++i) {
+        if (code == codeEnd) {
+            return false;
+        }
+        target[i] = *code++;
+        if (isX86Branch(target[i]) && i + X86_BRANCH_SIZE <= size) {
+            if (targetsEnd - targets < 4) {
+                return false;
+            }
+            uint32_t displacement;
+            std::memcpy(&displacement, targets, sizeof(displacement));
+            targets += sizeof(displacement);
+            displacement = convertX86Displacement(displacement, uint32_t(i + X86_BRANCH_SIZE), false);
+            std::memcpy(target + i + 1, &displacement, sizeof(displacement));
+            i += X86_BRANCH_SIZE - 1;
+        }
+    }
+    return code == codeEnd && targets == targetsEnd;
+}
+
+// True if `data` looks like x86 machine code: most E8/E9 bytes are followed by a near
+// displacement, as calls and jumps are, rather than by 2 in 256 of them as in other data.
+bool looksLikeX86(const unsigned char* data, size_t size) {
+    size_t branches = 0;
+    size_t near = 0;
+    for (size_t i = 0; i + X86_BRANCH_SIZE <= size; ++i) {
+        if (isX86Branch(data[i])) {
+            ++branches;
+            near += data[i + 4] == 0 || data[i + 4] == 0xFF;
+            i += X86_BRANCH_SIZE - 1;
+        }
+    }
+    return near >= 16 && near * 2 >= branches;
+}
+
+// --- Base64 and hex runs in text ---
+// JSON, XML and logs embed binary data as base64 or hex text, which spends 8 bits per 6 or 4 bits
+// of data. This filter decodes long runs back to bytes. Only whole groups are decoded, 4 base64
+// characters or 2 hex digits of one case, which re-encode to exactly the same text; padding and
+// leftover characters stay in the text. Stream 0 is the text around the runs, stream 1 the
+// decoded bytes, and stream 2 describes each run:
+//
+//   u32 text bytes since the previous run, u32 run length in characters << 2 | ENCODING_*
+const uint8_t ENCODED_BASE64 = 1; // --filter parameter bits: encodings to look for
+const uint8_t ENCODED_HEX = 2;
+const uint8_t ENCODING_BASE64 = 0; // Run kinds
+const uint8_t ENCODING_HEX_LOWER = 1;
+const uint8_t ENCODING_HEX_UPPER = 2;
+const size_t MIN_BASE64_RUN = 64;
+const size_t MIN_HEX_RUN = 32;
+const size_t ENCODED_RUN_ENTRY_SIZE = 2 * sizeof(uint32_t);
+
+const char BASE64_ALPHABET[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+const char HEX_LOWER[] = "0123456789abcdef";
+const char HEX_UPPER[] = "0123456789ABCDEF";
+
+// Value of each character in base64 and in hex, or 0xFF.
+struct EncodingTables {
+    EncodingTables() {
+        std::fill(std::begin(base64), std::end(base64), 0xFF);
+        std::fill(std::begin(hex), std::end(hex), 0xFF);
+        for (int i = 0; i < 64; ++i) {
+            base64[static_cast<unsigned char>(BASE64_ALPHABET[i])] = i;
+        }
+        for (int i = 0; i < 16; ++i) {
+            hex[static_cast<unsigned char>(HEX_LOWER[i])] = i;
+            hex[static_cast<unsigned char>(HEX_UPPER[i])] = i;
+        }
+    }
+    unsigned char base64[256];
+    unsigned char hex[256];
+};
+
+const EncodingTables& encodingTables() {
+    static const EncodingTables tables;
+    return tables;
+}
+
+size_t decodedRunSize(size_t length, uint8_t kind) {
+    return kind == ENCODING_BASE64 ? length / 4 * 3 : length / 2;
+}
+
+// Calls visit(start, length, kind) for every decodable run in `data`, in order.
+template <typename Visit>
+void forEachEncodedRun(const unsigned char* data, size_t size, uint8_t encodings, Visit visit) {
+    const EncodingTables& tables = encodingTables();
+    size_t i = 0;
+    while (i < size) {
+        if (tables.base64[data[i]] == 0xFF) {
+            ++i;
+            continue;
+        }
+        size_t start = i;
+        bool lower = true; // Only hex digits of one case so far
+        bool upper = true;
+        for (; i < size && tables.base64[data[i]] != 0xFF; ++i) {
+            bool digit = data[i] >= '0' && data[i] <= '9';
+            lower &= digit || (data[i] >= 'a' && data[i] <= 'f');
+            upper &= digit || (data[i] >= 'A' && data[i] <= 'F');
+        }
+        size_t length = i - start;
+        if ((lower || upper) && (encodings & ENCODED_HEX)) {
+            if (length >= MIN_HEX_RUN) {
+                visit(start, length & ~size_t(1), lower ? ENCODING_HEX_LOWER : ENCODING_HEX_UPPER);
+            }
+        } else if (length >= MIN_BASE64_RUN && (encodings & ENCODED_BASE64)) {
+            visit(start, length & ~size_t(3), ENCODING_BASE64);
+        }
+    }
+}
+
+bool encodedForward(const unsigned char* data, size_t size, uint8_t encodings, FilterStreams& out) {
+    size_t sizes[3] = {size, 0, 0};
+    forEachEncodedRun(data, size, encodings, [&](size_t, size_t length, uint8_t kind) {
+        sizes[0] -= length;
+        sizes[1] += decodedRunSize(length, kind);
+        sizes[2] += ENCODED_RUN_ENTRY_SIZE;
+    });
+    if (sizes[2] == 0 || size > UINT32_MAX / 4) {
+        return false;
+    }
+    unsigned char* text = out.allocate(sizes, 3);
+    unsigned char* bytes = text + sizes[0];
+    unsigned char* runs = bytes + sizes[1];
+    const EncodingTables& tables = encodingTables();
+    size_t copied = 0;
+    forEachEncodedRun(data, size, encodings, [&](size_t start, size_t length, uint8_t kind) {
+        uint32_t entry[2] = {uint32_t(start - copied), uint32_t(length << 2 | kind)};
+        std::memcpy(runs, entry, sizeof(entry));
+        runs += sizeof(entry);
+        std::memcpy(text, data + copied, start - copied);
+        text += start - copied;
+        const unsigned char* p = data + start;
+        if (kind == ENCODING_BASE64) {
+            for (size_t group = 0; group < length; group += 4, p += 4) {
+                uint32_t bits = tables.base64[p[0]] << 18 | tables.base64[p[1]] << 12 | tables.base64[p[2]] << 6 | tables.base64[p[3]];
+                *bytes++ = bits >> 16;
+                *bytes++ = bits >> 8;
+                *bytes++ = bits;
+            }
+        } else {
+            for (size_t pair = 0; pair < length; pair += 2, p += 2) {
+                *bytes++ = tables.hex[p[0]] << 4 | tables.hex[p[1]];
+            }
+        }
+        copied = start + length;
+    });
+    std::memcpy(text, data + copied, size - copied);
+    return true;
+}
+
+template <typename Vector>
+bool encodedInverse(const FilterStreams& in, Vector& output) {
+    if (in.count() != 3 || in.size(2) % ENCODED_RUN_ENTRY_SIZE) {
+        return false;
+    }
+    const unsigned char* text = in.data(0);
+    const unsigned char* textEnd = text + in.size(0);
+    const unsigned char* bytes = in.data(1);
+    const unsigned char* bytesEnd = bytes + in.size(1);
+    const unsigned char* runs = in.data(2);
+    const unsigned char* runsEnd = runs + in.size(2);
+    for (; runs != runsEnd; runs += ENCODED_RUN_ENTRY_SIZE) {
+        uint32_t entry[2];
+        std::memcpy(entry, runs, sizeof(entry));
+        size_t length = entry[1] >> 2;
+        uint8_t kind = entry[1] & 3;
+        if (entry[0] > size_t(textEnd - text) || kind > ENCODING_HEX_UPPER || length % (kind == ENCODING_BASE64 ? 4 : 2) ||
+            decodedRunSize(length, kind) > size_t(bytesEnd - bytes)) {
+            return false;
+        }
+        output.insert(output.end(), text, text + entry[0]);
+        text += entry[0];
+        size_t start = output.size();
+        output.resize(start + length);
+        unsigned char* target = output.data() + start;
+        if (kind == ENCODING_BASE64) {
+            for (size_t group = 0; group < length; group += 4, bytes += 3) {
+                uint32_t bits = bytes[0] << 16 | bytes[1] << 8 | bytes[2];
+                *target++ = BASE64_ALPHABET[bits >> 18];
+                *target++ = BASE64_ALPHABET[(bits >> 12) & 63];
+                *target++ = BASE64_ALPHABET[(bits >> 6) & 63];
+                *target++ = BASE64_ALPHABET[bits & 63];
+            }
+        } else {
+            const char* digits = kind == ENCODING_HEX_LOWER ? HEX_LOWER : HEX_UPPER;
+            for (size_t pair = 0; pair < length; pair += 2, ++bytes) {
+                *target++ = digits[*bytes >> 4];
+                *target++ = digits[*bytes & 15];
+            }
+        }
+    }
+    output.insert(output.end(), text, textEnd);
+    return bytes == bytesEnd;
+}
+
+// --- Apply and undo a filter ---
+bool filterForward(BlockFilter filter, uint8_t parameter, const unsigned char* data, size_t size, FilterStreams& out) {
+    switch (filter) {
+    case FILTER_COLUMNS:
+        return columnsForward(data, size, parameter, out);
+    case FILTER_SHUFFLE:
+        return numericForward<FILTER_SHUFFLE>(parameter, data, size, out);
+    case FILTER_DELTA:
+        return numericForward<FILTER_DELTA>(parameter, data, size, out);
+    case FILTER_XOR:
+        return numericForward<FILTER_XOR>(parameter, data, size, out);
+    case FILTER_X86:
+        return x86Forward(data, size, out);
+    case FILTER_ENCODED:
+        return encodedForward(data, size, parameter, out);
+    case FILTER_SAMPLES:
+        return samplesForward(data, size, out);
+    default:
+        return false;
+    }
+}
+
+template <typename Vector>
+bool filterInverse(BlockFilter filter, uint8_t parameter, const FilterStreams& in, Vector& output) {
+    switch (filter) {
+    case FILTER_COLUMNS:
+        return columnsInverse(in, parameter, output);
+    case FILTER_SHUFFLE:
+        return numericInverse<FILTER_SHUFFLE>(parameter, in, output);
+    case FILTER_DELTA:
+        return numericInverse<FILTER_DELTA>(parameter, in, output);
+    case FILTER_XOR:
+        return numericInverse<FILTER_XOR>(parameter, in, output);
+    case FILTER_X86:
+        return x86Inverse(in, output);
+    case FILTER_ENCODED:
+        return encodedInverse(in, output);
+    case FILTER_SAMPLES:
+        return samplesInverse(in, output);
+    default:
+        return false;
+    }
+}
+
+// Estimated coded size in bytes of `size` bytes with the byte statistics of `data`, including
+// the stream header.
+double estimateCodedBytes(const unsigned char* data, size_t sampleSize, size_t size) {
+    if (sampleSize == 0) {
+        return 0;
+    }
+    uint32_t counts[256] = {};
+    for (size_t i = 0; i < sampleSize; ++i) {
+        ++counts[data[i]];
+    }
+    double bits = 0;
+    int symbols = 0;
+    for (uint32_t count : counts) {
+        if (count) {
+            bits += count * std::log2(double(sampleSize) / count);
+            ++symbols;
+        }
+    }
+    return bits / 8 * size / sampleSize + sizeof(int) + symbols * (sizeof(char) + 2 * sizeof(int)) + 1 + sizeof(int);
+}
+
+// Estimated coded size in bytes of `count` 16-bit samples with the statistics of the first
+// `sampleCount` at `data`, including a header of about two bytes per distinct sample.
+double estimateCodedSamples(const unsigned char* data, size_t sampleCount, size_t count, SampleCoder& coder) {
+    if (sampleCount == 0) {
+        return 0;
+    }
+    std::pmr::vector<uint64_t>& counts = coder.counts();
+    counts.assign(65536, 0);
+    for (size_t i = 0; i < sampleCount; ++i) {
+        uint16_t sample;
+        std::memcpy(&sample, data + 2 * i, sizeof(sample));
+        ++counts[sample];
+    }
+    double bits = 0;
+    size_t symbols = 0;
+    for (uint64_t n : counts) {
+        if (n) {
+            bits += n * std::log2(double(sampleCount) / n);
+            ++symbols;
+        }
+    }
+    return bits / 8 * count / sampleCount + 2 * symbols;
+}
+
+// Estimated coded size of a `size`-byte block filtered with `filter`, from its first
+// `sampleSize` bytes, or -1 if the filter doesn't apply. `scratch` holds the trial output.
+double estimateFiltered(BlockFilter filter, uint8_t parameter, const unsigned char* data, size_t sampleSize, size_t size,
+                        FilterStreams& scratch) {
+    if (!filterForward(filter, parameter, data, sampleSize, scratch)) {
+        return -1;
+    }
+    double cost = 0;
+    for (size_t stream = 0; stream < scratch.count(); ++stream) {
+        if (filter == FILTER_SAMPLES && stream == 0) {
+            cost += estimateCodedSamples(scratch.data(0), scratch.size(0) / 2, size / 2, scratch.samples);
+        } else {
+            cost += estimateCodedBytes(scratch.data(stream), scratch.size(stream), scratch.size(stream) * size / sampleSize);
+        }
+    }
+    return cost;
+}
+
+const uint8_t ELEMENT_WIDTHS[] = {2, 4, 8};
+
+// Picks the filter for a block from a sample of its start, or FILTER_NONE if none is estimated
+// to save at least 2%. `scratch` holds the trial output.
+BlockFilter chooseFilter(const unsigned char* data, size_t size, uint8_t& parameter, FilterStreams& scratch) {
+    size_t sampleSize = std::min(size, FILTER_SAMPLE_SIZE);
+    double best = estimateCodedBytes(data, sampleSize, size) * 0.98;
+    // Converted branch targets pay off in matches, which byte statistics don't show. Executables
+    // start with headers and tables, so the whole block is checked for code.
+    if (looksLikeX86(data, size)) {
+        parameter = 0;
+        return FILTER_X86;
+    }
+    BlockFilter chosen = FILTER_NONE;
+    auto consider = [&](BlockFilter filter, uint8_t candidate) {
+        double cost = estimateFiltered(filter, candidate, data, sampleSize, size, scratch);
+        if (cost >= 0 && cost < best) {
+            best = cost;
+            chosen = filter;
+            parameter = candidate;
+        }
+    };
+    if (unsigned char delimiter = detectDelimiter(data, sampleSize)) {
+        consider(FILTER_COLUMNS, delimiter);
+    }
+    for (BlockFilter filter : {FILTER_SHUFFLE, FILTER_DELTA, FILTER_XOR}) {
+        for (uint8_t width : ELEMENT_WIDTHS) {
+            consider(filter, width);
+        }
+    }
+    consider(FILTER_ENCODED, ENCODED_BASE64 | ENCODED_HEX);
+    consider(FILTER_SAMPLES, 0);
+    return chosen;
+}
+
+// --filter names: a filter and its parameter, 0 to pick the parameter per block.
+struct FilterName {
+    const char* name;
+    BlockFilter filter;
+    uint8_t parameter;
+};
+
+const FilterName FILTER_NAMES[] = {
+    {"none", FILTER_NONE, 0},
+    {"auto", FILTER_AUTO, 0},
+    {"columns", FILTER_COLUMNS, 0},
+    {"csv", FILTER_COLUMNS, ','},
+    {"tsv", FILTER_COLUMNS, '\t'},
+    {"shuffle", FILTER_SHUFFLE, 0},
+    {"shuffle2", FILTER_SHUFFLE, 2},
+    {"shuffle4", FILTER_SHUFFLE, 4},
+    {"shuffle8", FILTER_SHUFFLE, 8},
+    {"delta", FILTER_DELTA, 0},
+    {"delta2", FILTER_DELTA, 2},
+    {"delta4", FILTER_DELTA, 4},
+    {"delta8", FILTER_DELTA, 8},
+    {"xor", FILTER_XOR, 0},
+    {"xor4", FILTER_XOR, 4},
+    {"xor8", FILTER_XOR, 8},
+    {"x86", FILTER_X86, 0},
+    {"base64", FILTER_ENCODED, ENCODED_BASE64},
+    {"hex", FILTER_ENCODED, ENCODED_HEX},
+    {"encoded", FILTER_ENCODED, ENCODED_BASE64 | ENCODED_HEX},
+    {"samples", FILTER_SAMPLES, 0},
+};
+
+bool parseFilter(const std::string& name, BlockFilter& filter, uint8_t& parameter) {
+    for (const FilterName& entry : FILTER_NAMES) {
+        if (name == entry.name) {
+            filter = entry.filter;
+            parameter = entry.parameter;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Parameter used when a filter is forced for every block without one: the detected delimiter,
+// or the element width with the smallest estimated output. `scratch` holds the trial output.
+uint8_t defaultFilterParameter(BlockFilter filter, const unsigned char* data, size_t size, FilterStreams& scratch) {
+    size_t sampleSize = std::min(size, FILTER_SAMPLE_SIZE);
+    if (filter == FILTER_COLUMNS) {
+        unsigned char delimiter = detectDelimiter(data, sampleSize);
+        return delimiter ? delimiter : ',';
+    }
+    if (filter == FILTER_X86 || filter == FILTER_SAMPLES) {
+        return 0;
+    }
+    uint8_t best = ELEMENT_WIDTHS[0];
+    double bestCost = -1;
+    for (uint8_t width : ELEMENT_WIDTHS) {
+        double cost = estimateFiltered(filter, width, data, sampleSize, size, scratch);
+        if (cost >= 0 && (bestCost < 0 || cost < bestCost)) {
+            best = width;
+            bestCost = cost;
+        }
+    }
+    return best;
+}
+
+// --- Code bytes with the cheapest method ---
+// Appends data[0, size) to `output` coded with Huffman or, from MIN_LZ_LEVEL, LZ, whichever is
+// smaller, and returns the method. Appends nothing and returns BLOCK_STORED if neither beats the
+// raw bytes.
+template <typename Vector>
+uint8_t encodeBytes(const unsigned char* data, size_t size, int level, HuffmanContext& context, LzContext& lz, Vector& output) {
+    if (size == 0) {
+        return BLOCK_STORED;
+    }
+    size_t start = output.size();
+    MemoryWriter out(output);
+    // Keep LZ only if it beats Huffman alone, whose size is known without encoding.
+    size_t huffmanSize = context.prepare(data, size);
+    if (level >= MIN_LZ_LEVEL) {
+        lz.compress(data, size, level, context, out);
+        if (output.size() - start < huffmanSize && output.size() - start < size) {
+            return BLOCK_LZ;
+        }
+        output.resize(start);
+        context.prepare(data, size);
+    }
+    if (huffmanSize >= size) {
+        return BLOCK_STORED;
+    }
+    context.encodePrepared(data, size, out);
+    return BLOCK_HUFFMAN;
+}
+
+// Appends exactly `rawSize` bytes decoded from a payload of `method`; false if it is corrupt.
+template <typename Vector>
+bool decodeBytes(uint8_t method, const unsigned char* payload, size_t payloadSize, size_t rawSize, HuffmanContext& context,
+                 LzContext& lz, Vector& output) {
+    size_t start = output.size();
+    if (method == BLOCK_STORED) {
+        if (payloadSize != rawSize) {
+            return false;
+        }
+        output.insert(output.end(), payload, payload + payloadSize);
+        return true;
+    }
+    if (method == BLOCK_LZ) {
+        return lz.decompress(payload, payloadSize, rawSize, context, output);
+    }
+    MemoryReader in(payload, payloadSize);
+    MemoryWriter out(output);
+    return method == BLOCK_HUFFMAN && context.decompress(in, out) && output.size() - start == rawSize;
+}
+
+// --- Streams coded on their own inside a block ---
+//   stream: u32 raw size, u8 method, u32 stored size, stored bytes
+//
+// The method is one of encodeBytes', or, for the samples of FILTER_SAMPLES, STREAM_SAMPLES:
+//
+//   samples stream: SampleCoder header (explicit symbols), packed codes
+const size_t STREAM_RECORD_HEADER = 2 * sizeof(uint32_t) + 1;
+const uint8_t STREAM_SAMPLES = 5;
+
+template <typename Vector>
+void writeStreamHeader(uint32_t size, uint8_t method, size_t header, Vector& output) {
+    uint32_t storedSize = output.size() - header - STREAM_RECORD_HEADER;
+    std::memcpy(output.data() + header, &size, sizeof(size));
+    output[header + sizeof(size)] = method;
+    std::memcpy(output.data() + header + sizeof(size) + 1, &storedSize, sizeof(storedSize));
+}
+
+// Appends data[0, size) as a stream record coded with the cheapest method.
+template <typename Vector>
+void appendStream(const unsigned char* data, uint32_t size, int level, HuffmanContext& context, LzContext& lz, Vector& output) {
+    size_t header = output.size();
+    output.resize(header + STREAM_RECORD_HEADER);
+    uint8_t method = encodeBytes(data, size, level, context, lz, output);
+    if (method == BLOCK_STORED) {
+        output.insert(output.end(), data, data + size);
+    }
+    writeStreamHeader(size, method, header, output);
+}
+
+// Appends the 16-bit samples data[0, size) as a stream record, coded with `coder` if that is
+// smaller than appendStream's record.
+template <typename Vector>
+void appendSamples(const unsigned char* data, uint32_t size, int level, SampleCoder& coder, HuffmanContext& context, LzContext& lz,
+                   Vector& output) {
+    size_t header = output.size();
+    if (size >= 2) {
+        std::pmr::vector<uint64_t>& counts = coder.counts();
+        counts.assign(65536, 0);
+        {
+            StageTimer timer(STAGE_COUNT);
+            for (size_t i = 0; i + 1 < size; i += 2) {
+                uint16_t sample;
+                std::memcpy(&sample, data + i, sizeof(sample));
+                ++counts[sample];
+            }
+        }
+        coder.build();
+        output.resize(header + STREAM_RECORD_HEADER);
+        coder.writeHeader(output, false);
+        StageTimer timer(STAGE_ENCODE);
+        BitWriter<Vector> out(output);
+        for (size_t i = 0; i + 1 < size; i += 2) {
+            uint16_t sample;
+            std::memcpy(&sample, data + i, sizeof(sample));
+            coder.put(sample, out);
+        }
+        out.flush();
+        writeStreamHeader(size, STREAM_SAMPLES, header, output);
+        countStat(COUNTER_SYMBOLS_ENCODED, size / 2);
+    }
+    size_t plain = output.size();
+    appendStream(data, size, level, context, lz, output);
+    if (plain == header || output.size() - plain < plain - header) {
+        std::copy(output.begin() + plain, output.end(), output.begin() + header);
+        output.resize(output.size() - (plain - header));
+    } else {
+        output.resize(plain);
+    }
+}
+
+// Appends the samples of the STREAM_SAMPLES record at payload[position] to `output` and moves
+// `position` past it. False if the record is corrupt or holds more than `maxSize` bytes.
+template <typename Vector>
+bool takeSamples(const unsigned char* payload, size_t payloadSize, size_t& position, size_t maxSize, SampleCoder& coder,
+                 Vector& output) {
+    uint32_t streamSize = 0;
+    uint32_t storedSize = 0;
+    std::memcpy(&streamSize, payload + position, sizeof(streamSize));
+    std::memcpy(&storedSize, payload + position + sizeof(streamSize) + 1, sizeof(storedSize));
+    position += STREAM_RECORD_HEADER;
+    if (storedSize > payloadSize - position || streamSize > maxSize || streamSize % 2 != 0) {
+        return false;
+    }
+    size_t end = position + storedSize;
+    if (!coder.readHeader(payload, end, position, false)) {
+        return false;
+    }
+    StageTimer timer(STAGE_DECODE);
+    size_t start = output.size();
+    output.resize(start + streamSize);
+    unsigned char* target = output.data() + start;
+    BitReader in(payload + position, end - position);
+    TableMisses misses;
+    for (uint32_t i = 0; i < streamSize; i += 2) {
+        uint16_t sample;
+        if (!coder.get(in, sample, misses)) {
+            return false;
+        }
+        std::memcpy(target + i, &sample, sizeof(sample));
+    }
+    countStat(COUNTER_SYMBOLS_DECODED, streamSize / 2);
+    misses.count();
+    position = end;
+    return in.endsInLastByte();
+}
+
+// Appends the bytes of the stream record at payload[position] to `output` and moves `position`
+// past it. False if the record is corrupt or holds more than `maxSize` bytes.
+template <typename Vector>
+bool takeStream(const unsigned char* payload, size_t payloadSize, size_t& position, size_t maxSize, HuffmanContext& context,
+                LzContext& lz, Vector& output) {
+    uint32_t streamSize = 0;
+    uint32_t storedSize = 0;
+    if (payloadSize - position < STREAM_RECORD_HEADER) {
+        return false;
+    }
+    std::memcpy(&streamSize, payload + position, sizeof(streamSize));
+    uint8_t method = payload[position + sizeof(streamSize)];
+    std::memcpy(&storedSize, payload + position + sizeof(streamSize) + 1, sizeof(storedSize));
+    position += STREAM_RECORD_HEADER;
+    if (storedSize > payloadSize - position || streamSize > maxSize ||
+        !decodeBytes(method, payload + position, storedSize, streamSize, context, lz, output)) {
+        return false;
+    }
+    position += storedSize;
+    return true;
+}
+
+// Appends the filtered block payload for `streams` to `output`.
+template <typename Vector>
+void encodeFiltered(BlockFilter filter, uint8_t parameter, FilterStreams& streams, int level, HuffmanContext& context,
+                    LzContext& lz, Vector& output) {
+    output.push_back(filter);
+    output.push_back(parameter);
+    output.push_back(static_cast<unsigned char>(streams.count()));
+    for (size_t stream = 0; stream < streams.count(); ++stream) {
+        if (filter == FILTER_SAMPLES && stream == 0) {
+            appendSamples(streams.data(stream), streams.size(stream), level, streams.samples, context, lz, output);
+        } else {
+            appendStream(streams.data(stream), streams.size(stream), level, context, lz, output);
+        }
+    }
+}
+
+// Decodes a filtered block payload into `output`; `streams` holds the decoded streams.
+template <typename Vector>
+bool decodeFiltered(const unsigned char* payload, size_t payloadSize, size_t rawSize, HuffmanContext& context, LzContext& lz,
+                    FilterStreams& streams, Vector& output) {
+    if (payloadSize < 3) {
+        return false;
+    }
+    BlockFilter filter = static_cast<BlockFilter>(payload[0]);
+    uint8_t parameter = payload[1];
+    size_t count = payload[2];
+    size_t position = 3;
+    streams.clear();
+    for (size_t stream = 0; stream < count; ++stream) {
+        size_t maxSize = filteredCapacity(rawSize) - streams.bytes.size();
+        bool samples = payloadSize - position >= STREAM_RECORD_HEADER && payload[position + sizeof(uint32_t)] == STREAM_SAMPLES;
+        if (samples ? !takeSamples(payload, payloadSize, position, maxSize, streams.samples, streams.bytes)
+                    : !takeStream(payload, payloadSize, position, maxSize, context, lz, streams.bytes)) {
+            return false;
+        }
+        streams.ends.push_back(streams.bytes.size());
+    }
+    output.clear();
+    return position == payloadSize && filterInverse(filter, parameter, streams, output) && output.size() == rawSize;
+}
+
+// --- Word-based coding for text ---
+// Byte codes can't see that text repeats whole words, so they top out around 4.5 bits per
+// character of English. In word mode a block is cut into tokens that alternate between words
+// (runs of letters, digits and UTF-8 bytes) and separators (runs of anything else), at most
+// MAX_WORD_TOKEN bytes each, and every distinct token becomes a symbol of a SymbolCoder. With
+// the codes of up to its TABLE_BITS bits a single lookup decodes a whole token. Blocks with more
+// than MAX_WORD_VOCABULARY distinct tokens aren't text and are left to the byte coders.
+//
+//   words block: u32 token count, SymbolCoder header (implicit symbols),
+//                token lengths stream, token bytes stream, packed codes
+//
+// The vocabulary lists the tokens in canonical order, by code length and then by first
+// appearance, so a token's symbol is its index in the vocabulary.
+const size_t MAX_WORD_TOKEN = 64;
+const size_t MAX_WORD_VOCABULARY = 1 << 17;
+
+inline bool isWordByte(unsigned char byte) {
+    return (byte >= '0' && byte <= '9') || ((byte | 0x20) >= 'a' && (byte | 0x20) <= 'z') || byte >= 0x80;
+}
+
+// End of the token that starts at data[start].
+inline size_t wordTokenEnd(const unsigned char* data, size_t size, size_t start) {
+    bool word = isWordByte(data[start]);
+    size_t limit = std::min(size, start + MAX_WORD_TOKEN);
+    size_t end = start + 1;
+    while (end < limit && isWordByte(data[end]) == word) {
+        ++end;
+    }
+    return end;
+}
+
+class WordContext {
+public:
+    using Coder = SymbolCoder<uint32_t, MAX_WORD_VOCABULARY>;
+
+    explicit WordContext(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : slots_(resource), start_(resource), length_(resource), coder_(resource), vocabulary_(resource), encoded_(resource),
+          offsets_(resource) {}
+
+    // Working memory compress() needs for a block of `blockSize` bytes, including its output.
+    static uint64_t compressBytes(size_t blockSize) {
+        return MAX_WORD_VOCABULARY * (4 * sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint8_t)) + Coder::memoryBytes() +
+               std::min(blockSize, MAX_WORD_VOCABULARY * (MAX_WORD_TOKEN + 1)) + blockOutputCapacity(blockSize);
+    }
+
+    // Working memory decompress() needs for a block of `blockSize` bytes.
+    static uint64_t decompressBytes(size_t blockSize) {
+        return std::min(blockSize, MAX_WORD_VOCABULARY * (MAX_WORD_TOKEN + 1)) + MAX_WORD_VOCABULARY * sizeof(uint32_t) +
+               Coder::memoryBytes();
+    }
+
+    // Codes data[0, size) into encoded(). False if the block has too many distinct tokens.
+    bool compress(const unsigned char* data, size_t size, int level, HuffmanContext& context, LzContext& lz) {
+        encoded_.clear();
+        std::pmr::vector<uint64_t>& counts = coder_.counts();
+        uint32_t tokens = 0;
+        {
+            StageTimer timer(STAGE_COUNT);
+            start_.clear();
+            length_.clear();
+            counts.clear();
+            slots_.assign(1024, 0);
+            for (size_t start = 0; start < size; ++tokens) {
+                size_t end = wordTokenEnd(data, size, start);
+                uint32_t* slot = findSlot(data, start, end - start);
+                if (*slot == 0) {
+                    if (start_.size() == MAX_WORD_VOCABULARY) {
+                        return false;
+                    }
+                    start_.push_back(start);
+                    length_.push_back(end - start);
+                    counts.push_back(0);
+                    *slot = start_.size();
+                    if (start_.size() * 2 > slots_.size()) {
+                        growSlots(data);
+                    }
+                    slot = findSlot(data, start, end - start);
+                }
+                ++counts[*slot - 1];
+                start = end;
+            }
+        }
+        if (tokens == 0) {
+            return false;
+        }
+        coder_.build();
+
+        encoded_.resize(sizeof(tokens));
+        std::memcpy(encoded_.data(), &tokens, sizeof(tokens));
+        coder_.writeHeader(encoded_, true);
+        // Token lengths, then token bytes, in canonical order.
+        uint32_t symbols = coder_.sorted().size();
+        vocabulary_.clear();
+        for (uint32_t symbol : coder_.sorted()) {
+            vocabulary_.push_back(static_cast<unsigned char>(length_[symbol]));
+        }
+        for (uint32_t symbol : coder_.sorted()) {
+            vocabulary_.insert(vocabulary_.end(), data + start_[symbol], data + start_[symbol] + length_[symbol]);
+        }
+        appendStream(vocabulary_.data(), symbols, level, context, lz, encoded_);
+        appendStream(vocabulary_.data() + symbols, vocabulary_.size() - symbols, level, context, lz, encoded_);
+
+        StageTimer timer(STAGE_ENCODE);
+        BitWriter<std::pmr::vector<unsigned char>> out(encoded_);
+        for (size_t start = 0; start < size;) {
+            size_t end = wordTokenEnd(data, size, start);
+            coder_.put(*findSlot(data, start, end - start) - 1, out);
+            start = end;
+        }
+        out.flush();
+        countStat(COUNTER_SYMBOLS_ENCODED, tokens);
+        return true;
+    }
+
+    const std::pmr::vector<unsigned char>& encoded() const {
+        return encoded_;
+    }
+
+    // Appends the block of exactly `rawSize` bytes to `output`. False if the payload is corrupt.
+    template <typename Vector>
+    bool decompress(const unsigned char* payload, size_t payloadSize, size_t rawSize, HuffmanContext& context, LzContext& lz,
+                    Vector& output) {
+        uint32_t tokens = 0;
+        size_t position = sizeof(tokens);
+        if (payloadSize < position) {
+            return false;
+        }
+        std::memcpy(&tokens, payload, sizeof(tokens));
+        if (tokens > rawSize || !coder_.readHeader(payload, payloadSize, position, true)) {
+            return false;
+        }
+        uint32_t symbols = coder_.symbolCount();
+        vocabulary_.clear();
+        if (!takeStream(payload, payloadSize, position, symbols, context, lz, vocabulary_) || vocabulary_.size() != symbols) {
+            return false;
+        }
+        offsets_.resize(symbols + 1);
+        offsets_[0] = symbols;
+        for (uint32_t symbol = 0; symbol < symbols; ++symbol) {
+            if (vocabulary_[symbol] == 0 || vocabulary_[symbol] > MAX_WORD_TOKEN) {
+                return false;
+            }
+            offsets_[symbol + 1] = offsets_[symbol] + vocabulary_[symbol];
+        }
+        if (!takeStream(payload, payloadSize, position, offsets_[symbols] - symbols, context, lz, vocabulary_) ||
+            vocabulary_.size() != offsets_[symbols]) {
+            return false;
+        }
+
+        StageTimer timer(STAGE_DECODE);
+        size_t start = output.size();
+        output.resize(start + rawSize);
+        unsigned char* target = output.data() + start;
+        unsigned char* targetEnd = target + rawSize;
+        const unsigned char* vocabulary = vocabulary_.data();
+        BitReader in(payload + position, payloadSize - position);
+        TableMisses misses;
+        for (uint32_t token = 0; token < tokens; ++token) {
+            uint32_t symbol;
+            if (!coder_.get(in, symbol, misses)) {
+                return false;
+            }
+            size_t tokenLength = offsets_[symbol + 1] - offsets_[symbol];
+            if (size_t(targetEnd - target) < tokenLength) {
+                return false;
+            }
+            std::memcpy(target, vocabulary + offsets_[symbol], tokenLength);
+            target += tokenLength;
+        }
+        countStat(COUNTER_SYMBOLS_DECODED, tokens);
+        misses.count();
+        return target == targetEnd && in.endsInLastByte();
+    }
+
+private:
+    static uint64_t tokenHash(const unsigned char* token, size_t length) {
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for (size_t i = 0; i < length; ++i) {
+            hash = (hash ^ token[i]) * 0x100000001b3ULL;
+        }
+        return hash;
+    }
+
+    // Slot holding the token data[start, start + length), or the empty slot where it belongs.
+    uint32_t* findSlot(const unsigned char* data, size_t start, size_t length) {
+        size_t mask = slots_.size() - 1;
+        for (size_t index = tokenHash(data + start, length) & mask;; index = (index + 1) & mask) {
+            uint32_t entry = slots_[index];
+            if (entry == 0 || (length_[entry - 1] == length && std::memcmp(data + start_[entry - 1], data + start, length) == 0)) {
+                return &slots_[index];
+            }
+        }
+    }
+
+    void growSlots(const unsigned char* data) {
+        slots_.assign(slots_.size() * 2, 0);
+        for (uint32_t symbol = 0; symbol < start_.size(); ++symbol) {
+            *findSlot(data, start_[symbol], length_[symbol]) = symbol + 1;
+        }
+    }
+
+    std::pmr::vector<uint32_t> slots_; // Open-addressing hash table: symbol + 1, or 0
+    std::pmr::vector<uint32_t> start_; // First occurrence of each symbol's token in the block
+    std::pmr::vector<uint8_t> length_; // Token length of each symbol
+    Coder coder_;
+    std::pmr::vector<unsigned char> vocabulary_; // Token lengths, then token bytes, in canonical order
+    std::pmr::vector<unsigned char> encoded_;
+    std::pmr::vector<uint32_t> offsets_; // Decoding: where each symbol's token starts in vocabulary_
+};
+
+// --- Settings for compressFile and decompressFile ---
+struct CompressionOptions {
+    bool directIO = false;
+    unsigned threads = 1;
+    uint64_t memoryBudget = 0; // Bytes; 0 = no limit
+    size_t blockSize = 0;      // 0 = chosen from the budget
+    bool hugePages = false;    // Back block buffers and codec tables with huge pages
+    int level = DEFAULT_LEVEL; // 1 = Huffman only, 2-6 greedy LZ, 7-9 optimal-parse LZ
+    int priority = 0;          // Scheduling on the shared executor: higher runs first,
+    unsigned weight = 1;       // equal priorities share CPU time in proportion to weight
+    uint64_t longMatchTable = 0; // Bytes of long-distance match table; 0 = no long matching
+    BlockFilter filter = FILTER_NONE; // Filter for every block, or FILTER_AUTO to choose per block
+    uint8_t filterParameter = 0;      // 0 = chosen per block
+    bool words = false;               // Also try word-based coding on every block
+    bool summaries = false;           // Store a summary of every block after the blocks
+    bool recover = false;             // Decompress: write damaged blocks as zeros and go on
+};
+
+// --- How many blocks of what size to keep in flight on how many threads ---
+struct MemoryPlan {
+    size_t blockSize;
+    unsigned threads;
+    unsigned inFlight;
+    uint64_t estimatedBytes;
+};
+
+// Working memory of one in-flight block: its input, its output and a codec context, plus the
+// context's pair table when encoding blocks large enough to use one. With huge pages each buffer
+// is rounded up to whole 2 MiB pages. `lzBytes`, if given, is the LZ scratch memory the slot needs
+// on top; `filters` adds the buffer for a filter's streams and the sample coder, and `wordBytes`
+// the word coder's memory.
+uint64_t blockSlotBytes(size_t blockSize, bool hugePages, bool encoding, uint64_t (*lzBytes)(size_t) = nullptr, bool filters = false,
+                        uint64_t (*wordBytes)(size_t) = nullptr) {
+    uint64_t lz = (lzBytes ? lzBytes(blockSize) : 0) + (filters ? filteredCapacity(blockSize) + SampleCoder::memoryBytes() : 0) +
+                  (wordBytes ? wordBytes(blockSize) : 0);
+    uint64_t context = HuffmanContext::workspaceBytes() + (encoding && blockSize >= PAIR_TABLE_MIN_INPUT ? HuffmanContext::pairTableBytes() : 0);
+    if (hugePages) {
+        return HugePageResource::footprint(blockSize) + HugePageResource::footprint(blockOutputCapacity(blockSize)) + context +
+               16 * 1024 + lz;
+    }
+    return blockSize + blockOutputCapacity(blockSize) + context + 16 * 1024 + lz;
+}
+
+// Picks the largest configuration that fits the budget. Parallelism is given up before block
+// size: first fewer blocks in flight (down to one per thread), then fewer threads, then smaller
+// blocks. When decompressing the block size is fixed by the file. `sharedBytes` is memory needed
+// once whatever the plan, such as the long-match table. Returns false if even one minimum-size
+// block on one thread doesn't fit.
+bool planMemory(const CompressionOptions& options, uint64_t inputSize, bool decompressing, size_t blockSize,
+                uint64_t (*lzBytes)(size_t), bool filters, uint64_t (*wordBytes)(size_t), uint64_t sharedBytes, MemoryPlan& plan) {
+    if (!decompressing) {
+        blockSize = options.blockSize ? options.blockSize : DEFAULT_BLOCK_SIZE;
+        while (blockSize / 2 >= MIN_BLOCK_SIZE && blockSize / 2 >= inputSize) {
+            blockSize /= 2; // No point in blocks much larger than the input
+        }
+    }
+    plan.blockSize = blockSize;
+    plan.threads = std::max(1u, options.threads);
+    plan.inFlight = 2 * plan.threads;
+    // The reader's and writer's pooled I/O buffers are needed whatever the plan.
+    const uint64_t fixedBytes = 2 * IO_BLOCK_SIZE + sharedBytes;
+    auto cost = [&] {
+        return fixedBytes + plan.inFlight * blockSlotBytes(plan.blockSize, options.hugePages, !decompressing, lzBytes, filters, wordBytes);
+    };
+
+    if (options.memoryBudget > 0) {
+        while (cost() > options.memoryBudget) {
+            if (plan.inFlight > plan.threads) {
+                --plan.inFlight;
+            } else if (plan.threads > 1) {
+                plan.inFlight = --plan.threads;
+            } else if (!decompressing && !options.blockSize && plan.blockSize / 2 >= MIN_BLOCK_SIZE) {
+                plan.blockSize /= 2;
+                plan.threads = std::max(1u, options.threads);
+                plan.inFlight = 2 * plan.threads;
+            } else {
+                return false;
+            }
+        }
+    }
+    plan.estimatedBytes = cost();
+    return true;
+}
+
+// --- Block summaries ---
+// With --summaries the container ends with a summary of every block's raw bytes, so statistics
+// of a file come from its last few KiB instead of decoding it:
+//
+//   table: per block, varint count of each byte value 0 .. 255, varint first newline,
+//          varint last newline, varint longest line
+//   footer: u64 table size, "HFSU"
+//
+// Newline positions are within the block, both equal to the block size if it has none; the
+// longest line is the longest one between them, without its '\n'. Lines that span blocks are
+// pieced together from the neighbours' first and last newlines.
+const char SUMMARY_MAGIC[4] = {'H', 'F', 'S', 'U'};
+
+struct BlockSummary {
+    uint32_t histogram[256];
+    uint32_t firstNewline;
+    uint32_t lastNewline;
+    uint32_t longestLine;
+};
+
+void summarizeBlock(const unsigned char* data, size_t size, BlockSummary& summary) {
+    StageTimer timer(STAGE_COUNT);
+    // Four tables so runs of one byte don't stall on a single counter.
+    uint32_t counts[4][256] = {};
+    size_t i = 0;
+    for (; i + 4 <= size; i += 4) {
+        ++counts[0][data[i]];
+        ++counts[1][data[i + 1]];
+        ++counts[2][data[i + 2]];
+        ++counts[3][data[i + 3]];
+    }
+    for (; i < size; ++i) {
+        ++counts[0][data[i]];
+    }
+    for (int byte = 0; byte < 256; ++byte) {
+        summary.histogram[byte] = counts[0][byte] + counts[1][byte] + counts[2][byte] + counts[3][byte];
+    }
+    summary.firstNewline = summary.lastNewline = size;
+    summary.longestLine = 0;
+    const unsigned char* newline = static_cast<const unsigned char*>(std::memchr(data, '\n', size));
+    while (newline) {
+        uint32_t position = newline - data;
+        if (summary.firstNewline == size) {
+            summary.firstNewline = position;
+        } else {
+            summary.longestLine = std::max(summary.longestLine, position - summary.lastNewline - 1);
+        }
+        summary.lastNewline = position;
+        newline = static_cast<const unsigned char*>(std::memchr(newline + 1, '\n', size - position - 1));
+    }
+}
+
+void appendSummary(const BlockSummary& summary, std::pmr::vector<unsigned char>& out) {
+    for (uint32_t count : summary.histogram) {
+        appendVarint(out, count);
+    }
+    appendVarint(out, summary.firstNewline);
+    appendVarint(out, summary.lastNewline);
+    appendVarint(out, summary.longestLine);
+}
+
+// Reads the summary of a block of `rawSize` bytes; false if it doesn't add up.
+bool takeSummary(const unsigned char* data, size_t size, size_t& position, uint32_t rawSize, BlockSummary& summary) {
+    uint64_t total = 0;
+    for (uint32_t& count : summary.histogram) {
+        if (!takeVarint(data, size, position, count)) {
+            return false;
+        }
+        total += count;
+    }
+    return total == rawSize && takeVarint(data, size, position, summary.firstNewline) &&
+           takeVarint(data, size, position, summary.lastNewline) && takeVarint(data, size, position, summary.longestLine) &&
+           summary.firstNewline <= summary.lastNewline && summary.lastNewline <= rawSize && summary.longestLine <= rawSize;
+}
+
+// --- One in-flight block: buffers and codec context, reused for block after block ---
+struct BlockSlot {
+    BlockSlot(std::pmr::memory_resource* resource, size_t inputCapacity, size_t outputCapacity)
+        : input(resource), output(resource), context(resource), lz(resource), longMatches(resource), filtered(resource), words(resource) {
+        input.reserve(inputCapacity);
+        output.reserve(outputCapacity);
+    }
+
+    std::pmr::vector<unsigned char> input;
+    std::pmr::vector<unsigned char> output;
+    HuffmanContext context;
+    LzContext lz; // Allocates its scratch memory on the slot's first LZ block
+    std::pmr::vector<LongMatch> longMatches; // Cut out of input before coding
+    FilterStreams filtered;                  // A filtered block's streams
+    WordContext words;                       // Allocates its memory on the slot's first word-coded block
+    unsigned node = 0; // NUMA node whose workers process this slot's blocks
+    uint32_t rawSize = 0;
+    uint8_t method = BLOCK_STORED;
+    bool wanted = true; // False if the output skips the block without it being decoded
+    BlockSummary summary; // Of the raw block, with --summaries
+    uint64_t index = 0;   // Of the block in the slot
+    uint32_t crc = 0;     // blockChecksum of the block
+};
+
+// CRC-32 of a block as written: its index, raw size and method (without BLOCK_LONG_MATCHES),
+// its long matches and then `payload`, its coded bytes.
+uint32_t blockChecksum(const BlockSlot& slot, const unsigned char* payload, size_t payloadSize) {
+    unsigned char fields[sizeof(slot.index) + sizeof(slot.rawSize) + sizeof(slot.method)];
+    std::memcpy(fields, &slot.index, sizeof(slot.index));
+    std::memcpy(fields + sizeof(slot.index), &slot.rawSize, sizeof(slot.rawSize));
+    fields[sizeof(fields) - 1] = slot.method;
+    uint32_t crc = crc32(fields, sizeof(fields));
+    for (const LongMatch& match : slot.longMatches) {
+        unsigned char entry[LONG_MATCH_ENTRY_SIZE];
+        std::memcpy(entry, &match.position, sizeof(match.position));
+        std::memcpy(entry + sizeof(match.position), &match.length, sizeof(match.length));
+        std::memcpy(entry + sizeof(match.position) + sizeof(match.length), &match.source, sizeof(match.source));
+        crc = crc32(entry, sizeof(entry), crc);
+    }
+    return crc32(payload, payloadSize, crc);
+}
+
+// CRC-32 of a block header's fields as written, so the stored size is known to be right before
+// the block is read and a damaged header can't swallow the next block.
+uint32_t blockHeaderChecksum(uint64_t index, uint32_t crc, uint32_t rawSize, uint32_t storedSize, uint8_t method) {
+    unsigned char fields[sizeof(index) + sizeof(crc) + sizeof(rawSize) + sizeof(storedSize) + sizeof(method)];
+    std::memcpy(fields, &index, sizeof(index));
+    std::memcpy(fields + sizeof(index), &crc, sizeof(crc));
+    std::memcpy(fields + sizeof(index) + sizeof(crc), &rawSize, sizeof(rawSize));
+    std::memcpy(fields + sizeof(index) + sizeof(crc) + sizeof(rawSize), &storedSize, sizeof(storedSize));
+    fields[sizeof(fields) - 1] = method;
+    return crc32(fields, sizeof(fields));
+}
+
+// Codes the block in slot.input as compressBlocks' workers do: with the options' filter, level
+// and word coding, whichever stores it smallest, then checksums it. With `summarize` the block
+// is summarized first.
+void encodeBlock(BlockSlot& slot, const CompressionOptions& options, bool summarize) {
+    int level = options.level;
+    slot.output.clear();
+    const unsigned char* data = slot.input.data();
+    size_t size = slot.input.size();
+    if (summarize) {
+        summarizeBlock(data, size, slot.summary);
+    }
+    auto encode = [&] {
+        uint8_t parameter = options.filterParameter;
+        BlockFilter chosen = options.filter;
+        if (options.filter == FILTER_AUTO) {
+            chosen = chooseFilter(data, size, parameter, slot.filtered);
+        } else if (options.filter != FILTER_NONE && parameter == 0) {
+            parameter = defaultFilterParameter(options.filter, data, size, slot.filtered);
+        }
+        if (chosen != FILTER_NONE && filterForward(chosen, parameter, data, size, slot.filtered)) {
+            encodeFiltered(chosen, parameter, slot.filtered, level, slot.context, slot.lz, slot.output);
+            if (slot.output.size() < slot.context.prepare(data, size) && slot.output.size() < size) {
+                slot.method = BLOCK_FILTERED;
+                if (level < MIN_LZ_LEVEL) {
+                    return;
+                }
+                // LZ may still beat the filter; code the block without it in the spent streams' buffer.
+                std::pmr::vector<unsigned char>& unfiltered = slot.filtered.bytes;
+                unfiltered.clear();
+                uint8_t method = encodeBytes(data, size, level, slot.context, slot.lz, unfiltered);
+                if (method != BLOCK_STORED && unfiltered.size() < slot.output.size()) {
+                    slot.output.assign(unfiltered.begin(), unfiltered.end());
+                    slot.method = method;
+                }
+                return;
+            }
+            slot.output.clear();
+        }
+        slot.method = encodeBytes(data, size, level, slot.context, slot.lz, slot.output);
+    };
+    encode();
+    size_t storedSize = slot.method == BLOCK_STORED ? size : slot.output.size();
+    if (options.words && slot.words.compress(data, size, level, slot.context, slot.lz) && slot.words.encoded().size() < storedSize) {
+        slot.output.assign(slot.words.encoded().begin(), slot.words.encoded().end());
+        slot.method = BLOCK_WORDS;
+    }
+    const std::pmr::vector<unsigned char>& stored = slot.method == BLOCK_STORED ? slot.input : slot.output;
+    slot.crc = blockChecksum(slot, stored.data(), stored.size());
+}
+
+// Checks and decodes the block read into `slot` as decompressBlocks' workers do, into
+// slot.output unless it is stored; `residualSize` is its size without long matches. Blocks the
+// output turned down are left alone. False if the block is damaged.
+bool decodeBlock(BlockSlot& slot, uint32_t residualSize, bool sync) {
+    if (!slot.wanted) {
+        return true;
+    }
+    TraceBlock block(slot.index);
+    if (sync && blockChecksum(slot, slot.input.data(), slot.input.size()) != slot.crc) {
+        return false;
+    }
+    if (slot.method == BLOCK_STORED) {
+        return true;
+    }
+    slot.output.clear();
+    if (slot.method == BLOCK_FILTERED) {
+        return decodeFiltered(slot.input.data(), slot.input.size(), residualSize, slot.context, slot.lz, slot.filtered, slot.output);
+    }
+    if (slot.method == BLOCK_WORDS) {
+        return slot.words.decompress(slot.input.data(), slot.input.size(), residualSize, slot.context, slot.lz, slot.output);
+    }
+    return decodeBytes(slot.method, slot.input.data(), slot.input.size(), residualSize, slot.context, slot.lz, slot.output);
+}
+
+// Creates the slots round-robin over the pool's nodes. On a NUMA-aware pool each slot is built by
+// a worker of its node and its buffers are touched there, so their pages are allocated on that
+// node and every block coded in the slot stays local.
+std::pmr::vector<std::unique_ptr<BlockSlot>> createBlockSlots(ExecutorJob& job, unsigned count, std::pmr::memory_resource* resource,
+                                                              size_t inputCapacity, size_t outputCapacity) {
+    std::pmr::vector<std::unique_ptr<BlockSlot>> slots(resource);
+    std::vector<std::future<std::unique_ptr<BlockSlot>>> created;
+    for (unsigned i = 0; i < count; ++i) {
+        unsigned node = i % job.nodeCount();
+        auto create = [&job, resource, inputCapacity, outputCapacity, node] {
+            auto slot = std::make_unique<BlockSlot>(resource, inputCapacity, outputCapacity);
+            slot->node = node;
+            if (job.nodeCount() > 1) {
+                slot->input.resize(inputCapacity);
+                slot->output.resize(outputCapacity);
+                slot->input.clear();
+                slot->output.clear();
+            }
+            return slot;
+        };
+        if (job.nodeCount() > 1) {
+            created.push_back(job.submitToNode(node, create));
+        } else {
+            slots.push_back(create());
+        }
+    }
+    for (auto& slot : created) {
+        slots.push_back(slot.get());
+    }
+    return slots;
+}
+
+void printMemoryReport(const MemoryPlan& plan, const TrackingResource& tracking, uint64_t budget) {
+    uint64_t peak = tracking.peak() + ioBufferPool().allocatedBytes();
+    std::cout << "Memory: " << plan.blockSize / 1024 << " KiB blocks, " << plan.threads << " thread(s), " << plan.inFlight
+              << " block(s) in flight; peak " << (peak + 1023) / 1024 << " KiB";
+    if (budget > 0) {
+        std::cout << " of " << budget / 1024 << " KiB budget";
+    }
+    std::cout << "." << std::endl;
+}
+
+// --- Compress blocks from `ifs` into `ofs` on a thread pool ---
+// Slots are used round-robin, so a slot's previous block has always been written before it is
+// refilled and blocks are written in order.
+template <typename Output>
+bool compressBlocks(BlockReader& ifs, Output& ofs, const MemoryPlan& plan, const CompressionOptions& options, std::pmr::memory_resource* resource) {
+    uint64_t originalSize = ifs.remaining();
+    ofs.write(BLOCK_MAGIC, sizeof(BLOCK_MAGIC));
+    ofs.write(&BLOCK_VERSION, sizeof(BLOCK_VERSION));
+    uint32_t blockSize = plan.blockSize;
+    ofs.write(&blockSize, sizeof(blockSize));
+    ofs.write(&originalSize, sizeof(originalSize));
+    uint32_t flags = (options.level >= MIN_LZ_LEVEL ? BLOCK_FLAG_LZ : 0) | (options.longMatchTable ? BLOCK_FLAG_LONG : 0) |
+                     (options.filter != FILTER_NONE ? BLOCK_FLAG_FILTERS : 0) | (options.words ? BLOCK_FLAG_WORDS : 0) |
+                     (options.summaries ? BLOCK_FLAG_SUMMARIES : 0) | BLOCK_FLAG_SYNC;
+    ofs.write(&flags, sizeof(flags));
+    std::unique_ptr<LongMatchFinder> finder;
+    if (options.longMatchTable) {
+        finder = std::make_unique<LongMatchFinder>(resource, options.longMatchTable, originalSize);
+    }
+
+    ExecutorJob job(plan.threads, options.priority, options.weight);
+    auto slots = createBlockSlots(job, plan.inFlight, resource, plan.blockSize, blockOutputCapacity(plan.blockSize));
+    std::deque<std::future<void>> inFlight;
+    uint64_t blockCount = (originalSize + plan.blockSize - 1) / plan.blockSize;
+    uint64_t written = 0;
+    bool ok = true;
+    std::pmr::vector<unsigned char> summaries(resource);
+
+    auto writeBlock = [&] {
+        inFlight.front().get();
+        inFlight.pop_front();
+        BlockSlot& slot = *slots[written % slots.size()];
+        TraceBlock block(written++);
+        if (options.summaries) {
+            appendSummary(slot.summary, summaries);
+        }
+        const std::pmr::vector<unsigned char>& stored = slot.method == BLOCK_STORED ? slot.input : slot.output;
+        uint32_t storedSize = stored.size();
+        uint8_t method = slot.method;
+        uint32_t matchCount = slot.longMatches.size();
+        if (matchCount > 0) {
+            method |= BLOCK_LONG_MATCHES;
+            storedSize += sizeof(matchCount) + matchCount * LONG_MATCH_ENTRY_SIZE;
+        }
+        ofs.write(&BLOCK_SYNC, sizeof(BLOCK_SYNC));
+        ofs.write(&slot.index, sizeof(slot.index));
+        ofs.write(&slot.crc, sizeof(slot.crc));
+        ofs.write(&slot.rawSize, sizeof(slot.rawSize));
+        ofs.write(&storedSize, sizeof(storedSize));
+        ofs.write(&method, sizeof(method));
+        uint32_t headerCrc = blockHeaderChecksum(slot.index, slot.crc, slot.rawSize, storedSize, method);
+        ofs.write(&headerCrc, sizeof(headerCrc));
+        if (matchCount > 0) {
+            ofs.write(&matchCount, sizeof(matchCount));
+            for (const LongMatch& match : slot.longMatches) {
+                ofs.write(&match.position, sizeof(match.position));
+                ofs.write(&match.length, sizeof(match.length));
+                ofs.write(&match.source, sizeof(match.source));
+            }
+        }
+        ofs.write(stored.data(), stored.size());
+    };
+
+    for (uint64_t index = 0; index < blockCount && ok; ++index) {
+        if (inFlight.size() == slots.size()) {
+            writeBlock();
+        }
+        BlockSlot& slot = *slots[index % slots.size()];
+        TraceBlock block(index);
+        slot.index = index;
+        slot.rawSize = std::min<uint64_t>(plan.blockSize, ifs.remaining());
+        slot.input.resize(slot.rawSize);
+        if (!ifs.read(slot.input.data(), slot.rawSize)) {
+            ok = false;
+            break;
+        }
+        if (finder) {
+            // The summary is of the raw block, before long matches are cut out of it.
+            if (options.summaries) {
+                summarizeBlock(slot.input.data(), slot.rawSize, slot.summary);
+            }
+            finder->find(ifs, slot.input.data(), slot.rawSize, index * plan.blockSize, slot.longMatches);
+            slot.input.resize(LongMatchFinder::removeMatches(slot.input.data(), slot.rawSize, slot.longMatches));
+            countStat(COUNTER_LONG_MATCH_BYTES, slot.rawSize - slot.input.size());
+        }
+        bool summarize = options.summaries && !finder;
+        inFlight.push_back(job.submitToNode(slot.node, [&slot, &options, index, summarize] {
+            TraceBlock block(index);
+            encodeBlock(slot, options, summarize);
+        }));
+    }
+    while (!inFlight.empty()) {
+        if (ok) {
+            writeBlock();
+        } else {
+            inFlight.front().wait();
+            inFlight.pop_front();
+        }
+    }
+    if (ok && options.summaries) {
+        uint64_t tableSize = summaries.size();
+        ofs.write(summaries.data(), summaries.size());
+        ofs.write(&tableSize, sizeof(tableSize));
+        ofs.write(SUMMARY_MAGIC, sizeof(SUMMARY_MAGIC));
+    }
+    return ok;
+}
+
+// Outputs that only need some blocks, such as SearchOutput, have wantsBlock(method, stored bytes,
+// stored size), asked before a block is decoded, and skip(size), given the blocks they turned down.
+template <typename Output, typename = void>
+struct SkipsBlocks : std::false_type {};
+
+template <typename Output>
+struct SkipsBlocks<Output, std::void_t<decltype(&Output::wantsBlock)>> : std::true_type {};
+
+// Plans decompressing a container with the given header within options.memoryBudget. Callers
+// check it before opening their output, so a budget that is too small never truncates a file.
+bool planDecompression(const CompressionOptions& options, uint64_t originalSize, uint32_t blockSize, uint32_t flags, MemoryPlan& plan) {
+    uint64_t copyBytes = flags & BLOCK_FLAG_LONG ? LONG_MATCH_CHUNK : 0;
+    return planMemory(options, originalSize, true, blockSize, flags & BLOCK_FLAG_LZ ? &LzContext::decompressBytes : nullptr,
+                      flags & BLOCK_FLAG_FILTERS, flags & BLOCK_FLAG_WORDS ? &WordContext::decompressBytes : nullptr, copyBytes, plan);
+}
+
+// --- Decompress a block container from `ifs` into `ofs` on a thread pool ---
+// With options.recover, blocks that are damaged or missing are reported and written as zeros
+// instead of failing the file, and `damagedBlocks` receives their number.
+template <typename Output>
+bool decompressBlocks(BlockReader& ifs, Output& ofs, const CompressionOptions& options, TrackingResource& tracking, MemoryPlan& plan,
+                      uint64_t* damagedBlocks = nullptr) {
+    char magic[sizeof(BLOCK_MAGIC)];
+    uint32_t version = 0;
+    uint32_t blockSize = 0;
+    uint64_t originalSize = 0;
+    uint32_t flags = 0;
+    if (!ifs.read(magic, sizeof(magic)) || std::memcmp(magic, BLOCK_MAGIC, sizeof(magic)) != 0 ||
+        !ifs.read(&version, sizeof(version)) || version < 1 || version > BLOCK_VERSION || !ifs.read(&blockSize, sizeof(blockSize)) ||
+        !ifs.read(&originalSize, sizeof(originalSize)) || (version >= 2 && !ifs.read(&flags, sizeof(flags))) || blockSize == 0 ||
+        blockSize > MAX_BLOCK_SIZE) {
+        return false;
+    }
+    auto methodAllowed = [flags](uint8_t method) {
+        return method <= BLOCK_HUFFMAN || (method == BLOCK_LZ && (flags & BLOCK_FLAG_LZ)) ||
+               (method == BLOCK_FILTERED && (flags & BLOCK_FLAG_FILTERS)) || (method == BLOCK_WORDS && (flags & BLOCK_FLAG_WORDS));
+    };
+    uint64_t copyBytes = flags & BLOCK_FLAG_LONG ? LONG_MATCH_CHUNK : 0;
+    if (!planDecompression(options, originalSize, blockSize, flags, plan)) {
+        std::cerr << "Memory budget too small for " << blockSize / 1024 << " KiB blocks." << std::endl;
+        return false;
+    }
+
+    ExecutorJob job(plan.threads, options.priority, options.weight);
+    auto slots = createBlockSlots(job, plan.inFlight, &tracking, blockOutputCapacity(blockSize), blockSize);
+    std::pmr::vector<unsigned char> copyBuffer(copyBytes, &tracking); // Long matches read back from the output
+    std::deque<std::future<bool>> inFlight;
+    uint64_t blockCount = (originalSize + blockSize - 1) / blockSize;
+    bool sync = flags & BLOCK_FLAG_SYNC;
+    uint64_t submitted = 0; // Blocks handed to the workers, which take the slots in turn
+    uint64_t retired = 0;
+    uint64_t nextBlock = 0; // The next block to write
+    uint64_t damaged = 0;
+    bool ok = true;
+
+    // Writes the blocks from nextBlock up to `end`, which were lost or failed to decode, as
+    // zeros with --recover; otherwise the first of them fails the file.
+    auto fillDamaged = [&](uint64_t end) {
+        static const unsigned char zeros[4096] = {};
+        for (; ok && nextBlock < end; ++nextBlock) {
+            uint64_t start = nextBlock * blockSize;
+            uint64_t size = std::min<uint64_t>(blockSize, originalSize - start);
+            ++damaged;
+            std::cerr << "Block " << nextBlock << " (bytes " << start << "-" << start + size - 1 << ") is damaged";
+            if (!options.recover) {
+                std::cerr << (sync ? "; decompress with --recover to restore the other blocks." : ".") << std::endl;
+                ok = false;
+                return;
+            }
+            std::cerr << "; filled with zeros." << std::endl;
+            for (uint64_t left = size; left > 0;) {
+                size_t chunk = std::min<uint64_t>(left, sizeof(zeros));
+                ofs.write(zeros, chunk);
+                left -= chunk;
+            }
+        }
+    };
+
+    // Writes the decoded remainder with the block's long matches copied back in between.
+    auto writeBlock = [&] {
+        bool decoded = inFlight.front().get();
+        inFlight.pop_front();
+        BlockSlot& slot = *slots[retired++ % slots.size()];
+        TraceBlock block(slot.index);
+        fillDamaged(decoded ? slot.index : slot.index + 1);
+        if (!decoded || !ok) {
+            return;
+        }
+        nextBlock = slot.index + 1;
+        if constexpr (SkipsBlocks<Output>::value) {
+            if (!slot.wanted) {
+                ofs.skip(slot.rawSize);
+                return;
+            }
+        }
+        const std::pmr::vector<unsigned char>& data = slot.method == BLOCK_STORED ? slot.input : slot.output;
+        size_t next = 0;
+        uint32_t blockPosition = 0;
+        for (const LongMatch& match : slot.longMatches) {
+            ofs.write(data.data() + next, match.position - blockPosition);
+            next += match.position - blockPosition;
+            for (uint32_t copied = 0; copied < match.length;) {
+                size_t chunk = std::min<size_t>(copyBuffer.size(), match.length - copied);
+                if (!ofs.readBack(match.source + copied, copyBuffer.data(), chunk)) {
+                    ok = false;
+                    return;
+                }
+                ofs.write(copyBuffer.data(), chunk);
+                copied += chunk;
+            }
+            blockPosition = match.position + match.length;
+        }
+        ofs.write(data.data() + next, data.size() - next);
+    };
+
+    // Reads the next block into `slot`, from the next sync marker with --recover. `index` is the
+    // block expected next and becomes the block read. False if no valid block header follows.
+    auto readBlock = [&](BlockSlot& slot, uint64_t& index, uint32_t& residualSize) {
+        uint64_t blockIndex = index;
+        if (sync) {
+            uint64_t marker = 0;
+            if (!ifs.read(&marker, sizeof(marker))) {
+                return false;
+            }
+            // Slide over damaged bytes a byte at a time.
+            unsigned char byte;
+            while (marker != BLOCK_SYNC && options.recover && ifs.get(byte)) {
+                marker = (marker >> 8) | uint64_t(byte) << 56;
+            }
+            if (marker != BLOCK_SYNC || !ifs.read(&blockIndex, sizeof(blockIndex)) || !ifs.read(&slot.crc, sizeof(slot.crc))) {
+                return false;
+            }
+        }
+        uint32_t storedSize = 0;
+        if (!ifs.read(&slot.rawSize, sizeof(slot.rawSize)) || !ifs.read(&storedSize, sizeof(storedSize)) ||
+            !ifs.read(&slot.method, sizeof(slot.method))) {
+            return false;
+        }
+        if (sync) {
+            uint32_t headerCrc = 0;
+            if (!ifs.read(&headerCrc, sizeof(headerCrc)) ||
+                headerCrc != blockHeaderChecksum(blockIndex, slot.crc, slot.rawSize, storedSize, slot.method) || blockIndex < index ||
+                blockIndex >= blockCount) {
+                return false;
+            }
+            index = blockIndex;
+        }
+        uint64_t blockStart = index * blockSize;
+        uint64_t expectedSize = std::min<uint64_t>(blockSize, originalSize - blockStart);
+        if (slot.rawSize != expectedSize || storedSize > blockOutputCapacity(blockSize) || !methodAllowed(slot.method & ~BLOCK_LONG_MATCHES) ||
+            ((slot.method & BLOCK_LONG_MATCHES) && !(flags & BLOCK_FLAG_LONG))) {
+            return false;
+        }
+        // Long matches must lie in order inside the block and copy from output written before them.
+        residualSize = slot.rawSize;
+        slot.longMatches.clear();
+        if (slot.method & BLOCK_LONG_MATCHES) {
+            uint32_t matchCount = 0;
+            bool valid = ifs.read(&matchCount, sizeof(matchCount)) && matchCount <= slot.rawSize / LONG_MATCH_MIN &&
+                         sizeof(matchCount) + uint64_t(matchCount) * LONG_MATCH_ENTRY_SIZE <= storedSize;
+            for (uint32_t i = 0; valid && i < matchCount; ++i) {
+                LongMatch match;
+                uint32_t previousEnd = slot.longMatches.empty() ? 0 : slot.longMatches.back().position + slot.longMatches.back().length;
+                valid = ifs.read(&match.position, sizeof(match.position)) && ifs.read(&match.length, sizeof(match.length)) &&
+                        ifs.read(&match.source, sizeof(match.source)) && match.length > 0 && match.position >= previousEnd &&
+                        match.position <= slot.rawSize && match.length <= slot.rawSize - match.position &&
+                        match.length <= blockStart + match.position && match.source <= blockStart + match.position - match.length;
+                slot.longMatches.push_back(match);
+                residualSize -= match.length;
+            }
+            if (!valid) {
+                return false;
+            }
+            storedSize -= sizeof(matchCount) + matchCount * LONG_MATCH_ENTRY_SIZE;
+            slot.method &= ~BLOCK_LONG_MATCHES;
+        }
+        if (slot.method == BLOCK_STORED && storedSize != residualSize) {
+            return false;
+        }
+        slot.input.resize(storedSize);
+        return ifs.read(slot.input.data(), storedSize);
+    };
+
+    for (uint64_t index = 0; index < blockCount && ok;) {
+        if (inFlight.size() == slots.size()) {
+            writeBlock();
+            if (!ok) {
+                break;
+            }
+        }
+        BlockSlot& slot = *slots[submitted % slots.size()];
+        uint32_t residualSize = 0;
+        if (!readBlock(slot, index, residualSize)) {
+            // Without sync markers there is no finding the next block; with them, look for it.
+            if (options.recover && sync && ifs.remaining() > 0) {
+                continue;
+            }
+            // Otherwise the blocks in flight are written first, so the first damaged block in file
+            // order is the one reported.
+            if (!options.recover) {
+                while (ok && !inFlight.empty()) {
+                    writeBlock();
+                }
+                fillDamaged(index + 1);
+            }
+            break;
+        }
+        TraceBlock block(index);
+        slot.index = index++;
+        ++submitted;
+        if constexpr (SkipsBlocks<Output>::value) {
+            slot.wanted = ofs.wantsBlock(slot.method, slot.input.data(), slot.input.size());
+        }
+        inFlight.push_back(job.submitToNode(slot.node, [&slot, residualSize, sync] {
+            return decodeBlock(slot, residualSize, sync);
+        }));
+    }
+    while (!inFlight.empty()) {
+        if (ok) {
+            writeBlock();
+        } else {
+            inFlight.front().wait();
+            inFlight.pop_front();
+        }
+    }
+    // With --recover, blocks never found are written as zeros too.
+    if (ok && options.recover) {
+        fillDamaged(blockCount);
+    }
+    if (damagedBlocks) {
+        *damagedBlocks = damaged;
+    }
+    return ok;
+}
+
+// --- Sparse file header ---
+// Files with holes get a prefix listing their data extents; only the extents' bytes go through
+// the block container. The magic can't be confused with the other formats' first bytes.
+//
+//   "HFSP" u64 apparent size, u32 extent count, (u64 offset, u64 length) per extent, blocks
+const char SPARSE_MAGIC[4] = {'H', 'F', 'S', 'P'};
+
+// --- Compression Function ---
+bool compressFile(const std::string& inputFile, const std::string& outputFile, const CompressionOptions& options = CompressionOptions()) {
+    BlockReader ifs;
+    BlockWriter ofs;
+
+    if (options.level < DEFAULT_LEVEL || options.level > MAX_LEVEL) {
+        std::cerr << "Compression level must be between " << DEFAULT_LEVEL << " and " << MAX_LEVEL << "." << std::endl;
+        return false;
+    }
+    if (!ifs.open(inputFile, options.directIO, true)) {
+        std::cerr << "Error opening files for compression." << std::endl;
+        return false;
+    }
+    // The output is only opened, and truncated, once the options are known to work.
+    MemoryPlan plan;
+    uint64_t (*lzBytes)(size_t) = options.level >= MIN_LZ_LEVEL ? &LzContext::compressBytes : nullptr;
+    uint64_t finderBytes = options.longMatchTable ? LongMatchFinder::memoryBytes(options.longMatchTable) : 0;
+    bool filters = options.filter != FILTER_NONE;
+    uint64_t (*wordBytes)(size_t) = options.words ? &WordContext::compressBytes : nullptr;
+    if (!planMemory(options, ifs.remaining(), false, 0, lzBytes, filters, wordBytes, finderBytes, plan)) {
+        std::cerr << "Memory budget too small: need at least "
+                  << (2 * IO_BLOCK_SIZE + finderBytes + blockSlotBytes(MIN_BLOCK_SIZE, options.hugePages, true, lzBytes, filters, wordBytes)) / 1024
+                  << " KiB." << std::endl;
+        return false;
+    }
+    if (!ofs.open(outputFile, options.directIO)) {
+        std::cerr << "Error opening files for compression." << std::endl;
+        return false;
+    }
+
+    if (ifs.hasHoles()) {
+        std::vector<unsigned char> header(SPARSE_MAGIC, SPARSE_MAGIC + sizeof(SPARSE_MAGIC));
+        appendValue<uint64_t>(header, ifs.size());
+        appendValue<uint32_t>(header, ifs.dataExtents().size());
+        for (const FileExtent& extent : ifs.dataExtents()) {
+            appendValue(header, extent.offset);
+            appendValue(header, extent.length);
+        }
+        ofs.write(header.data(), header.size());
+    }
+
+    HugePageResource hugePages;
+    TrackingResource tracking(options.hugePages ? &hugePages : std::pmr::get_default_resource());
+    bool ok = compressBlocks(ifs, ofs, plan, options, &tracking);
+
+    ifs.close();
+    if (!ofs.close() || !ok) {
+        std::cerr << "Error writing " << outputFile << std::endl;
+        return false;
+    }
+    std::cout << "File compressed successfully." << std::endl;
+    if (options.memoryBudget > 0) {
+        printMemoryReport(plan, tracking, options.memoryBudget);
+    }
+    return true;
+}
+
+// --- The headers in front of a file's blocks ---
+struct ContainerInfo {
+    std::vector<FileExtent> extents; // Of a file with holes, else empty
+    uint64_t apparentSize = 0;       // Holes included
+    uint32_t version = 0;
+    uint32_t blockSize = 0;
+    uint64_t originalSize = 0;
+    uint32_t flags = 0;
+};
+
+// Reads the sparse header, if there is one, and leaves `ifs` at the block container, whose header
+// is only peeked at. False if there is no block container.
+bool readContainerInfo(BlockReader& ifs, ContainerInfo& info) {
+    char magic[sizeof(SPARSE_MAGIC)] = {};
+    if (ifs.peek(magic, sizeof(magic)) && std::memcmp(magic, SPARSE_MAGIC, sizeof(magic)) == 0) {
+        uint32_t extentCount = 0;
+        if (!ifs.read(magic, sizeof(magic)) || !ifs.read(&info.apparentSize, sizeof(info.apparentSize)) ||
+            !ifs.read(&extentCount, sizeof(extentCount)) || extentCount > ifs.remaining() / sizeof(FileExtent)) {
+            return false;
+        }
+        info.extents.resize(extentCount);
+        for (FileExtent& extent : info.extents) {
+            if (!ifs.read(&extent.offset, sizeof(extent.offset)) || !ifs.read(&extent.length, sizeof(extent.length))) {
+                return false;
+            }
+        }
+    }
+    unsigned char header[sizeof(BLOCK_MAGIC) + 2 * sizeof(uint32_t) + sizeof(uint64_t) + sizeof(uint32_t)] = {};
+    size_t headerSize = sizeof(header);
+    if (!ifs.peek(header, headerSize - sizeof(info.flags)) || std::memcmp(header, BLOCK_MAGIC, sizeof(BLOCK_MAGIC)) != 0) {
+        return false;
+    }
+    std::memcpy(&info.version, header + sizeof(BLOCK_MAGIC), sizeof(info.version));
+    std::memcpy(&info.blockSize, header + sizeof(BLOCK_MAGIC) + sizeof(info.version), sizeof(info.blockSize));
+    std::memcpy(&info.originalSize, header + sizeof(BLOCK_MAGIC) + 2 * sizeof(uint32_t), sizeof(info.originalSize));
+    if (info.version >= 2) {
+        if (!ifs.peek(header, headerSize)) {
+            return false;
+        }
+        std::memcpy(&info.flags, header + headerSize - sizeof(info.flags), sizeof(info.flags));
+    }
+    return info.version >= 1 && info.version <= BLOCK_VERSION && info.blockSize > 0 && info.blockSize <= MAX_BLOCK_SIZE;
+}
+
+// --- Decompression Function ---
+// Reads the block container, optionally behind a sparse header. Streams written before the block
+// container existed (a bare encodeStream) are still accepted.
+bool decompressFile(const std::string& compressedFile, const std::string& decompressedFile, const CompressionOptions& options = CompressionOptions()) {
+    BlockReader ifs;
+    BlockWriter ofs;
+
+    if (!ifs.open(compressedFile, options.directIO)) {
+        std::cerr << "Error opening files for decompression." << std::endl;
+        return false;
+    }
+    char magic[sizeof(SPARSE_MAGIC)] = {};
+    bool sparse = ifs.peek(magic, sizeof(magic)) && std::memcmp(magic, SPARSE_MAGIC, sizeof(magic)) == 0;
+    ContainerInfo info;
+    bool container = readContainerInfo(ifs, info);
+    if (sparse && !container) {
+        std::cerr << "Corrupt compressed file " << compressedFile << std::endl;
+        return false;
+    }
+    // The budget is checked against the container's header before the output is truncated.
+    MemoryPlan plan = {};
+    if (container && !planDecompression(options, info.originalSize, info.blockSize, info.flags, plan)) {
+        std::cerr << "Memory budget too small for " << info.blockSize / 1024 << " KiB blocks." << std::endl;
+        return false;
+    }
+    if (!ofs.open(decompressedFile, options.directIO)) {
+        std::cerr << "Error opening files for decompression." << std::endl;
+        return false;
+    }
+
+    HugePageResource hugePages;
+    TrackingResource tracking(options.hugePages ? &hugePages : std::pmr::get_default_resource());
+    uint64_t damaged = 0;
+    auto decodeInto = [&](auto& output) {
+        if (container) {
+            return decompressBlocks(ifs, output, options, tracking, plan, &damaged);
+        }
+        return decodeStream(ifs, output);
+    };
+
+    bool ok;
+    if (sparse) {
+        // Size the output first so the holes exist, then fill in only the data extents.
+        ok = std::all_of(info.extents.begin(), info.extents.end(), [&](const FileExtent& extent) {
+            return extent.offset <= info.apparentSize && extent.length <= info.apparentSize - extent.offset;
+        });
+        if (ok && ofs.reserve(info.apparentSize)) {
+            ExtentWriter extentWriter(ofs, info.extents);
+            ok = decodeInto(extentWriter) && extentWriter.complete();
+        }
+    } else {
+        ok = decodeInto(ofs);
+    }
+    if (!ok) {
+        std::cerr << "Corrupt compressed file " << compressedFile << std::endl;
+        return false;
+    }
+
+    ifs.close();
+    if (!ofs.close()) {
+        std::cerr << "Error writing " << decompressedFile << std::endl;
+        return false;
+    }
+    if (damaged > 0) {
+        std::cerr << "Recovered " << decompressedFile << " with " << damaged << " damaged block(s) filled with zeros." << std::endl;
+        return false;
+    }
+    std::cout << "File decompressed successfully." << std::endl;
+    if (options.memoryBudget > 0 && plan.blockSize > 0) {
+        printMemoryReport(plan, tracking, options.memoryBudget);
+    }
+    return true;
+}
+
+// Reads the summary table from the end of the file; false if it is missing or corrupt.
+bool readBlockSummaries(BlockReader& ifs, const ContainerInfo& info, std::vector<BlockSummary>& summaries) {
+    uint64_t fileSize = ifs.size();
+    uint64_t tableSize = 0;
+    char magic[sizeof(SUMMARY_MAGIC)] = {};
+    const size_t footerSize = sizeof(tableSize) + sizeof(magic);
+    if (fileSize < footerSize || !ifs.readAt(fileSize - footerSize, &tableSize, sizeof(tableSize)) ||
+        !ifs.readAt(fileSize - sizeof(magic), magic, sizeof(magic)) || std::memcmp(magic, SUMMARY_MAGIC, sizeof(magic)) != 0 ||
+        tableSize > fileSize - footerSize) {
+        return false;
+    }
+    uint64_t blockCount = (info.originalSize + info.blockSize - 1) / info.blockSize;
+    // Every summary takes at least one byte per byte value and newline field.
+    if (blockCount > tableSize / (256 + 3)) {
+        return false;
+    }
+    std::vector<unsigned char> table(tableSize);
+    if (!ifs.readAt(fileSize - footerSize - tableSize, table.data(), tableSize)) {
+        return false;
+    }
+    summaries.resize(blockCount);
+    size_t position = 0;
+    for (uint64_t index = 0; index < blockCount; ++index) {
+        uint32_t rawSize = std::min<uint64_t>(info.blockSize, info.originalSize - index * info.blockSize);
+        if (!takeSummary(table.data(), table.size(), position, rawSize, summaries[index])) {
+            return false;
+        }
+    }
+    return position == table.size();
+}
+
+// --- Search a compressed file for a literal pattern ---
+// Blocks are decoded in parallel as for decompress, but instead of being written out the bytes
+// stream through SearchOutput, which prints every line containing the pattern as
+// "offset:line", the offset being where the line starts in the original file, like grep -b -F.
+//
+// A Huffman block lists the bytes it contains in its code table, and so does every block's
+// stored summary, so blocks that can't hold the pattern are skipped undecoded. A match may also
+// cross into the next block, so a block is kept if it could hold the start of a match that the
+// next one completes, or the end of one begun in the block before. Lines that run into a skipped
+// block are printed up to it, and lines are cut at MAX_SEARCH_LINE bytes.
+const size_t MAX_SEARCH_LINE = 64 * 1024;
+
+class SearchOutput {
+public:
+    // `extents` are where the decoded bytes lie in a file with holes, see ExtentWriter; empty for
+    // one without. `summaries` are the blocks' stored summaries, if the file has them.
+    SearchOutput(const std::string& pattern, const std::vector<FileExtent>& extents, const std::vector<BlockSummary>& summaries)
+        : pattern_(pattern), extents_(extents), summaries_(summaries), seamPrefix_(pattern.size() - 1) {
+        line_.reserve(MAX_SEARCH_LINE + pattern.size());
+    }
+
+    // False if the block can be skipped: the pattern can't lie in it, and no match can cross
+    // from the block before into it or from it into the next. Without summaries only Huffman
+    // blocks are judged; other methods would have to be decoded first.
+    bool wantsBlock(uint8_t method, const unsigned char* stored, size_t storedSize) {
+        size_t length = pattern_.size();
+        size_t index = block_++;
+        bool present[256] = {};
+        if (index < summaries_.size()) {
+            for (int byte = 0; byte < 256; ++byte) {
+                present[byte] = summaries_[index].histogram[byte] > 0;
+            }
+        } else if (method != BLOCK_HUFFMAN || !huffmanSymbols(stored, storedSize, present)) {
+            seamPrefix_ = length - 1;
+            return true;
+        }
+        // Longest prefix and suffix of the pattern made only of bytes the block contains.
+        size_t prefix = 0;
+        while (prefix < length && present[static_cast<unsigned char>(pattern_[prefix])]) {
+            ++prefix;
+        }
+        size_t suffix = 0;
+        while (suffix < length && present[static_cast<unsigned char>(pattern_[length - 1 - suffix])]) {
+            ++suffix;
+        }
+        // Any match that lies in the block, or starts in it, begins with pattern_[0]; one the
+        // previous block began with at most seamPrefix_ bytes ends here in the rest.
+        bool wanted = prefix > 0 || (seamPrefix_ > 0 && suffix >= length - seamPrefix_);
+        seamPrefix_ = std::min(prefix, length - 1);
+        if (!wanted) {
+            countStat(COUNTER_BLOCKS_SKIPPED, 1);
+        }
+        return wanted;
+    }
+
+    void write(const void* data, size_t length) {
+        const unsigned char* in = static_cast<const unsigned char*>(data);
+        while (length > 0) {
+            if (left_ == 0) {
+                nextExtent();
+                continue;
+            }
+            size_t chunk = std::min<uint64_t>(length, left_);
+            scan(in, chunk);
+            in += chunk;
+            length -= chunk;
+            left_ -= chunk;
+        }
+    }
+
+    void skip(uint64_t length) {
+        endRun();
+        while (length > 0) {
+            if (left_ == 0) {
+                nextExtent();
+                continue;
+            }
+            uint64_t chunk = std::min(length, left_);
+            offset_ += chunk;
+            length -= chunk;
+            left_ -= chunk;
+        }
+    }
+
+    // Long matches would have to be read back from output that is never written.
+    bool readBack(uint64_t, void*, size_t) {
+        return false;
+    }
+
+    // Prints the last line if it matched and flushes the output; returns the matching lines.
+    uint64_t finish() {
+        endRun();
+        std::cout.write(printed_.data(), printed_.size());
+        printed_.clear();
+        std::cout.flush();
+        return matches_;
+    }
+
+private:
+    // Marks the bytes the Huffman payload `stored` has codes for; false if its header is malformed.
+    static bool huffmanSymbols(const unsigned char* stored, size_t storedSize, bool (&present)[256]) {
+        const size_t entryBytes = sizeof(char) + 2 * sizeof(int);
+        int count = 0;
+        if (storedSize < sizeof(count)) {
+            return false;
+        }
+        std::memcpy(&count, stored, sizeof(count));
+        if (count < 0 || count > 256 || storedSize - sizeof(count) < count * entryBytes) {
+            return false;
+        }
+        for (int i = 0; i < count; ++i) {
+            present[stored[sizeof(count) + i * entryBytes]] = true;
+        }
+        return true;
+    }
+
+    // Moves to the next extent; the hole before it ends the current run of bytes.
+    void nextExtent() {
+        endRun();
+        if (extents_.empty()) {
+            left_ = UINT64_MAX;
+        } else if (extent_ < extents_.size()) {
+            offset_ = extents_[extent_].offset;
+            left_ = extents_[extent_++].length;
+        } else {
+            left_ = UINT64_MAX; // More data than the extents hold; counted on from the end
+        }
+    }
+
+    // Ends the line in progress where the bytes stop being contiguous.
+    void endRun() {
+        if (lineMatched_) {
+            printLine(lineOffset_, line_.data(), line_.size());
+        }
+        line_.clear();
+        lineMatched_ = false;
+        lineOffset_ = offset_;
+    }
+
+    // Searches `length` contiguous bytes that follow the ones scanned before.
+    void scan(const unsigned char* data, size_t length) {
+        const unsigned char* end = data + length;
+        const unsigned char* next = data;
+        // Finish the line carried over from the previous bytes.
+        if (!line_.empty()) {
+            const unsigned char* newline = static_cast<const unsigned char*>(std::memchr(data, '\n', length));
+            const unsigned char* lineEnd = newline ? newline : end;
+            if (!lineMatched_) {
+                // A match that starts in the carried bytes, then one that lies in the new ones.
+                size_t tail = std::min(line_.size(), pattern_.size() - 1);
+                size_t head = std::min<size_t>(lineEnd - data, pattern_.size() - 1);
+                seam_.assign(line_.end() - tail, line_.end());
+                seam_.insert(seam_.end(), data, data + head);
+                lineMatched_ = find(seam_.data(), seam_.size()) || find(data, lineEnd - data);
+            }
+            appendLine(data, lineEnd);
+            if (!newline) {
+                offset_ += length;
+                return;
+            }
+            if (lineMatched_) {
+                printLine(lineOffset_, line_.data(), line_.size());
+            }
+            line_.clear();
+            lineMatched_ = false;
+            next = newline + 1;
+        }
+        while (next < end) {
+            const unsigned char* match = find(next, end - next);
+            if (!match) {
+                break;
+            }
+            const unsigned char* lineStart = static_cast<const unsigned char*>(memrchr(next, '\n', match - next));
+            lineStart = lineStart ? lineStart + 1 : next;
+            const unsigned char* newline = static_cast<const unsigned char*>(std::memchr(match, '\n', end - match));
+            if (!newline) {
+                // The matching line goes on in the next bytes.
+                lineOffset_ = offset_ + (lineStart - data);
+                lineMatched_ = true;
+                appendLine(lineStart, end);
+                offset_ += length;
+                return;
+            }
+            printLine(offset_ + (lineStart - data), lineStart, std::min<size_t>(newline - lineStart, MAX_SEARCH_LINE));
+            next = newline + 1;
+        }
+        // Carry the last, unfinished line.
+        if (next < end) {
+            const unsigned char* lastNewline = static_cast<const unsigned char*>(memrchr(next, '\n', end - next));
+            const unsigned char* lineStart = lastNewline ? lastNewline + 1 : next;
+            lineOffset_ = offset_ + (lineStart - data);
+            appendLine(lineStart, end);
+        }
+        offset_ += length;
+    }
+
+    const unsigned char* find(const unsigned char* data, size_t length) const {
+        return static_cast<const unsigned char*>(memmem(data, length, pattern_.data(), pattern_.size()));
+    }
+
+    // Adds to the carried line. Past MAX_SEARCH_LINE a matched line is cut, and an unmatched one
+    // keeps only the bytes a match could still start in.
+    void appendLine(const unsigned char* begin, const unsigned char* end) {
+        if (lineMatched_) {
+            end = begin + std::min<size_t>(end - begin, MAX_SEARCH_LINE - std::min(line_.size(), MAX_SEARCH_LINE));
+        } else if (line_.size() + (end - begin) > MAX_SEARCH_LINE) {
+            size_t keep = pattern_.size() - 1;
+            if (size_t(end - begin) >= keep) {
+                lineOffset_ += line_.size() + (end - begin) - keep;
+                line_.assign(end - keep, end);
+                return;
+            }
+            size_t drop = line_.size() + (end - begin) - keep;
+            line_.erase(line_.begin(), line_.begin() + drop);
+            lineOffset_ += drop;
+        }
+        line_.insert(line_.end(), begin, end);
+    }
+
+    void printLine(uint64_t offset, const unsigned char* line, size_t length) {
+        printed_ += std::to_string(offset);
+        printed_ += ':';
+        printed_.append(reinterpret_cast<const char*>(line), length);
+        printed_ += '\n';
+        ++matches_;
+        if (printed_.size() >= IO_BLOCK_SIZE) {
+            std::cout.write(printed_.data(), printed_.size());
+            printed_.clear();
+        }
+    }
+
+    std::string pattern_;
+    const std::vector<FileExtent>& extents_;
+    const std::vector<BlockSummary>& summaries_;
+    size_t block_ = 0; // Blocks asked about so far
+    size_t extent_ = 0;
+    uint64_t left_ = 0;   // Bytes left in the current extent
+    uint64_t offset_ = 0; // File offset of the next byte
+    size_t seamPrefix_;   // Longest pattern prefix the last block may end with
+    std::vector<unsigned char> line_; // The unfinished line, or its last bytes
+    std::vector<unsigned char> seam_; // Bytes around a seam between writes
+    uint64_t lineOffset_ = 0;         // File offset of line_[0]
+    bool lineMatched_ = false;
+    uint64_t matches_ = 0;
+    std::string printed_; // Output not yet handed to std::cout
+};
+
+// Prints the lines of the compressed file that contain `pattern`; see SearchOutput.
+bool searchFile(const std::string& pattern, const std::string& compressedFile, const CompressionOptions& options = CompressionOptions()) {
+    if (pattern.empty() || pattern.size() > MIN_BLOCK_SIZE || pattern.find('\n') != std::string::npos) {
+        std::cerr << "The pattern must be one line of at most " << MIN_BLOCK_SIZE << " bytes." << std::endl;
+        return false;
+    }
+    BlockReader ifs;
+    if (!ifs.open(compressedFile, options.directIO)) {
+        std::cerr << "Error opening " << compressedFile << std::endl;
+        return false;
+    }
+    ContainerInfo info;
+    if (!readContainerInfo(ifs, info)) {
+        std::cerr << compressedFile << " is not a block container." << std::endl;
+        return false;
+    }
+    if (info.flags & BLOCK_FLAG_LONG) {
+        std::cerr << "Files compressed with --long can't be searched; decompress them instead." << std::endl;
+        return false;
+    }
+    // Stored summaries tell which bytes every block holds, whatever its method.
+    std::vector<BlockSummary> summaries;
+    if ((info.flags & BLOCK_FLAG_SUMMARIES) && !readBlockSummaries(ifs, info, summaries)) {
+        std::cerr << "Corrupt block summaries in " << compressedFile << std::endl;
+        return false;
+    }
+
+    MemoryPlan plan = {};
+    if (!planDecompression(options, info.originalSize, info.blockSize, info.flags, plan)) {
+        std::cerr << "Memory budget too small for " << info.blockSize / 1024 << " KiB blocks." << std::endl;
+        return false;
+    }
+    TrackingResource tracking(std::pmr::get_default_resource());
+    SearchOutput output(pattern, info.extents, summaries);
+    bool ok = decompressBlocks(ifs, output, options, tracking, plan);
+    output.finish();
+    if (!ok) {
+        std::cerr << "Corrupt compressed file " << compressedFile << std::endl;
+    }
+    return ok;
+}
+
+// --- Print the statistics of a file from its block summaries ---
+bool summarizeFile(const std::string& compressedFile) {
+    BlockReader ifs;
+    ContainerInfo info;
+    std::vector<BlockSummary> summaries;
+    if (!ifs.open(compressedFile) || !readContainerInfo(ifs, info)) {
+        std::cerr << "Error reading " << compressedFile << std::endl;
+        return false;
+    }
+    if (!(info.flags & BLOCK_FLAG_SUMMARIES)) {
+        std::cerr << compressedFile << " has no block summaries; compress it with --summaries." << std::endl;
+        return false;
+    }
+    if (!readBlockSummaries(ifs, info, summaries)) {
+        std::cerr << "Corrupt block summaries in " << compressedFile << std::endl;
+        return false;
+    }
+    uint64_t histogram[256] = {};
+    uint64_t longestLine = 0;
+    uint64_t lineSoFar = 0; // Length of the line running into the next block
+    for (const BlockSummary& summary : summaries) {
+        uint64_t blockBytes = 0;
+        for (int byte = 0; byte < 256; ++byte) {
+            histogram[byte] += summary.histogram[byte];
+            blockBytes += summary.histogram[byte];
+        }
+        if (summary.histogram['\n'] == 0) {
+            lineSoFar += blockBytes;
+            continue;
+        }
+        longestLine = std::max<uint64_t>({longestLine, lineSoFar + summary.firstNewline, summary.longestLine});
+        lineSoFar = blockBytes - summary.lastNewline - 1;
+    }
+    longestLine = std::max(longestLine, lineSoFar);
+
+    int distinct = 0;
+    int lowest = -1;
+    int highest = -1;
+    double bits = 0;
+    for (int byte = 0; byte < 256; ++byte) {
+        if (histogram[byte]) {
+            ++distinct;
+            lowest = lowest < 0 ? byte : lowest;
+            highest = byte;
+            bits += histogram[byte] * std::log2(double(info.originalSize) / histogram[byte]);
+        }
+    }
+    std::cout << "Size: " << info.originalSize << " bytes in " << summaries.size() << " block(s)\n"
+              << "Lines: " << histogram['\n'] << " newline(s), longest line " << longestLine << " bytes\n"
+              << "Bytes: " << distinct << " distinct";
+    if (distinct > 0) {
+        std::cout << ", min 0x" << std::hex << lowest << ", max 0x" << highest << std::dec << ", entropy "
+                  << bits / info.originalSize << " bits/byte";
+    }
+    std::cout << "\n";
+    if (!info.extents.empty()) {
+        std::cout << "Holes: " << info.apparentSize - info.originalSize << " bytes, not counted\n";
+    }
+    std::cout << "Histogram:\n";
+    for (int byte = 0; byte < 256; ++byte) {
+        if (histogram[byte]) {
+            std::cout << "  0x" << std::hex << (byte < 16 ? "0" : "") << byte << std::dec << " " << histogram[byte] << "\n";
+        }
+    }
+    return true;
+}
+
+// --- Archive format ---
+// A multi-file container: every entry is compressed independently (compressBuffer format) and
+// stored back to back after the header, followed by a central directory and a fixed-size footer
+// pointing at it. A single entry can be extracted by reading the footer, the directory and then
+// only that entry's bytes.
+//
+//   header:    "HFAR" u32 version
+//   entries:   compressed payloads
+//   directory: per entry u16 name length, name, u64 original size, u64 compressed size,
+//              u64 offset, u32 CRC-32 of the original bytes
+//   footer:    u64 directory offset, u32 entry count, "HFAR"
+const char ARCHIVE_MAGIC[4] = {'H', 'F', 'A', 'R'};
+const uint32_t ARCHIVE_VERSION = 1;
+const size_t ARCHIVE_FOOTER_SIZE = sizeof(uint64_t) + sizeof(uint32_t) + sizeof(ARCHIVE_MAGIC);
+
+struct ArchiveEntry {
+    std::string name; // Path relative to the archived directory, '/' separated
+    uint64_t originalSize = 0;
+    uint64_t compressedSize = 0;
+    uint64_t offset = 0;
+    uint32_t crc = 0;
+};
+
+// --- Read a whole file into memory ---
+bool readWholeFile(const std::string& path, std::vector<unsigned char>& data, bool directIO = false) {
+    BlockReader ifs;
+    if (!ifs.open(path, directIO)) {
+        return false;
+    }
+    data.resize(ifs.size());
+    return ifs.read(data.data(), data.size());
+}
+
+// --- Read `length` bytes at `offset` of an open file ---
+bool readRange(int fd, uint64_t offset, size_t length, std::vector<unsigned char>& data) {
+    StageTimer timer(STAGE_READ);
+    countStat(COUNTER_BYTES_READ, length);
+    data.resize(length);
+    return preadFully(fd, data.data(), length, offset);
+}
+
+// --- List the regular files below inputPath (or inputPath itself if it is a file) ---
+// Names are relative to inputPath, '/' separated and sorted so output is reproducible.
+bool collectInputFiles(const std::string& inputPath, std::vector<std::string>& sources, std::vector<std::string>& names) {
+    namespace fs = std::filesystem;
+    std::error_code error;
+    if (fs::is_directory(inputPath, error)) {
+        for (auto it = fs::recursive_directory_iterator(inputPath, error); !error && it != fs::recursive_directory_iterator();
+             it.increment(error)) {
+            if (it->is_regular_file(error)) {
+                sources.push_back(it->path().string());
+            }
+        }
+        std::sort(sources.begin(), sources.end());
+        for (const std::string& source : sources) {
+            names.push_back(fs::path(source).lexically_relative(inputPath).generic_string());
+        }
+    } else if (fs::is_regular_file(inputPath, error)) {
+        sources.push_back(inputPath);
+        names.push_back(fs::path(inputPath).filename().generic_string());
+    }
+    return !error && !sources.empty();
+}
+
+// --- Write an extracted file below outputDir, refusing names that would escape it ---
+bool writeOutputFile(const std::string& outputDir, const std::string& name, const std::vector<unsigned char>& data, bool directIO) {
+    namespace fs = std::filesystem;
+    fs::path relative(name);
+    if (relative.empty() || relative.is_absolute()) {
+        return false;
+    }
+    for (const fs::path& part : relative) {
+        if (part == "..") {
+            return false;
+        }
+    }
+    fs::path target = fs::path(outputDir) / relative;
+    std::error_code error;
+    fs::create_directories(target.parent_path(), error);
+
+    BlockWriter ofs;
+    if (!ofs.open(target.string(), directIO)) {
+        return false;
+    }
+    ofs.write(data.data(), data.size());
+    return ofs.close();
+}
+
+// --- Pack a directory tree (or a single file) into an archive ---
+// Entries are compressed in parallel; results are written in directory order as they complete,
+// with at most two entries per worker in flight to bound memory.
+// Entries are coded independently rather than as one solid stream so extract can pull a
+// single entry and entries can be compressed in parallel.
+bool createArchive(const std::string& inputPath, const std::string& archiveFile, unsigned threads, bool directIO = false) {
+    std::vector<std::string> sources;
+    std::vector<std::string> names;
+    if (!collectInputFiles(inputPath, sources, names)) {
+        std::cerr << "Nothing to archive at " << inputPath << std::endl;
+        return false;
+    }
+    std::vector<ArchiveEntry> entries(names.size());
+    for (size_t i = 0; i < names.size(); ++i) {
+        entries[i].name = names[i];
+    }
+
+    BlockWriter ofs;
+    if (!ofs.open(archiveFile, directIO)) {
+        std::cerr << "Error opening " << archiveFile << std::endl;
+        return false;
+    }
+    ofs.write(ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC));
+    ofs.write(&ARCHIVE_VERSION, sizeof(ARCHIVE_VERSION));
+    uint64_t offset = sizeof(ARCHIVE_MAGIC) + sizeof(ARCHIVE_VERSION);
+
+    struct Compressed {
+        bool ok = false;
+        uint64_t originalSize = 0;
+        uint32_t crc = 0;
+        std::vector<unsigned char> payload;
+    };
+    auto compressEntry = [directIO](const std::string& source, size_t index) {
+        TraceBlock block(index);
+        Compressed result;
+        std::vector<unsigned char> data;
+        if (!readWholeFile(source, data, directIO)) {
+            return result;
+        }
+        result.originalSize = data.size();
+        result.crc = crc32(data.data(), data.size());
+        compressBuffer(data, result.payload);
+        result.ok = true;
+        return result;
+    };
+
+    ExecutorJob job(threads);
+    std::deque<std::future<Compressed>> inFlight;
+    size_t next = 0;
+    bool ok = true;
+    for (size_t i = 0; i < entries.size() && ok; ++i) {
+        while (next < sources.size() && inFlight.size() < 2 * job.size()) {
+            const std::string& source = sources[next];
+            inFlight.push_back(job.submit([&compressEntry, &source, next] { return compressEntry(source, next); }));
+            ++next;
+        }
+        Compressed result = inFlight.front().get();
+        inFlight.pop_front();
+        if (!result.ok) {
+            std::cerr << "Error reading " << sources[i] << std::endl;
+            ok = false;
+            break;
+        }
+        entries[i].originalSize = result.originalSize;
+        entries[i].compressedSize = result.payload.size();
+        entries[i].offset = offset;
+        entries[i].crc = result.crc;
+        TraceBlock block(i);
+        ofs.write(result.payload.data(), result.payload.size());
+        offset += result.payload.size();
+    }
+    for (std::future<Compressed>& pending : inFlight) {
+        pending.wait();
+    }
+    if (!ok) {
+        ofs.close();
+        return false;
+    }
+
+    std::vector<unsigned char> directory;
+    for (const ArchiveEntry& entry : entries) {
+        appendValue<uint16_t>(directory, entry.name.size());
+        directory.insert(directory.end(), entry.name.begin(), entry.name.end());
+        appendValue(directory, entry.originalSize);
+        appendValue(directory, entry.compressedSize);
+        appendValue(directory, entry.offset);
+        appendValue(directory, entry.crc);
+    }
+    appendValue<uint64_t>(directory, offset);
+    appendValue<uint32_t>(directory, entries.size());
+    directory.insert(directory.end(), ARCHIVE_MAGIC, ARCHIVE_MAGIC + sizeof(ARCHIVE_MAGIC));
+    ofs.write(directory.data(), directory.size());
+
+    if (!ofs.close()) {
+        std::cerr << "Error writing " << archiveFile << std::endl;
+        return false;
+    }
+    std::cout << "Archived " << entries.size() << " file(s) into " << archiveFile << std::endl;
+    return true;
+}
+
+// --- Read the central directory of an archive ---
+// Only the footer and the directory are read; entry payloads are left untouched.
+bool readArchiveDirectory(int fd, std::vector<ArchiveEntry>& entries) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) < sizeof(ARCHIVE_MAGIC) + sizeof(uint32_t) + ARCHIVE_FOOTER_SIZE) {
+        return false;
+    }
+    uint64_t fileSize = st.st_size;
+
+    std::vector<unsigned char> header;
+    if (!readRange(fd, 0, sizeof(ARCHIVE_MAGIC) + sizeof(uint32_t), header) ||
+        std::memcmp(header.data(), ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC)) != 0) {
+        return false;
+    }
+    uint32_t version;
+    std::memcpy(&version, header.data() + sizeof(ARCHIVE_MAGIC), sizeof(version));
+    if (version != ARCHIVE_VERSION) {
+        return false;
+    }
+
+    std::vector<unsigned char> footer;
+    if (!readRange(fd, fileSize - ARCHIVE_FOOTER_SIZE, ARCHIVE_FOOTER_SIZE, footer) ||
+        std::memcmp(footer.data() + ARCHIVE_FOOTER_SIZE - sizeof(ARCHIVE_MAGIC), ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC)) != 0) {
+        return false;
+    }
+    size_t position = 0;
+    uint64_t directoryOffset = 0;
+    uint32_t entryCount = 0;
+    takeValue(footer, position, directoryOffset);
+    takeValue(footer, position, entryCount);
+    if (directoryOffset > fileSize - ARCHIVE_FOOTER_SIZE) {
+        return false;
+    }
+
+    std::vector<unsigned char> directory;
+    if (!readRange(fd, directoryOffset, fileSize - ARCHIVE_FOOTER_SIZE - directoryOffset, directory)) {
+        return false;
+    }
+    position = 0;
+    entries.clear();
+    for (uint32_t i = 0; i < entryCount; ++i) {
+        ArchiveEntry entry;
+        uint16_t nameLength;
+        if (!takeValue(directory, position, nameLength) || directory.size() - position < nameLength) {
+            return false;
+        }
+        entry.name.assign(reinterpret_cast<const char*>(directory.data() + position), nameLength);
+        position += nameLength;
+        if (!takeValue(directory, position, entry.originalSize) || !takeValue(directory, position, entry.compressedSize) ||
+            !takeValue(directory, position, entry.offset) || !takeValue(directory, position, entry.crc) ||
+            entry.offset > directoryOffset || entry.compressedSize > directoryOffset - entry.offset) {
+            return false;
+        }
+        entries.push_back(entry);
+    }
+    return true;
+}
+
+// --- Decompress one archive entry and check it against its CRC ---
+bool readArchiveEntry(int fd, const ArchiveEntry& entry, std::vector<unsigned char>& data) {
+    std::vector<unsigned char> payload;
+    data.clear();
+    if (!readRange(fd, entry.offset, entry.compressedSize, payload) ||
+        !decompressBuffer(payload.data(), payload.size(), data)) {
+        return false;
+    }
+    return data.size() == entry.originalSize && crc32(data.data(), data.size()) == entry.crc;
+}
+
+// --- Extract every entry, or just the one named `only` ---
+bool extractArchive(const std::string& archiveFile, const std::string& outputDir, const std::string& only, unsigned threads, bool directIO = false) {
+    int fd = open(archiveFile.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Error opening " << archiveFile << std::endl;
+        return false;
+    }
+    std::vector<ArchiveEntry> entries;
+    if (!readArchiveDirectory(fd, entries)) {
+        std::cerr << "Invalid archive " << archiveFile << std::endl;
+        close(fd);
+        return false;
+    }
+    if (!only.empty()) {
+        auto match = std::find_if(entries.begin(), entries.end(), [&only](const ArchiveEntry& e) { return e.name == only; });
+        if (match == entries.end()) {
+            std::cerr << "No entry " << only << " in " << archiveFile << std::endl;
+            close(fd);
+            return false;
+        }
+        entries = {*match};
+    }
+
+    ExecutorJob job(threads);
+    std::vector<std::future<bool>> results;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        const ArchiveEntry& entry = entries[i];
+        results.push_back(job.submit([fd, &entry, &outputDir, directIO, i] {
+            TraceBlock block(i);
+            std::vector<unsigned char> data;
+            return readArchiveEntry(fd, entry, data) && writeOutputFile(outputDir, entry.name, data, directIO);
+        }));
+    }
+    bool ok = true;
+    for (size_t i = 0; i < results.size(); ++i) {
+        if (!results[i].get()) {
+            std::cerr << "Error extracting " << entries[i].name << std::endl;
+            ok = false;
+        }
+    }
+    close(fd);
+    if (ok) {
+        std::cout << "Extracted " << entries.size() << " file(s) to " << outputDir << std::endl;
+    }
+    return ok;
+}
+
+// --- List archive entries ---
+bool listArchive(const std::string& archiveFile) {
+    int fd = open(archiveFile.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Error opening " << archiveFile << std::endl;
+        return false;
+    }
+    std::vector<ArchiveEntry> entries;
+    bool ok = readArchiveDirectory(fd, entries);
+    close(fd);
+    if (!ok) {
+        std::cerr << "Invalid archive " << archiveFile << std::endl;
+        return false;
+    }
+    for (const ArchiveEntry& entry : entries) {
+        std::cout << entry.originalSize << "\t" << entry.compressedSize << "\t" << entry.name << std::endl;
+    }
+    return true;
+}
+
+// --- SHA-256, used to fingerprint deduplicated chunks ---
+struct Sha256Digest {
+    unsigned char bytes[32];
+
+    bool operator==(const Sha256Digest& other) const {
+        return std::memcmp(bytes, other.bytes, sizeof(bytes)) == 0;
+    }
+};
+
+struct Sha256DigestHash {
+    size_t operator()(const Sha256Digest& digest) const {
+        size_t h;
+        std::memcpy(&h, digest.bytes, sizeof(h)); // Already uniformly distributed
+        return h;
+    }
+};
+
+Sha256Digest sha256(const unsigned char* data, size_t length) {
+    static const uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+    uint32_t h[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    auto rotr = [](uint32_t x, int n) { return (x >> n) | (x << (32 - n)); };
+
+    auto compress = [&](const unsigned char* block) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i) {
+            w[i] = (uint32_t(block[4 * i]) << 24) | (uint32_t(block[4 * i + 1]) << 16) | (uint32_t(block[4 * i + 2]) << 8) | block[4 * i + 3];
+        }
+        for (int i = 16; i < 64; ++i) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+        for (int i = 0; i < 64; ++i) {
+            uint32_t t1 = hh + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            hh = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+    };
+
+    size_t full = length / 64 * 64;
+    for (size_t i = 0; i < full; i += 64) {
+        compress(data + i);
+    }
+    // Final block(s): remaining bytes, 0x80, zero fill, 64-bit big-endian bit length.
+    unsigned char tail[128] = {};
+    size_t rest = length - full;
+    std::memcpy(tail, data + full, rest);
+    tail[rest] = 0x80;
+    size_t tailLength = rest + 9 <= 64 ? 64 : 128;
+    uint64_t bits = static_cast<uint64_t>(length) * 8;
+    for (int i = 0; i < 8; ++i) {
+        tail[tailLength - 1 - i] = static_cast<unsigned char>(bits >> (8 * i));
+    }
+    for (size_t i = 0; i < tailLength; i += 64) {
+        compress(tail + i);
+    }
+
+    Sha256Digest digest;
+    for (int i = 0; i < 8; ++i) {
+        digest.bytes[4 * i] = h[i] >> 24;
+        digest.bytes[4 * i + 1] = h[i] >> 16;
+        digest.bytes[4 * i + 2] = h[i] >> 8;
+        digest.bytes[4 * i + 3] = h[i];
+    }
+    return digest;
+}
+
+// --- Content-defined chunking (FastCDC) ---
+// A gear rolling hash picks cut points from the content itself, so an insertion only moves the
+// chunk boundaries around it and the rest of a near-identical file still yields identical chunks.
+// Normalized chunking uses a stricter mask before the average size and a looser one after it,
+// which keeps chunk sizes close to CDC_AVERAGE_CHUNK.
+const size_t CDC_MIN_CHUNK = 2 * 1024;
+const size_t CDC_AVERAGE_CHUNK = 8 * 1024;
+const size_t CDC_MAX_CHUNK = 64 * 1024;
+const uint64_t CDC_MASK_SMALL = 0x0000d9f003530000ull; // 15 bits set
+const uint64_t CDC_MASK_LARGE = 0x0000d90003530000ull; // 11 bits set
+
+const uint64_t* gearTable() {
+    static const std::vector<uint64_t> table = [] {
+        std::vector<uint64_t> t(256);
+        uint64_t state = 0x9E3779B97F4A7C15ull; // splitmix64: fixed, so chunking is reproducible
+        for (uint64_t& value : t) {
+            state += 0x9E3779B97F4A7C15ull;
+            uint64_t z = state;
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+            value = z ^ (z >> 31);
+        }
+        return t;
+    }();
+    return table.data();
+}
+
+// Length of the next chunk at the start of data[0, length).
+size_t nextChunkLength(const unsigned char* data, size_t length) {
+    if (length <= CDC_MIN_CHUNK) {
+        return length;
+    }
+    const uint64_t* gear = gearTable();
+    size_t end = std::min(length, CDC_MAX_CHUNK);
+    size_t normal = std::min(end, CDC_AVERAGE_CHUNK);
+    uint64_t fingerprint = 0;
+    size_t i = CDC_MIN_CHUNK;
+    for (; i < normal; ++i) {
+        fingerprint = (fingerprint << 1) + gear[data[i]];
+        if (!(fingerprint & CDC_MASK_SMALL)) {
+            return i + 1;
+        }
+    }
+    for (; i < end; ++i) {
+        fingerprint = (fingerprint << 1) + gear[data[i]];
+        if (!(fingerprint & CDC_MASK_LARGE)) {
+            return i + 1;
+        }
+    }
+    return end;
+}
+
+// --- Deduplicating store format ---
+// Input files are split into content-defined chunks; each distinct chunk (by SHA-256) is
+// compressed once and stored once, and files become lists of chunk indices.
+//
+//   header:  "HFDD" u32 version
+//   chunks:  compressed payloads of the unique chunks
+//   chunk table: u32 count, per chunk u64 offset, u32 compressed size, u32 original size, 32-byte SHA-256
+//   file table:  u32 count, per file u16 name length, name, u64 size, u32 CRC-32, u32 chunk count, u32 chunk indices
+//   footer:  u64 chunk table offset, "HFDD"
+const char DEDUP_MAGIC[4] = {'H', 'F', 'D', 'D'};
+const uint32_t DEDUP_VERSION = 1;
+const size_t DEDUP_FOOTER_SIZE = sizeof(uint64_t) + sizeof(DEDUP_MAGIC);
+
+struct DedupChunk {
+    uint64_t offset = 0;
+    uint32_t compressedSize = 0;
+    uint32_t originalSize = 0;
+    Sha256Digest digest;
+};
+
+struct DedupFile {
+    std::string name;
+    uint64_t size = 0;
+    uint32_t crc = 0;
+    std::vector<uint32_t> chunks;
+};
+
+// --- Chunk, fingerprint and store the files below inputPath ---
+// Duplicate chunks are detected before compression, so repeats cost neither CPU nor space.
+// Unique chunks are compressed on the thread pool and written in order as they complete.
+bool createDedupStore(const std::string& inputPath, const std::string& storeFile, unsigned threads, bool directIO = false) {
+    std::vector<std::string> sources;
+    std::vector<std::string> names;
+    if (!collectInputFiles(inputPath, sources, names)) {
+        std::cerr << "Nothing to store at " << inputPath << std::endl;
+        return false;
+    }
+
+    BlockWriter ofs;
+    if (!ofs.open(storeFile, directIO)) {
+        std::cerr << "Error opening " << storeFile << std::endl;
+        return false;
+    }
+    ofs.write(DEDUP_MAGIC, sizeof(DEDUP_MAGIC));
+    ofs.write(&DEDUP_VERSION, sizeof(DEDUP_VERSION));
+    uint64_t offset = sizeof(DEDUP_MAGIC) + sizeof(DEDUP_VERSION);
+
+    std::vector<DedupChunk> chunks;
+    std::vector<DedupFile> files(sources.size());
+    std::unordered_map<Sha256Digest, uint32_t, Sha256DigestHash> chunkIndex;
+    uint64_t totalBytes = 0;
+    uint64_t totalChunks = 0;
+
+    ExecutorJob job(threads);
+    std::deque<std::future<std::vector<unsigned char>>> inFlight;
+    size_t written = 0;
+    auto writeCompleted = [&](size_t keepInFlight) {
+        while (inFlight.size() > keepInFlight) {
+            std::vector<unsigned char> payload = inFlight.front().get();
+            inFlight.pop_front();
+            TraceBlock block(written);
+            DedupChunk& chunk = chunks[written++];
+            chunk.offset = offset;
+            chunk.compressedSize = payload.size();
+            ofs.write(payload.data(), payload.size());
+            offset += payload.size();
+        }
+    };
+
+    for (size_t f = 0; f < sources.size(); ++f) {
+        // Chunks hold pointers into the file's buffer, so it must outlive their compression.
+        auto data = std::make_shared<std::vector<unsigned char>>();
+        if (!readWholeFile(sources[f], *data, directIO)) {
+            std::cerr << "Error reading " << sources[f] << std::endl;
+            writeCompleted(0);
+            ofs.close();
+            return false;
+        }
+        DedupFile& file = files[f];
+        file.name = names[f];
+        file.size = data->size();
+        file.crc = crc32(data->data(), data->size());
+        totalBytes += data->size();
+
+        size_t position = 0;
+        while (position < data->size()) {
+            size_t length = nextChunkLength(data->data() + position, data->size() - position);
+            Sha256Digest digest = sha256(data->data() + position, length);
+            auto [it, inserted] = chunkIndex.emplace(digest, static_cast<uint32_t>(chunks.size()));
+            if (inserted) {
+                DedupChunk chunk;
+                chunk.originalSize = length;
+                chunk.digest = digest;
+                chunks.push_back(chunk);
+                inFlight.push_back(job.submit([data, position, length, index = chunks.size() - 1] {
+                    TraceBlock block(index);
+                    std::vector<unsigned char> piece(data->begin() + position, data->begin() + position + length);
+                    std::vector<unsigned char> payload;
+                    compressBuffer(piece, payload);
+                    return payload;
+                }));
+                writeCompleted(2 * job.size());
+            }
+            file.chunks.push_back(it->second);
+            position += length;
+            ++totalChunks;
+        }
+    }
+    writeCompleted(0);
+
+    std::vector<unsigned char> tables;
+    appendValue<uint32_t>(tables, chunks.size());
+    for (const DedupChunk& chunk : chunks) {
+        appendValue(tables, chunk.offset);
+        appendValue(tables, chunk.compressedSize);
+        appendValue(tables, chunk.originalSize);
+        tables.insert(tables.end(), chunk.digest.bytes, chunk.digest.bytes + sizeof(chunk.digest.bytes));
+    }
+    appendValue<uint32_t>(tables, files.size());
+    for (const DedupFile& file : files) {
+        appendValue<uint16_t>(tables, file.name.size());
+        tables.insert(tables.end(), file.name.begin(), file.name.end());
+        appendValue(tables, file.size);
+        appendValue(tables, file.crc);
+        appendValue<uint32_t>(tables, file.chunks.size());
+        for (uint32_t index : file.chunks) {
+            appendValue(tables, index);
+        }
+    }
+    appendValue<uint64_t>(tables, offset);
+    tables.insert(tables.end(), DEDUP_MAGIC, DEDUP_MAGIC + sizeof(DEDUP_MAGIC));
+    ofs.write(tables.data(), tables.size());
+
+    if (!ofs.close()) {
+        std::cerr << "Error writing " << storeFile << std::endl;
+        return false;
+    }
+    std::cout << "Stored " << files.size() << " file(s), " << totalBytes << " bytes in " << totalChunks
+              << " chunks (" << chunks.size() << " unique) into " << storeFile << std::endl;
+    return true;
+}
+
+// --- Read the chunk and file tables of a deduplicating store ---
+bool readDedupTables(int fd, std::vector<DedupChunk>& chunks, std::vector<DedupFile>& files) {
+    struct stat st;
+    size_t headerSize = sizeof(DEDUP_MAGIC) + sizeof(uint32_t);
+    if (fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) < headerSize + DEDUP_FOOTER_SIZE) {
+        return false;
+    }
+    uint64_t fileSize = st.st_size;
+
+    std::vector<unsigned char> header;
+    uint32_t version = 0;
+    size_t position = sizeof(DEDUP_MAGIC);
+    if (!readRange(fd, 0, headerSize, header) || std::memcmp(header.data(), DEDUP_MAGIC, sizeof(DEDUP_MAGIC)) != 0 ||
+        !takeValue(header, position, version) || version != DEDUP_VERSION) {
+        return false;
+    }
+
+    std::vector<unsigned char> footer;
+    uint64_t tablesOffset = 0;
+    position = 0;
+    if (!readRange(fd, fileSize - DEDUP_FOOTER_SIZE, DEDUP_FOOTER_SIZE, footer) ||
+        std::memcmp(footer.data() + sizeof(uint64_t), DEDUP_MAGIC, sizeof(DEDUP_MAGIC)) != 0 ||
+        !takeValue(footer, position, tablesOffset) || tablesOffset > fileSize - DEDUP_FOOTER_SIZE) {
+        return false;
+    }
+
+    std::vector<unsigned char> tables;
+    if (!readRange(fd, tablesOffset, fileSize - DEDUP_FOOTER_SIZE - tablesOffset, tables)) {
+        return false;
+    }
+    position = 0;
+    uint32_t chunkCount = 0;
+    if (!takeValue(tables, position, chunkCount)) {
+        return false;
+    }
+    chunks.assign(chunkCount, DedupChunk());
+    for (DedupChunk& chunk : chunks) {
+        if (!takeValue(tables, position, chunk.offset) || !takeValue(tables, position, chunk.compressedSize) ||
+            !takeValue(tables, position, chunk.originalSize) || tables.size() - position < sizeof(chunk.digest.bytes) ||
+            chunk.offset > tablesOffset || chunk.compressedSize > tablesOffset - chunk.offset) {
+            return false;
+        }
+        std::memcpy(chunk.digest.bytes, tables.data() + position, sizeof(chunk.digest.bytes));
+        position += sizeof(chunk.digest.bytes);
+    }
+
+    uint32_t fileCount = 0;
+    if (!takeValue(tables, position, fileCount)) {
+        return false;
+    }
+    files.assign(fileCount, DedupFile());
+    for (DedupFile& file : files) {
+        uint16_t nameLength = 0;
+        uint32_t refCount = 0;
+        if (!takeValue(tables, position, nameLength) || tables.size() - position < nameLength) {
+            return false;
+        }
+        file.name.assign(reinterpret_cast<const char*>(tables.data() + position), nameLength);
+        position += nameLength;
+        if (!takeValue(tables, position, file.size) || !takeValue(tables, position, file.crc) ||
+            !takeValue(tables, position, refCount) || (tables.size() - position) / sizeof(uint32_t) < refCount) {
+            return false;
+        }
+        file.chunks.resize(refCount);
+        for (uint32_t& index : file.chunks) {
+            takeValue(tables, position, index);
+            if (index >= chunkCount) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// --- Restore every file of a deduplicating store below outputDir ---
+bool restoreDedupStore(const std::string& storeFile, const std::string& outputDir, unsigned threads, bool directIO = false) {
+    int fd = open(storeFile.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Error opening " << storeFile << std::endl;
+        return false;
+    }
+    std::vector<DedupChunk> chunks;
+    std::vector<DedupFile> files;
+    if (!readDedupTables(fd, chunks, files)) {
+        std::cerr << "Invalid store " << storeFile << std::endl;
+        close(fd);
+        return false;
+    }
+
+    ExecutorJob job(threads);
+    std::vector<std::future<bool>> results;
+    for (size_t i = 0; i < files.size(); ++i) {
+        const DedupFile& file = files[i];
+        results.push_back(job.submit([fd, &file, &chunks, &outputDir, directIO, i] {
+            TraceBlock block(i);
+            std::vector<unsigned char> data;
+            std::vector<unsigned char> payload;
+            for (uint32_t index : file.chunks) {
+                const DedupChunk& chunk = chunks[index];
+                size_t before = data.size();
+                if (!readRange(fd, chunk.offset, chunk.compressedSize, payload) ||
+                    !decompressBuffer(payload.data(), payload.size(), data) || data.size() - before != chunk.originalSize) {
+                    return false;
+                }
+            }
+            return data.size() == file.size && crc32(data.data(), data.size()) == file.crc &&
+                   writeOutputFile(outputDir, file.name, data, directIO);
+        }));
+    }
+    bool ok = true;
+    for (size_t i = 0; i < results.size(); ++i) {
+        if (!results[i].get()) {
+            std::cerr << "Error restoring " << files[i].name << std::endl;
+            ok = false;
+        }
+    }
+    close(fd);
+    if (ok) {
+        std::cout << "Restored " << files.size() << " file(s) to " << outputDir << std::endl;
+    }
+    return ok;
+}
+
+// --- Delta compression against a reference file ---
+// The reference is indexed by hashing every DELTA_BLOCK-byte block at block-aligned offsets.
+// The target is scanned with a rolling hash of the same window; a hit that verifies becomes a
+// copy from the reference, extended forwards and backwards as far as the bytes agree. Whatever
+// is left becomes literals. Copy/literal commands and the literal bytes are then Huffman coded
+// as two separate streams.
+//
+//   "HFDL" u32 version
+//   u64 reference size, u32 reference CRC-32, u64 target size, u32 target CRC-32
+//   u64 compressed command size, commands (compressBuffer format)
+//   u64 compressed literal size, literals (compressBuffer format)
+//
+// Commands are varints: literal count, copy length, then for non-empty copies the zigzagged
+// distance from the end of the previous copy in the reference (small for in-order edits).
+const char DELTA_MAGIC[4] = {'H', 'F', 'D', 'L'};
+const uint32_t DELTA_VERSION = 1;
+const size_t DELTA_BLOCK = 16;
+const uint64_t DELTA_HASH_MULTIPLIER = 0x100000001B3ull;
+const int DELTA_MAX_INDEX_BITS = 24;
+
+void appendVarint(std::vector<unsigned char>& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<unsigned char>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<unsigned char>(value));
+}
+
+bool takeVarint(const std::vector<unsigned char>& in, size_t& position, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && position < in.size(); shift += 7) {
+        unsigned char byte = in[position++];
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Polynomial hash of DELTA_BLOCK bytes, updatable one byte at a time.
+uint64_t deltaBlockHash(const unsigned char* data) {
+    uint64_t h = 0;
+    for (size_t i = 0; i < DELTA_BLOCK; ++i) {
+        h = h * DELTA_HASH_MULTIPLIER + data[i];
+    }
+    return h;
+}
+
+// Encodes `target` as commands and literals against `reference`.
+void encodeDelta(const std::vector<unsigned char>& reference, const std::vector<unsigned char>& target,
+                 std::vector<unsigned char>& commands, std::vector<unsigned char>& literals) {
+    int indexBits = 10;
+    while (indexBits < DELTA_MAX_INDEX_BITS && (size_t(1) << indexBits) < reference.size() / DELTA_BLOCK) {
+        ++indexBits;
+    }
+    auto bucketOf = [indexBits](uint64_t h) { return static_cast<size_t>((h * 0x9E3779B97F4A7C15ull) >> (64 - indexBits)); };
+
+    // Bucket -> reference offset + 1 (0 = empty). The first block with a given hash wins.
+    std::vector<uint64_t> index(size_t(1) << indexBits, 0);
+    for (size_t offset = 0; offset + DELTA_BLOCK <= reference.size(); offset += DELTA_BLOCK) {
+        uint64_t& slot = index[bucketOf(deltaBlockHash(reference.data() + offset))];
+        if (slot == 0) {
+            slot = offset + 1;
+        }
+    }
+
+    uint64_t outgoingWeight = 1; // DELTA_HASH_MULTIPLIER^(DELTA_BLOCK - 1)
+    for (size_t i = 1; i < DELTA_BLOCK; ++i) {
+        outgoingWeight *= DELTA_HASH_MULTIPLIER;
+    }
+
+    size_t literalStart = 0;
+    uint64_t previousCopyEnd = 0;
+    size_t position = 0;
+    bool hashValid = false;
+    uint64_t h = 0;
+    while (position + DELTA_BLOCK <= target.size()) {
+        if (!hashValid) {
+            h = deltaBlockHash(target.data() + position);
+            hashValid = true;
+        }
+        uint64_t slot = index[bucketOf(h)];
+        if (slot != 0 && std::memcmp(reference.data() + slot - 1, target.data() + position, DELTA_BLOCK) == 0) {
+            size_t source = slot - 1;
+            size_t start = position;
+            size_t length = DELTA_BLOCK;
+            while (source + length < reference.size() && start + length < target.size() &&
+                   reference[source + length] == target[start + length]) {
+                ++length;
+            }
+            while (start > literalStart && source > 0 && reference[source - 1] == target[start - 1]) {
+                --start;
+                --source;
+                ++length;
+            }
+
+            appendVarint(commands, start - literalStart);
+            appendVarint(commands, length);
+            int64_t distance = static_cast<int64_t>(source) - static_cast<int64_t>(previousCopyEnd);
+            appendVarint(commands, (static_cast<uint64_t>(distance) << 1) ^ static_cast<uint64_t>(distance >> 63));
+            literals.insert(literals.end(), target.begin() + literalStart, target.begin() + start);
+
+            previousCopyEnd = source + length;
+            position = start + length;
+            literalStart = position;
+            hashValid = false;
+            continue;
+        }
+        if (position + DELTA_BLOCK < target.size()) {
+            h = (h - target[position] * outgoingWeight) * DELTA_HASH_MULTIPLIER + target[position + DELTA_BLOCK];
+        }
+        ++position;
+    }
+
+    if (literalStart < target.size()) {
+        appendVarint(commands, target.size() - literalStart);
+        appendVarint(commands, 0);
+        literals.insert(literals.end(), target.begin() + literalStart, target.end());
+    }
+}
+
+// Rebuilds the target from `reference`, the commands and the literals.
+bool decodeDelta(const std::vector<unsigned char>& reference, const std::vector<unsigned char>& commands,
+                 const std::vector<unsigned char>& literals, std::vector<unsigned char>& target) {
+    size_t position = 0;
+    size_t literalPosition = 0;
+    uint64_t previousCopyEnd = 0;
+    while (position < commands.size()) {
+        uint64_t literalCount, copyLength;
+        if (!takeVarint(commands, position, literalCount) || !takeVarint(commands, position, copyLength) ||
+            literalCount > literals.size() - literalPosition) {
+            return false;
+        }
+        target.insert(target.end(), literals.begin() + literalPosition, literals.begin() + literalPosition + literalCount);
+        literalPosition += literalCount;
+        if (copyLength == 0) {
+            continue;
+        }
+        uint64_t zigzag;
+        if (!takeVarint(commands, position, zigzag)) {
+            return false;
+        }
+        uint64_t source = previousCopyEnd + static_cast<uint64_t>(static_cast<int64_t>(zigzag >> 1) ^ -static_cast<int64_t>(zigzag & 1));
+        if (source > reference.size() || copyLength > reference.size() - source) {
+            return false;
+        }
+        target.insert(target.end(), reference.begin() + source, reference.begin() + source + copyLength);
+        previousCopyEnd = source + copyLength;
+    }
+    return literalPosition == literals.size();
+}
+
+// --- Write a delta of inputFile against referenceFile ---
+bool createDelta(const std::string& referenceFile, const std::string& inputFile, const std::string& outputFile, bool directIO = false) {
+    std::vector<unsigned char> reference;
+    std::vector<unsigned char> target;
+    if (!readWholeFile(referenceFile, reference, directIO) || !readWholeFile(inputFile, target, directIO)) {
+        std::cerr << "Error reading " << referenceFile << " or " << inputFile << std::endl;
+        return false;
+    }
+
+    std::vector<unsigned char> commands;
+    std::vector<unsigned char> literals;
+    encodeDelta(reference, target, commands, literals);
+
+    std::vector<unsigned char> output(DELTA_MAGIC, DELTA_MAGIC + sizeof(DELTA_MAGIC));
+    appendValue(output, DELTA_VERSION);
+    appendValue<uint64_t>(output, reference.size());
+    appendValue(output, crc32(reference.data(), reference.size()));
+    appendValue<uint64_t>(output, target.size());
+    appendValue(output, crc32(target.data(), target.size()));
+    for (const std::vector<unsigned char>* stream : {&commands, &literals}) {
+        std::vector<unsigned char> payload;
+        compressBuffer(*stream, payload);
+        appendValue<uint64_t>(output, payload.size());
+        output.insert(output.end(), payload.begin(), payload.end());
+    }
+
+    BlockWriter ofs;
+    if (!ofs.open(outputFile, directIO)) {
+        std::cerr << "Error opening " << outputFile << std::endl;
+        return false;
+    }
+    ofs.write(output.data(), output.size());
+    if (!ofs.close()) {
+        std::cerr << "Error writing " << outputFile << std::endl;
+        return false;
+    }
+    std::cout << "Delta of " << target.size() << " bytes: " << literals.size() << " literal bytes, "
+              << output.size() << " bytes written." << std::endl;
+    return true;
+}
+
+// --- Rebuild a file from its reference and a delta ---
+bool applyDelta(const std::string& referenceFile, const std::string& deltaFile, const std::string& outputFile, bool directIO = false) {
+    std::vector<unsigned char> reference;
+    std::vector<unsigned char> delta;
+    if (!readWholeFile(referenceFile, reference, directIO) || !readWholeFile(deltaFile, delta, directIO)) {
+        std::cerr << "Error reading " << referenceFile << " or " << deltaFile << std::endl;
+        return false;
+    }
+
+    size_t position = sizeof(DELTA_MAGIC);
+    uint32_t version = 0, referenceCrc = 0, targetCrc = 0;
+    uint64_t referenceSize = 0, targetSize = 0;
+    if (delta.size() < sizeof(DELTA_MAGIC) || std::memcmp(delta.data(), DELTA_MAGIC, sizeof(DELTA_MAGIC)) != 0 ||
+        !takeValue(delta, position, version) || version != DELTA_VERSION || !takeValue(delta, position, referenceSize) ||
+        !takeValue(delta, position, referenceCrc) || !takeValue(delta, position, targetSize) || !takeValue(delta, position, targetCrc)) {
+        std::cerr << "Invalid delta " << deltaFile << std::endl;
+        return false;
+    }
+    if (referenceSize != reference.size() || referenceCrc != crc32(reference.data(), reference.size())) {
+        std::cerr << referenceFile << " is not the reference this delta was made against." << std::endl;
+        return false;
+    }
+
+    std::vector<unsigned char> streams[2];
+    for (std::vector<unsigned char>& stream : streams) {
+        uint64_t payloadSize = 0;
+        if (!takeValue(delta, position, payloadSize) || payloadSize > delta.size() - position ||
+            !decompressBuffer(delta.data() + position, payloadSize, stream)) {
+            std::cerr << "Corrupt delta " << deltaFile << std::endl;
+            return false;
+        }
+        position += payloadSize;
+    }
+
+    std::vector<unsigned char> target;
+    if (!decodeDelta(reference, streams[0], streams[1], target) || target.size() != targetSize ||
+        crc32(target.data(), target.size()) != targetCrc) {
+        std::cerr << "Corrupt delta " << deltaFile << std::endl;
+        return false;
+    }
+
+    BlockWriter ofs;
+    if (!ofs.open(outputFile, directIO)) {
+        std::cerr << "Error opening " << outputFile << std::endl;
+        return false;
+    }
+    ofs.write(target.data(), target.size());
+    if (!ofs.close()) {
+        std::cerr << "Error writing " << outputFile << std::endl;
+        return false;
+    }
+    std::cout << "File rebuilt from delta." << std::endl;
+    return true;
+}
+
+// --- Hardware performance counters (perf_event_open) ---
+// Counts user-space events of the calling thread. Each counter is opened on its own so that an
+// event the CPU (or VM) doesn't expose only drops that column; readings are scaled when the
+// kernel had to multiplex counters.
+enum PerfEvent { PERF_CYCLES, PERF_INSTRUCTIONS, PERF_BRANCH_MISSES, PERF_L1D_MISSES, PERF_LLC_MISSES, PERF_EVENT_COUNT_ };
+
+const char* const PERF_EVENT_NAMES[PERF_EVENT_COUNT_] = {"cycles", "instructions", "branch_misses", "l1d_misses", "llc_misses"};
+
+struct PerfReading {
+    bool valid[PERF_EVENT_COUNT_] = {};
+    double value[PERF_EVENT_COUNT_] = {};
+};
+
+class PerfCounters {
+public:
+    PerfCounters() {
+        for (int& fd : fds_) {
+            fd = -1;
+        }
+    }
+
+    ~PerfCounters() {
+        for (int fd : fds_) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    // Opens whatever counters are available; false if none are.
+    bool open() {
+        const uint32_t types[PERF_EVENT_COUNT_] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+                                                   PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE};
+        const uint64_t configs[PERF_EVENT_COUNT_] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_BRANCH_MISSES,
+            PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+            PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)};
+        bool any = false;
+        for (int i = 0; i < PERF_EVENT_COUNT_; ++i) {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = types[i];
+            attr.config = configs[i];
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            fds_[i] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+            any = any || fds_[i] >= 0;
+        }
+        return any;
+    }
+
+    void start() {
+        for (int fd : fds_) {
+            if (fd >= 0) {
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+    }
+
+    PerfReading stop() {
+        PerfReading reading;
+        for (int i = 0; i < PERF_EVENT_COUNT_; ++i) {
+            if (fds_[i] < 0) {
+                continue;
+            }
+            ioctl(fds_[i], PERF_EVENT_IOC_DISABLE, 0);
+            uint64_t values[3]; // value, time enabled, time running
+            if (::read(fds_[i], values, sizeof(values)) == sizeof(values) && values[2] > 0) {
+                reading.valid[i] = true;
+                reading.value[i] = static_cast<double>(values[0]) * values[1] / values[2];
+            }
+        }
+        return reading;
+    }
+
+private:
+    int fds_[PERF_EVENT_COUNT_];
+};
+
+// --- Global allocation counter ---
+// Replaces the global operator new so bench can check that the codec allocates nothing per block
+// once its context exists. The count is a relaxed atomic increment per allocation. The aligned
+// overloads are replaced too: std::pmr::new_delete_resource allocates through them without going
+// through the plain one.
+std::atomic<uint64_t> globalAllocationCount{0};
+
+[[gnu::noinline]] void* operator new(std::size_t size) {
+    globalAllocationCount.fetch_add(1, std::memory_order_relaxed);
+    if (void* memory = std::malloc(size ? size : 1)) {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void* operator new(std::size_t size, std::align_val_t alignment) {
+    globalAllocationCount.fetch_add(1, std::memory_order_relaxed);
+    void* memory = nullptr;
+    if (posix_memalign(&memory, std::max(static_cast<size_t>(alignment), sizeof(void*)), size ? size : 1) == 0) {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+// Kept out of line: once inlined, GCC pairs malloc/free with the caller's new/delete and warns.
+[[gnu::noinline]] void operator delete(void* memory) noexcept {
+    std::free(memory);
+}
+
+[[gnu::noinline]] void operator delete(void* memory, std::size_t) noexcept {
+    std::free(memory);
+}
+
+[[gnu::noinline]] void operator delete(void* memory, std::align_val_t) noexcept {
+    std::free(memory);
+}
+
+[[gnu::noinline]] void operator delete(void* memory, std::size_t, std::align_val_t) noexcept {
+    std::free(memory);
+}
+
+// --- Benchmark the in-memory encode and decode kernels on a file ---
+// Each kernel is repeated for at least half a second on one HuffmanContext, with all buffers
+// drawn from a pmr pool. Encoding reuses one code table so that only the encoding loop is
+// measured; decoding includes rebuilding the tree from the header. The blocks kernel codes and
+// decodes every block on reused slots as the block pipeline does. Every kernel must run without
+// allocating after its warm-up; bench fails otherwise. With perf counters the report adds IPC
+// and per-byte cache and branch misses. With huge pages the kernels run a second time with the
+// input, output and codec tables on a HugePageResource, and the report compares the two.
+bool runBenchmark(const std::string& inputFile, bool usePerf, bool hugePages) {
+    std::vector<unsigned char> fileData;
+    if (!readWholeFile(inputFile, fileData)) {
+        std::cerr << "Error reading " << inputFile << std::endl;
+        return false;
+    }
+
+    PerfCounters perf;
+    if (usePerf && !perf.open()) {
+        std::cerr << "Hardware counters unavailable (perf_event_open failed: " << std::strerror(errno)
+                  << "); reporting throughput only." << std::endl;
+        usePerf = false;
+    }
+
+    const size_t inputSize = fileData.size();
+    // Kernels draw their memory through `counted`, which counts every pmr allocation even when the
+    // pool under it recycles memory; anything else shows up in the global count.
+    auto measure = [&](const std::string& name, const std::function<bool()>& kernel, double& throughput, const TrackingResource& counted) {
+        if (!kernel()) { // Warm-up run, also validates the round trip
+            return false;
+        }
+        uint64_t iterations = 0;
+        auto start = std::chrono::steady_clock::now();
+        double seconds = 0;
+        if (usePerf) {
+            perf.start();
+        }
+        uint64_t allocationsBefore = globalAllocationCount.load() + counted.allocations();
+        do {
+            kernel();
+            ++iterations;
+            seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        } while (seconds < 0.5);
+        uint64_t allocations = globalAllocationCount.load() + counted.allocations() - allocationsBefore;
+        PerfReading reading = usePerf ? perf.stop() : PerfReading();
+
+        double bytes = static_cast<double>(inputSize) * iterations;
+        throughput = bytes / seconds / 1e6;
+        std::cout << name << ": " << throughput << " MB/s over " << iterations << " iteration(s), "
+                  << static_cast<double>(allocations) / iterations << " allocations/iteration";
+        if (reading.valid[PERF_CYCLES] && reading.valid[PERF_INSTRUCTIONS] && reading.value[PERF_CYCLES] > 0) {
+            std::cout << ", IPC " << reading.value[PERF_INSTRUCTIONS] / reading.value[PERF_CYCLES];
+        }
+        for (int i = 0; i < PERF_EVENT_COUNT_; ++i) {
+            if (reading.valid[i] && bytes > 0) {
+                std::cout << ", " << PERF_EVENT_NAMES[i] << "/byte " << reading.value[i] / bytes;
+            }
+        }
+        std::cout << std::endl;
+        if (allocations > 0) {
+            std::cerr << name << " allocated " << allocations << " time(s) in steady state." << std::endl;
+            return false;
+        }
+        return true;
+    };
+
+    // Runs the kernels with every buffer and the context drawn from `resource`.
+    const int KERNEL_COUNT = 4;
+    auto runKernels = [&](const std::string& suffix, std::pmr::memory_resource* resource, double* throughput) {
+        std::pmr::unsynchronized_pool_resource pool(resource);
+        TrackingResource counted(&pool);
+        std::pmr::vector<unsigned char> input(fileData.begin(), fileData.end(), resource);
+        HuffmanContext context(&counted);
+        uint64_t frequencies[256] = {};
+        for (unsigned char ch : input) {
+            frequencies[ch]++;
+        }
+        CodeTable table;
+        context.buildCodes(frequencies, table);
+
+        std::pmr::vector<unsigned char> compressed(resource);
+        std::pmr::vector<unsigned char> decompressed(resource);
+        compressed.reserve(blockOutputCapacity(input.size()));
+        decompressed.reserve(input.size());
+
+        bool ok = measure("encode" + suffix, [&] {
+            compressed.clear();
+            MemoryReader in(input.data(), input.size());
+            MemoryWriter out(compressed);
+            encodeStream(in, out, table);
+            return true;
+        }, throughput[0], counted);
+        if (ok && pairTableProfitable(table, input.size())) {
+            auto pairs = std::make_unique<PairCodeTable>();
+            buildPairTable(table, *pairs);
+            double pairThroughput = 0;
+            ok = measure("encode, pair table" + suffix, [&] {
+                compressed.clear();
+                MemoryReader in(input.data(), input.size());
+                MemoryWriter out(compressed);
+                encodeStream(in, out, table, pairs.get());
+                return true;
+            }, pairThroughput, counted);
+        }
+        ok = ok && measure("decode" + suffix, [&] {
+            decompressed.clear();
+            MemoryReader in(compressed.data(), compressed.size());
+            MemoryWriter out(decompressed);
+            return context.decompress(in, out) && std::equal(decompressed.begin(), decompressed.end(), input.begin(), input.end());
+        }, throughput[1], counted);
+        ok = ok && measure("compress" + suffix, [&] {
+            compressed.clear();
+            MemoryWriter out(compressed);
+            context.compress(input.data(), input.size(), out);
+            return true;
+        }, throughput[2], counted);
+
+        // encodeBlock and decodeBlock with LZ, the automatic filter, word coding and summaries
+        // on, so every context a slot allocates on its first use has to be reused afterwards.
+        CompressionOptions blockOptions;
+        blockOptions.level = MIN_LZ_LEVEL;
+        blockOptions.filter = FILTER_AUTO;
+        blockOptions.words = true;
+        blockOptions.summaries = true;
+        size_t blockSize = std::min(DEFAULT_BLOCK_SIZE, std::max<size_t>(input.size(), 1));
+        BlockSlot encodeSlot(&counted, blockSize, blockOutputCapacity(blockSize));
+        BlockSlot decodeSlot(&counted, blockOutputCapacity(blockSize), blockSize);
+        ok = ok && measure("blocks" + suffix, [&] {
+            for (size_t start = 0, index = 0; start < input.size(); start += blockSize, ++index) {
+                size_t size = std::min(blockSize, input.size() - start);
+                encodeSlot.index = decodeSlot.index = index;
+                encodeSlot.rawSize = decodeSlot.rawSize = size;
+                encodeSlot.input.assign(input.begin() + start, input.begin() + start + size);
+                encodeBlock(encodeSlot, blockOptions, true);
+                const std::pmr::vector<unsigned char>& stored = encodeSlot.method == BLOCK_STORED ? encodeSlot.input : encodeSlot.output;
+                decodeSlot.input.assign(stored.begin(), stored.end());
+                decodeSlot.method = encodeSlot.method;
+                decodeSlot.crc = encodeSlot.crc;
+                if (!decodeBlock(decodeSlot, size, true)) {
+                    return false;
+                }
+                const std::pmr::vector<unsigned char>& decoded = decodeSlot.method == BLOCK_STORED ? decodeSlot.input : decodeSlot.output;
+                if (!std::equal(decoded.begin(), decoded.end(), input.begin() + start, input.begin() + start + size)) {
+                    return false;
+                }
+            }
+            return true;
+        }, throughput[3], counted);
+        if (ok) {
+            std::cout << "ratio" << suffix << ": " << (input.empty() ? 0.0 : static_cast<double>(compressed.size()) / input.size()) << std::endl;
+        }
+        return ok;
+    };
+
+    std::cout << "Benchmarking " << inputFile << " (" << inputSize << " bytes)" << std::endl;
+    double regular[KERNEL_COUNT] = {};
+    double huge[KERNEL_COUNT] = {};
+    bool ok = runKernels("", std::pmr::get_default_resource(), regular);
+    if (ok && hugePages) {
+        HugePageResource hugePageResource;
+        ok = runKernels(" (huge pages)", &hugePageResource, huge);
+        const char* const names[KERNEL_COUNT] = {"encode", "decode", "compress", "blocks"};
+        for (int i = 0; ok && i < KERNEL_COUNT; ++i) {
+            std::cout << names[i] << " speedup with huge pages: " << (regular[i] > 0 ? huge[i] / regular[i] : 0.0) << "x" << std::endl;
+        }
+        const CodecStats& stats = codecStats();
+        std::cout << "huge pages: " << stats.counters[COUNTER_HUGE_PAGE_BYTES] / 1024 << " KiB MAP_HUGETLB, "
+                  << stats.counters[COUNTER_THP_ADVISED_BYTES] / 1024 << " KiB transparent (madvise)" << std::endl;
+    }
+    if (!ok) {
+        std::cerr << "Benchmark failed for " << inputFile << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// --- Original demonstration: compress and decompress a generated sample ---
+int runDemo(bool directIO) {
+    std::string inputFileName = "input.txt";
+    std::string compressedFileName = "compressed.bin";
+    std::string decompressedFileName = "decompressed.txt";
+
+    // Create a dummy input file for testing
+    std::ofstream testInput(inputFileName);
+    if (testInput.is_open()) {
+        testInput << "this is a test string for huffman coding. a simple test to see if it works.";
+        testInput.close();
+        std::cout << "Created " << inputFileName << std::endl;
+    } else {
+        std::cerr << "Error creating input.txt" << std::endl;
+        return 1;
+    }
+
+    // --- Step 1: Calculate character frequencies ---
+    std::map<char, int> frequencies;
+    if (!countFrequencies(inputFileName, frequencies, directIO)) {
+        return 1;
+    }
+
+    // --- Step 2: Build Huffman Tree ---
+    Node* huffmanRoot = buildHuffmanTree(frequencies);
+
+    // --- Step 3: Generate Huffman Codes ---
+    {
+        StageTimer timer(STAGE_GENERATE_CODES);
+        countStat(COUNTER_CODE_TABLES, 1);
+        generateCodes(huffmanRoot, "");
+    }
+
+    std::cout << "\nHuffman Codes:" << std::endl;
+    for (auto const& [character, code] : huffmanCodes) {
+        if (character == '\n') {
+            std::cout << "'\\n': " << code << std::endl;
+        } else if (character == ' ') {
+            std::cout << "' ': " << code << std::endl;
+        } else {
+            std::cout << "'" << character << "': " << code << std::endl;
+        }
+    }
+
+    // --- Step 4: Compress the file ---
+    CompressionOptions options;
+    options.directIO = directIO;
+    compressFile(inputFileName, compressedFileName, options);
+
+    // --- Step 5: Decompress the file ---
+    decompressFile(compressedFileName, decompressedFileName, options);
+
+    // Clean up the Huffman tree
+    delete huffmanRoot;
+
+    return 0;
+}
+
+void printUsage(const char* program) {
+    std::cerr << "Usage:\n"
+              << "  " << program << " [options]                               run the demo\n"
+              << "  " << program << " [options] compress <input> <output>\n"
+              << "  " << program << " [options] decompress <input> <output>\n"
+              << "  " << program << " [options] search <pattern> <input>\n"
+              << "  " << program << " summary <input>\n"
+              << "  " << program << " [options] archive <dir|file> <archive>\n"
+              << "  " << program << " [options] extract <archive> <output dir> [entry]\n"
+              << "  " << program << " list <archive>\n"
+              << "  " << program << " [options] dedup <dir|file> <store>\n"
+              << "  " << program << " [options] undedup <store> <output dir>\n"
+              << "  " << program << " [options] delta <reference> <input> <output>\n"
+              << "  " << program << " [--perf] [--huge-pages] bench <input>\n"
+              << "  " << program << " [options] undelta <reference> <delta> <output>\n"
+              << "Options:\n"
+              << "  --direct-io     bypass the page cache with O_DIRECT\n"
+              << "  --stats=json    print per-stage timings and counters to stderr (or --stats=text)\n"
+              << "  --trace=FILE    record a Chrome trace / Perfetto timeline of the pipeline to FILE\n"
+              << "  --perf          read hardware performance counters in bench\n"
+              << "  --threads=N     worker threads (default: all cores)\n"
+              << "  --level=N       1 = Huffman only (default), 2-6 LZ + Huffman, 7-9 optimal-parse LZ\n"
+              << "  --filter=NAME   transform blocks before coding: auto (per block), columns, csv, tsv,\n"
+              << "                  shuffle[2|4|8], delta[2|4|8], xor[4|8], x86, base64, hex, encoded,\n"
+              << "                  samples\n"
+              << "  --words         also code each block as words and separators; kept if smaller\n"
+              << "  --summaries     store byte histograms and line statistics of every block, for summary\n"
+              << "  --recover       decompress: write damaged blocks as zeros and restore the rest\n"
+              << "  --long[=SIZE]   also match repeats far apart in the input, with a SIZE hash table\n"
+              << "                  (default 64M)\n"
+              << "  --numa          pin workers to NUMA nodes and keep block buffers node-local\n"
+              << "  --huge-pages    back block buffers and codec tables with 2 MiB pages (compress,\n"
+              << "                  decompress, bench)\n"
+              << "  --memory=SIZE   bound compress/decompress working memory, e.g. 64M; picks block\n"
+              << "                  size, blocks in flight and threads to fit and reports the peak\n";
+}
+
+// --- Main function ---
+int main(int argc, char* argv[]) {
+    // --direct-io streams files with O_DIRECT so bulk runs don't evict the page cache.
+    bool directIO = false;
+    std::string statsFormat; // "json" or "text" to print codec statistics on exit
+    std::string tracePath;   // Chrome trace JSON output, if requested
+    bool usePerf = false;    // Hardware counters in the benchmark
+    bool hugePages = false;  // Huge-page backed buffers and tables
+    bool numa = false;       // NUMA-pinned workers for compress/decompress
+    int level = DEFAULT_LEVEL;
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    uint64_t memoryBudget = 0; // --memory: bound on compress/decompress working memory
+    uint64_t longMatchTable = 0; // --long: long-distance match table size
+    BlockFilter filter = FILTER_NONE;
+    uint8_t filterParameter = 0;
+    bool words = false; // --words: also try word-based coding
+    bool summaries = false; // --summaries: store block summaries
+    bool recover = false;   // --recover: decompress around damaged blocks
+    std::vector<std::string> blockOnly; // Given options only the block engine honours
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--direct-io") {
+            directIO = true;
+        } else if (arg == "--stats=json" || arg == "--stats=text") {
+            statsFormat = arg.substr(8);
+        } else if (arg.rfind("--trace=", 0) == 0 && arg.size() > 8) {
+            tracePath = arg.substr(8);
+            traceEnabled = true;
+        } else if (arg == "--perf") {
+            usePerf = true;
+        } else if (arg == "--huge-pages") {
+            hugePages = true;
+        } else if (arg.rfind("--level=", 0) == 0) {
+            level = std::atoi(arg.c_str() + 8);
+            blockOnly.push_back(arg);
+        } else if (arg == "--numa") {
+            numa = true;
+        } else if (arg.rfind("--threads=", 0) == 0) {
+            threads = std::max(1, std::atoi(arg.c_str() + 10));
+        } else if (arg.rfind("--memory=", 0) == 0 && parseSize(arg.substr(9), memoryBudget)) {
+            blockOnly.push_back(arg);
+        } else if (arg.rfind("--filter=", 0) == 0 && parseFilter(arg.substr(9), filter, filterParameter)) {
+            blockOnly.push_back(arg);
+        } else if (arg == "--words") {
+            words = true;
+            blockOnly.push_back(arg);
+        } else if (arg == "--summaries") {
+            summaries = true;
+        } else if (arg == "--recover") {
+            recover = true;
+        } else if (arg == "--long") {
+            longMatchTable = DEFAULT_LONG_MATCH_TABLE;
+        } else if (arg.rfind("--long=", 0) == 0 && parseSize(arg.substr(7), longMatchTable) && longMatchTable > 0) {
+        } else if (arg.rfind("--", 0) == 0) {
+            printUsage(argv[0]);
+            return 1;
+        } else {
+            args.push_back(arg);
+        }
+    }
+
+    resetCodecStats();
+    setTraceThreadName("main");
+    if (args.empty()) {
+        int status = runDemo(directIO);
+        if (!statsFormat.empty()) {
+            printCodecStats(std::cerr, statsFormat == "json");
+        }
+        if (!tracePath.empty() && !exportTrace(tracePath)) {
+            std::cerr << "Error writing trace " << tracePath << std::endl;
+        }
+        return status;
+    }
+
+    CompressionOptions options;
+    options.directIO = directIO;
+    options.threads = threads;
+    options.memoryBudget = memoryBudget;
+    options.hugePages = hugePages;
+    options.level = level;
+    options.longMatchTable = longMatchTable;
+    options.filter = filter;
+    options.filterParameter = filterParameter;
+    options.words = words;
+    options.summaries = summaries;
+    options.recover = recover;
+    executorSettings().threads = threads;
+    executorSettings().numaAware = numa;
+
+    const std::string& command = args[0];
+    // Archives, dedup stores and deltas load each file whole and code it with the plain Huffman
+    // codec, so they would silently ignore these options; refuse them instead.
+    if (!blockOnly.empty() && command != "compress" && command != "decompress" && command != "search") {
+        std::cerr << command << " doesn't support " << blockOnly.front() << "; only compress, decompress and search do." << std::endl;
+        return 1;
+    }
+    bool ok;
+    if (command == "compress" && args.size() == 3) {
+        ok = compressFile(args[1], args[2], options);
+    } else if (command == "decompress" && args.size() == 3) {
+        ok = decompressFile(args[1], args[2], options);
+    } else if (command == "search" && args.size() == 3) {
+        ok = searchFile(args[1], args[2], options);
+    } else if (command == "summary" && args.size() == 2) {
+        ok = summarizeFile(args[1]);
+    } else if (command == "archive" && args.size() == 3) {
+        ok = createArchive(args[1], args[2], threads, directIO);
+    } else if (command == "extract" && (args.size() == 3 || args.size() == 4)) {
+        ok = extractArchive(args[1], args[2], args.size() == 4 ? args[3] : "", threads, directIO);
+    } else if (command == "list" && args.size() == 2) {
+        ok = listArchive(args[1]);
+    } else if (command == "dedup" && args.size() == 3) {
+        ok = createDedupStore(args[1], args[2], threads, directIO);
+    } else if (command == "undedup" && args.size() == 3) {
+        ok = restoreDedupStore(args[1], args[2], threads, directIO);
+    } else if (command == "bench" && args.size() == 2) {
+        ok = runBenchmark(args[1], usePerf, hugePages);
+    } else if (command == "delta" && args.size() == 4) {
+        ok = createDelta(args[1], args[2], args[3], directIO);
+    } else if (command == "undelta" && args.size() == 4) {
+        ok = applyDelta(args[1], args[2], args[3], directIO);
+    } else {
+        printUsage(argv[0]);
+        return 1;
+    }
+    if (!statsFormat.empty()) {
+        printCodecStats(std::cerr, statsFormat == "json");
+    }
+    if (!tracePath.empty() && !exportTrace(tracePath)) {
+        std::cerr << "Error writing trace " << tracePath << std::endl;
+        ok = false;
+    }
+    return ok ? 0 : 1;
 }